@@ -34,6 +34,6 @@ int main()
     push_to_display(&window);
 
     update_display(&window);
-    wait(3000);
+    wait_ms(3000);
     free_display(&window);
 }
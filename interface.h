@@ -5,6 +5,8 @@
 */
 
 #include <SDL2/SDL.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <errno.h>
 
 /* Game display */
@@ -50,12 +52,15 @@ void create_display(Display * disp, const char * window_title, size_t width, siz
     disp->width     = width; 
     disp->height    = height;
 
-    /* Set surface, texture, colordepth */
+    /* 
+    Set surface, texture, colordepth. The texture lives as long as the display, every frame 
+    is streamed into it (see push_frame_to_display()), the surface is only there to draw on 
+    with the write_* functions.
+    */
     disp->surface   = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
-    disp->texture   = SDL_CreateTextureFromSurface(disp->renderer, disp->surface);
+    disp->texture   = SDL_CreateTexture(disp->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
 
-    /* Set render target and draw color (black) */
-    SDL_SetRenderTarget(disp->renderer, disp->texture);
+    /* Set draw color (black) */
     SDL_SetRenderDrawColor(disp->renderer, 0, 0, 0, 0xFF);
 
     /* Get pitch */
@@ -90,11 +95,24 @@ void write_ARGB8888_arr_to_display(Display * disp, size_t x, size_t y, uint32_t
 
 }
 
+/* Push a whole frame ('pitch' bytes per row) to display, it is copied once, straight into the texture */
+void push_frame_to_display(Display * disp, const uint32_t * frame, size_t pitch)
+{
+    SDL_UpdateTexture(disp->texture, NULL, frame, pitch);
+    SDL_RenderCopy(disp->renderer, disp->texture, NULL, NULL);
+}
+
 /* Push any changes to display */
 void push_to_display(Display * disp)
 {
-    disp->texture = SDL_CreateTextureFromSurface(disp->renderer, disp->surface);
-    SDL_RenderCopy(disp->renderer, disp->texture, NULL, NULL);
+    push_frame_to_display(disp, (const uint32_t *) disp->surface->pixels, disp->pitch);
+}
+
+/* Wait for the vertical retrace of the screen before every update, to pace frames with it */
+void set_display_vsync(Display * disp, bool on)
+{
+    if (SDL_RenderSetVSync(disp->renderer, on) != 0)
+        fprintf(stderr, "error: Failed to set vsync: %s.\n", SDL_GetError());
 }
 
 /* Update display */
@@ -115,6 +133,536 @@ void free_display(Display * disp)
     SDL_DestroyWindow(disp->window);
 }
 
+/* 
+Triple buffer, hands whole frames from one thread to another without either of them waiting: 
+the producer draws into the back buffer and swaps it with the middle one, the consumer swaps 
+the middle one with its front buffer whenever a new frame is in there. A frame is either 
+shown or replaced by a newer one, so at most one frame of latency is added.
+*/
+#define FRAME_MAILBOX_NEW   0x4             /* Flag on 'middle', it holds a frame the consumer hasn't seen */
+
+typedef struct Frame_mailbox
+{
+    uint32_t    * buffer[3];
+    size_t      width, height;
+    int         back, front;                /* Owned by the producer and the consumer */
+    atomic_int  middle;
+    SDL_sem     * posted;                   /* Posted for every new frame */
+}
+Frame_mailbox;
+
+/* Allocate the 3 frames of 'width' x 'height' pixels */
+bool init_frame_mailbox(Frame_mailbox * mb, size_t width, size_t height)
+{
+    mb->width   = width;
+    mb->height  = height;
+    mb->back    = 0;
+    mb->front   = 1;
+    atomic_store(&mb->middle, 2);
+
+    mb->posted  = SDL_CreateSemaphore(0);
+    for (size_t i = 0; i < 3; i++)
+        mb->buffer[i] = calloc(width * height, sizeof(uint32_t));
+
+    if (mb->posted == NULL || !mb->buffer[0] || !mb->buffer[1] || !mb->buffer[2])
+    {
+        fprintf(stderr, "error: Failed to allocate frame buffers: %s.\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+/* Frame for the producer to draw into */
+uint32_t * frame_mailbox_back(Frame_mailbox * mb)
+{
+    return mb->buffer[mb->back];
+}
+
+/* Hand the back buffer over to the consumer */
+void frame_mailbox_post(Frame_mailbox * mb)
+{
+    mb->back = atomic_exchange_explicit(&mb->middle, mb->back | FRAME_MAILBOX_NEW, memory_order_acq_rel) & 0x3;
+    SDL_SemPost(mb->posted);
+}
+
+/* Wake up a consumer waiting for a frame, without one */
+void frame_mailbox_wake(Frame_mailbox * mb)
+{
+    SDL_SemPost(mb->posted);
+}
+
+/* Newest frame, if there is one the consumer hasn't seen yet (waits up to 'timeout' msec for it) */
+const uint32_t * frame_mailbox_take(Frame_mailbox * mb, uint32_t timeout)
+{
+    if (!(atomic_load_explicit(&mb->middle, memory_order_relaxed) & FRAME_MAILBOX_NEW))
+        SDL_SemWaitTimeout(mb->posted, timeout);
+
+    if (!(atomic_load_explicit(&mb->middle, memory_order_relaxed) & FRAME_MAILBOX_NEW))
+        return NULL;
+
+    mb->front = atomic_exchange_explicit(&mb->middle, mb->front, memory_order_acq_rel) & 0x3;
+    return mb->buffer[mb->front];
+}
+
+void free_frame_mailbox(Frame_mailbox * mb)
+{
+    for (size_t i = 0; i < 3; i++)
+        free(mb->buffer[i]);
+    SDL_DestroySemaphore(mb->posted);
+}
+
+/* Frame time statistics, in microseconds */
+typedef struct Frame_stats
+{
+    const char  * name;
+    uint64_t    last;                       /* Performance counter at the last frame */
+    uint32_t    frames;
+    uint64_t    sum, sum_sq, min, max;
+}
+Frame_stats;
+
+void frame_stats_reset(Frame_stats * st)
+{
+    st->frames  = 0;
+    st->sum     = st->sum_sq = st->max = 0;
+    st->min     = UINT64_MAX;
+}
+
+/* Count a frame, timed from the one before */
+void frame_stats_tick(Frame_stats * st)
+{
+    uint64_t now = SDL_GetPerformanceCounter(),
+             us  = st->last ? (now - st->last) * 1000000 / SDL_GetPerformanceFrequency() : 0;
+
+    if (st->last)
+    {
+        st->frames++;
+        st->sum    += us;
+        st->sum_sq += us * us;
+        st->min     = us < st->min ? us : st->min;
+        st->max     = us > st->max ? us : st->max;
+    }
+    st->last = now;
+}
+
+/* Print the average frame time, its range and jitter (standard deviation) followed by 'extra', then reset */
+void frame_stats_report(Frame_stats * st, const char * extra)
+{
+    if (st->frames == 0)
+        return;
+
+    uint64_t mean   = st->sum / st->frames,
+             var    = st->sum_sq / st->frames - mean * mean,
+             sd     = var;
+
+    /* Integer square root (Newton's method) */
+    for (uint64_t next = (sd + 1) / 2; next < sd; next = (sd + var / sd) / 2)
+        sd = next;
+
+    fprintf(stderr, "%s: %u frames, %llu.%03llu ms avg (%llu.%03llu - %llu.%03llu), jitter %llu us%s\n",
+            st->name, st->frames,
+            (unsigned long long)(mean / 1000), (unsigned long long)(mean % 1000),
+            (unsigned long long)(st->min / 1000), (unsigned long long)(st->min % 1000),
+            (unsigned long long)(st->max / 1000), (unsigned long long)(st->max % 1000),
+            (unsigned long long) sd, extra);
+
+    frame_stats_reset(st);
+}
+
+/* 
+Audio output. SDL pulls samples from its own thread through audio_callback(), they come from 
+a lock-free ring (one producer, one consumer) the emulation pushes a frame's worth into at a 
+time. The sound card's clock and the one the emulation is paced by never quite agree, so the 
+producer nudges the sample rate it makes samples at (by up to AUDIO_MAX_PPM) to keep the ring 
+at its target fill: too full and fewer samples are made per frame, too empty and more are. 
+The fill is taken half a frame after each push, about what it is on average until the next.
+*/
+#define AUDIO_MAX_PPM       5000            /* Largest rate correction, +-0.5% */
+#define AUDIO_FILL_SMOOTH   32              /* Frames the fill is averaged over (exponentially) */
+#define AUDIO_DRIFT_FRAMES  600             /* Frames the integral term takes to make up a full target of error */
+#define AUDIO_MIN_LATENCY   20              /* Msec */
+
+typedef struct Audio
+{
+    SDL_AudioDeviceID   device;
+    int                 rate;               /* Samples per second of the device */
+    uint32_t            chunk;              /* Samples per callback */
+    bool                playing;
+
+    float               * ring;
+    uint32_t            size;               /* Power of 2 */
+    atomic_uint         head, tail;         /* Free running, written by the producer and the consumer */
+    float               last;               /* Last sample played, held through underruns (consumer) */
+
+    uint32_t            target;             /* Fill the rate control aims for, in samples */
+    float               fill_avg,
+                        drift;              /* Integral term, the clock difference in ppm once settled */
+    int32_t             ppm;                /* Current rate correction */
+
+    /* Statistics, since the last report */
+    atomic_uint         underruns;          /* Callbacks the ring ran dry in */
+    uint32_t            pushes, dropped,    /* Frames pushed, samples that didn't fit */
+                        fill_min, fill_max;
+    uint64_t            fill_sum;
+    int32_t             ppm_min, ppm_max;
+}
+Audio;
+
+/* Device callback, copies out what is in the ring and holds the last sample if that's not enough */
+void audio_callback(void * data, Uint8 * stream, int len)
+{
+    Audio    * au   = data;
+    float    * out  = (float *) stream;
+    uint32_t n      = (uint32_t) len / sizeof(float),
+             tail   = atomic_load_explicit(&au->tail, memory_order_relaxed),
+             avail  = atomic_load_explicit(&au->head, memory_order_acquire) - tail,
+             take   = avail < n ? avail : n;
+
+    for (uint32_t i = 0; i < take; i++)
+        out[i] = au->ring[(tail + i) & (au->size - 1)];
+    atomic_store_explicit(&au->tail, tail + take, memory_order_release);
+
+    if (take > 0)
+        au->last = out[take - 1];
+    if (take < n)
+    {
+        for (uint32_t i = take; i < n; i++)
+            out[i] = au->last;
+        atomic_fetch_add_explicit(&au->underruns, 1, memory_order_relaxed);
+    }
+}
+
+void audio_stats_reset(Audio * au)
+{
+    au->pushes  = au->dropped = au->fill_max = 0;
+    au->fill_min = UINT32_MAX;
+    au->fill_sum = 0;
+    au->ppm_min = au->ppm_max = au->ppm;
+    atomic_store(&au->underruns, 0);
+}
+
+/* 
+Open the default audio device at 'rate' (it may pick another one, see au->rate) for mono float 
+samples, aiming for 'latency' msec of buffering (AUDIO_MIN_LATENCY at least). Playback starts 
+once the first 'latency' msec have been pushed.
+*/
+bool init_audio(Audio * au, int rate, uint32_t latency)
+{
+    SDL_AudioSpec want, have;
+
+    memset(au, 0, sizeof(*au));
+    latency = latency < AUDIO_MIN_LATENCY ? AUDIO_MIN_LATENCY : latency;
+    au->target = (uint32_t)((uint64_t) rate * latency / 1000);
+
+    /* At most a quarter of the latency per callback (a power of 2, 128 to 2048 samples) */
+    for (au->chunk = 128; au->chunk < 2048 && au->chunk * 8 <= au->target; au->chunk *= 2)
+        ;
+
+    SDL_zero(want);
+    want.freq       = rate;
+    want.format     = AUDIO_F32SYS;
+    want.channels   = 1;
+    want.samples    = au->chunk;
+    want.callback   = audio_callback;
+    want.userdata   = au;
+
+    au->device = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+    if (au->device == 0)
+    {
+        fprintf(stderr, "error: Failed to open audio device: %s.\n", SDL_GetError());
+        return false;
+    }
+
+    /* Target is kept in device samples, the ring holds it twice over plus a long frame */
+    au->rate    = have.freq;
+    au->chunk   = have.samples;
+    au->target  = (uint32_t)((uint64_t) au->rate * latency / 1000);
+    for (au->size = 4096; au->size < au->target * 2 + 4096; au->size *= 2)
+        ;
+
+    au->ring = calloc(au->size, sizeof(float));
+    if (au->ring == NULL)
+    {
+        fprintf(stderr, "error: Failed to allocate the audio buffer.\n");
+        SDL_CloseAudioDevice(au->device);
+        return false;
+    }
+
+    au->fill_avg = (float) au->target;
+    audio_stats_reset(au);
+    return true;
+}
+
+/* 
+Push a frame of 'n' samples (producer), returns the rate correction in ppm to make the next 
+ones at. What doesn't fit into the ring is dropped.
+*/
+int32_t audio_push(Audio * au, const float * samples, uint32_t n)
+{
+    uint32_t head   = atomic_load_explicit(&au->head, memory_order_relaxed),
+             room   = au->size - (head - atomic_load_explicit(&au->tail, memory_order_acquire));
+
+    if (n > room)
+    {
+        au->dropped += n - room;
+        n = room;
+    }
+
+    for (uint32_t i = 0; i < n; i++)
+        au->ring[(head + i) & (au->size - 1)] = samples[i];
+    atomic_store_explicit(&au->head, head + n, memory_order_release);
+
+    uint32_t fill = head + n - atomic_load_explicit(&au->tail, memory_order_acquire);
+    fill = fill > n / 2 ? fill - n / 2 : 0;
+    if (!au->playing)
+    {
+        if (fill < au->target)
+            return au->ppm;
+
+        SDL_PauseAudioDevice(au->device, 0);
+        au->playing = true;
+    }
+
+    /* 
+    PI control on the smoothed fill: being a full target off is the largest correction, the 
+    integral slowly takes over the steady difference of the clocks so the fill ends up on target 
+    */
+    au->fill_avg += ((float) fill - au->fill_avg) / AUDIO_FILL_SMOOTH;
+
+    float   err = (au->fill_avg - (float) au->target) / (float) au->target;
+    err         = err > 1.0f ? 1.0f : (err < -1.0f ? -1.0f : err);
+    au->drift  -= err * AUDIO_MAX_PPM / AUDIO_DRIFT_FRAMES;
+    au->drift   = au->drift > AUDIO_MAX_PPM ? AUDIO_MAX_PPM : (au->drift < -AUDIO_MAX_PPM ? -AUDIO_MAX_PPM : au->drift);
+
+    float   ppm = au->drift - err * AUDIO_MAX_PPM;
+    au->ppm     = (int32_t)(ppm > AUDIO_MAX_PPM ? AUDIO_MAX_PPM : (ppm < -AUDIO_MAX_PPM ? -AUDIO_MAX_PPM : ppm));
+
+    au->pushes++;
+    au->fill_sum += fill;
+    au->fill_min  = fill < au->fill_min ? fill : au->fill_min;
+    au->fill_max  = fill > au->fill_max ? fill : au->fill_max;
+    au->ppm_min   = au->ppm < au->ppm_min ? au->ppm : au->ppm_min;
+    au->ppm_max   = au->ppm > au->ppm_max ? au->ppm : au->ppm_max;
+
+    return au->ppm;
+}
+
+/* Print the ring's fill (msec), underruns, dropped samples and the range of the rate correction, then reset */
+void audio_report(Audio * au)
+{
+    if (au->pushes == 0)
+        return;
+
+    uint64_t avg = au->fill_sum * 1000000 / au->pushes / au->rate,     /* usec */
+             min = (uint64_t) au->fill_min * 1000000 / au->rate,
+             max = (uint64_t) au->fill_max * 1000000 / au->rate;
+
+    fprintf(stderr, "audio: %u frames, fill %llu.%03llu ms avg (%llu.%03llu - %llu.%03llu), target %u.%03u ms, "
+                    "%u underruns, %u dropped, rate %+d ppm (%+d - %+d)\n",
+            au->pushes,
+            (unsigned long long)(avg / 1000), (unsigned long long)(avg % 1000),
+            (unsigned long long)(min / 1000), (unsigned long long)(min % 1000),
+            (unsigned long long)(max / 1000), (unsigned long long)(max % 1000),
+            (unsigned)((uint64_t) au->target * 1000 / au->rate), (unsigned)((uint64_t) au->target * 1000000 / au->rate % 1000),
+            atomic_load(&au->underruns), au->dropped, au->ppm, au->ppm_min, au->ppm_max);
+
+    audio_stats_reset(au);
+}
+
+void free_audio(Audio * au)
+{
+    SDL_CloseAudioDevice(au->device);
+    free(au->ring);
+}
+
+/* 
+Audio capture to a file, for headless runs. Samples (float, interleaved if there is more than 
+one channel) are gathered into large blocks, full blocks go to a writer thread that does one 
+fwrite() per block. The producer never waits on the disk: if the writer falls a whole ring of 
+blocks behind, samples are dropped (and counted) instead.
+*/
+#define CAPTURE_BLOCK_SAMPLES   (1 << 17)   /* 512 KB blocks */
+#define CAPTURE_BLOCKS          8
+
+typedef struct Capture
+{
+    FILE        * file;
+    bool        wav;                        /* RIFF header (float), raw samples otherwise */
+    uint32_t    rate;
+    uint16_t    channels;
+
+    float       * block[CAPTURE_BLOCKS];
+    uint32_t    fill[CAPTURE_BLOCKS],       /* Samples in each block handed to the writer */
+                pending;                    /* Samples in the block being filled (block 'head') */
+    atomic_uint head, tail;                 /* Blocks handed to the writer, and written (free running) */
+
+    SDL_Thread  * thread;
+    SDL_sem     * posted;
+    atomic_bool stop;
+
+    uint64_t    written;                    /* Samples in the file (writer) */
+    uint64_t    dropped;                    /* Samples the producer had no room for */
+    bool        failed;                     /* A write went wrong (writer) */
+}
+Capture;
+
+static void capture_put32(uint8_t * p, uint32_t v)
+{
+    p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+/* RIFF/WAVE header of an IEEE float file, 'bytes' of samples long */
+static void capture_wav_header(Capture * cap, uint32_t bytes)
+{
+    uint8_t h[44];
+
+    memcpy(&h[0],  "RIFF", 4);  capture_put32(&h[4], 36 + bytes);
+    memcpy(&h[8],  "WAVE", 4);
+    memcpy(&h[12], "fmt ", 4);  capture_put32(&h[16], 16);
+    capture_put32(&h[20], 3 | (uint32_t) cap->channels << 16);                 /* Format 3 (float), channels */
+    capture_put32(&h[24], cap->rate);
+    capture_put32(&h[28], cap->rate * cap->channels * sizeof(float));           /* Bytes per second */
+    capture_put32(&h[32], (uint32_t)(cap->channels * sizeof(float)) | 32 << 16);    /* Block align, bits */
+    memcpy(&h[36], "data", 4);  capture_put32(&h[40], bytes);
+
+    fwrite(h, 1, sizeof(h), cap->file);
+}
+
+/* Writer thread */
+static int capture_main(void * data)
+{
+    Capture * cap = data;
+
+    for (;;)
+    {
+        uint32_t tail = atomic_load_explicit(&cap->tail, memory_order_relaxed);
+
+        if (atomic_load_explicit(&cap->head, memory_order_acquire) == tail)
+        {
+            if (atomic_load(&cap->stop))
+                return 0;
+            SDL_SemWait(cap->posted);
+            continue;
+        }
+
+        uint32_t b = tail % CAPTURE_BLOCKS;
+        if (fwrite(cap->block[b], sizeof(float), cap->fill[b], cap->file) != cap->fill[b])
+            cap->failed = true;
+        cap->written += cap->fill[b];
+
+        atomic_store_explicit(&cap->tail, tail + 1, memory_order_release);
+    }
+}
+
+void free_capture(Capture*);
+
+/* Start capturing 'channels' channels at 'rate' to 'path', as WAV or raw floats */
+bool init_capture(Capture * cap, const char * path, bool wav, uint32_t rate, uint16_t channels)
+{
+    memset(cap, 0, sizeof(*cap));
+    cap->wav        = wav;
+    cap->rate       = rate;
+    cap->channels   = channels;
+
+    if ((cap->file = fopen(path, "wb")) == NULL)
+    {
+        fprintf(stderr, "error: Failed to open %s: %s.\n", path, strerror(errno));
+        return false;
+    }
+
+    /* Blocks are big enough already, no need to copy them through stdio's buffer */
+    setvbuf(cap->file, NULL, _IONBF, 0);
+    if (wav)
+        capture_wav_header(cap, 0);
+
+    bool ok = (cap->posted = SDL_CreateSemaphore(0)) != NULL;
+    for (int i = 0; i < CAPTURE_BLOCKS; i++)
+        ok &= (cap->block[i] = malloc(CAPTURE_BLOCK_SAMPLES * sizeof(float))) != NULL;
+
+    if (ok)
+        cap->thread = SDL_CreateThread(capture_main, "capture", cap);
+    if (cap->thread == NULL)
+    {
+        fprintf(stderr, "error: Failed to start audio capture: %s.\n", SDL_GetError());
+        free_capture(cap);
+        return false;
+    }
+    return true;
+}
+
+/* Hand the block being filled to the writer */
+static void capture_post(Capture * cap)
+{
+    uint32_t head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+
+    cap->fill[head % CAPTURE_BLOCKS] = cap->pending;
+    cap->pending = 0;
+    atomic_store_explicit(&cap->head, head + 1, memory_order_release);
+    SDL_SemPost(cap->posted);
+}
+
+/* 
+Append 'frames' sample frames (producer). 'channel[c]' points to channel c's samples, with 
+'stride' floats between one sample and the next (1 for contiguous arrays).
+*/
+void capture_write(Capture * cap, const float * const * channel, size_t stride, uint32_t frames)
+{
+    for (uint32_t i = 0; i < frames; )
+    {
+        uint32_t head = atomic_load_explicit(&cap->head, memory_order_relaxed);
+
+        /* Every block is still with the writer, the rest is dropped */
+        if (head - atomic_load_explicit(&cap->tail, memory_order_acquire) >= CAPTURE_BLOCKS)
+        {
+            cap->dropped += (uint64_t)(frames - i) * cap->channels;
+            return;
+        }
+
+        uint32_t room   = (CAPTURE_BLOCK_SAMPLES - cap->pending) / cap->channels,
+                 n      = frames - i < room ? frames - i : room;
+        float    * out  = &cap->block[head % CAPTURE_BLOCKS][cap->pending];
+
+        for (uint16_t c = 0; c < cap->channels; c++)
+            for (uint32_t j = 0; j < n; j++)
+                out[j * cap->channels + c] = channel[c][(i + j) * stride];
+
+        cap->pending += n * cap->channels;
+        i += n;
+
+        if (cap->pending + cap->channels > CAPTURE_BLOCK_SAMPLES)
+            capture_post(cap);
+    }
+}
+
+/* Write what's left, wait for the writer and finish the file */
+void free_capture(Capture * cap)
+{
+    if (cap->thread != NULL)
+    {
+        if (cap->pending > 0)
+            capture_post(cap);
+
+        atomic_store(&cap->stop, true);
+        SDL_SemPost(cap->posted);
+        SDL_WaitThread(cap->thread, NULL);
+    }
+
+    if (cap->file != NULL)
+    {
+        if (cap->wav && fseek(cap->file, 0, SEEK_SET) == 0)
+            capture_wav_header(cap, (uint32_t)(cap->written * sizeof(float)));
+        if (cap->failed)
+            fprintf(stderr, "error: Audio capture is incomplete, writing failed.\n");
+        if (cap->dropped)
+            fprintf(stderr, "warning: Audio capture dropped %llu samples, the disk couldn't keep up.\n", (unsigned long long) cap->dropped);
+        fclose(cap->file);
+    }
+
+    for (int i = 0; i < CAPTURE_BLOCKS; i++)
+        free(cap->block[i]);
+    SDL_DestroySemaphore(cap->posted);
+}
+
 /* Event handling loop */
 void on_event(int * i)
 {
@@ -150,8 +698,24 @@ void main_loop(Display * disp)
     SDL_Quit();
 }
 
-/* A simple wait function (TO-DO: don't use SDL_Delay) */
-void wait(uint32_t msec)
+/* 
+Wait until the performance counter reaches 'deadline'. SDL_Delay() can oversleep by a 
+scheduler tick or more, so it only covers all but the last 2 msec, the rest is spun.
+*/
+void sleep_until(uint64_t deadline)
+{
+    const uint64_t freq = SDL_GetPerformanceFrequency();
+    uint64_t now;
+
+    while ((now = SDL_GetPerformanceCounter()) + freq / 500 < deadline)
+        SDL_Delay((uint32_t)((deadline - now) * 1000 / freq) - 1);
+
+    while (SDL_GetPerformanceCounter() < deadline)
+        ;
+}
+
+/* A simple wait function (not wait(), that one is POSIX's) */
+void wait_ms(uint32_t msec)
 {
-    SDL_Delay(msec);
+    sleep_until(SDL_GetPerformanceCounter() + SDL_GetPerformanceFrequency() * msec / 1000);
 }
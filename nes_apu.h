@@ -0,0 +1,1021 @@
+#pragma once
+
+/*
+    nes_apu.h: Header-only implementation of the APU found inside of the NES
+
+    Technical references:
+    https://wiki.nesdev.com/w/index.php/APU
+    https://wiki.nesdev.com/w/index.php/APU_Frame_Counter
+    https://wiki.nesdev.com/w/index.php/APU_Mixer
+    http://slack.net/~ant/bl-synth/ (band-limited sound synthesis)
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <math.h>
+#include <SDL2/SDL.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+APU registers (from https://wiki.nesdev.com/w/index.php/APU_registers)
+
+Register    Address     Bits        Function
+-------------------------------------------------------------------------------------------
+Pulse 1/2   $4000/$4004 DDLC VVVV   Duty (D), length counter halt / envelope loop (L),
+                                    constant volume (C), volume / envelope period (V)
+            $4001/$4005 EPPP NSSS   Sweep enable (E), period (P), negate (N), shift (S)
+            $4002/$4006 TTTT TTTT   Timer low
+            $4003/$4007 LLLL LTTT   Length counter load (L), timer high (T)
+Triangle    $4008       CRRR RRRR   Length counter halt / linear counter control (C), reload (R)
+            $400A       TTTT TTTT   Timer low
+            $400B       LLLL LTTT   Length counter load (L), timer high (T)
+Noise       $400C       --LC VVVV   Same as pulse
+            $400E       M--- PPPP   Mode (M), period (P)
+            $400F       LLLL L---   Length counter load (L)
+DMC         $4010       IL-- RRRR   IRQ enable (I), loop (L), rate (R)
+            $4011       -DDD DDDD   Direct load of the output level
+            $4012       AAAA AAAA   Sample address ($C000 + A * 64)
+            $4013       LLLL LLLL   Sample length (L * 16 + 1)
+Status      $4015       ---D NT21   Enable channels (write),
+                        IF-D NT21   DMC IRQ (I), frame IRQ (F), active channels (read)
+Frame       $4017       MI-- ----   5-step mode (M), IRQ inhibit (I)
+*/
+
+/* CPU clock, 236.25 MHz / 132 (~1.789773 MHz) */
+#define APU_CPU_CLOCK_NUM       236250000ull
+#define APU_CPU_CLOCK_DEN       132
+
+/* Sample positions are kept exactly, in 1 / APU_SAMPLE_UNIT of a sample (the rate can be off by some ppm) */
+#define APU_RATE_ONE            1000000ull
+#define APU_SAMPLE_UNIT         (APU_CPU_CLOCK_NUM * APU_RATE_ONE)
+
+/*
+Band-limited steps: every change of the output is added to the output buffer as a step
+smoothed by a windowed sinc, at the fraction of a sample it happens at (one of
+APU_BLEP_PHASES). The buffer holds the differences, summing it up gives the samples.
+Nothing runs per CPU cycle or per sample while the APU is emulated, output samples are
+only made once a frame (see APU_end_frame()). The kernels are made for any output rate
+(44.1 and 48 kHz alike), so this is the resampler too.
+
+A frame's samples are made in blocks: the buffer is summed up and then goes through the
+NES's own output filters (high-pass at 90 Hz and 440 Hz, low-pass at 14 kHz), each of
+them a pass over the block, 4 samples at a time with SSE2.
+
+The APU is also run lazily: it is only caught up to the CPU when a register is written,
+$4015 is read, the frame ends, or the CPU reaches nes_apu.sync (the next cycle an IRQ
+can go up at). Channels are free to lag behind in between, nothing sees them.
+*/
+#define APU_BLEP_PHASES         64
+#define APU_BLEP_TAPS           16
+#define APU_SAMPLE_RATE         48000
+#define APU_FRAME_SAMPLES_MAX   4096            /* Output samples per frame, enough for 2 frames at 96 kHz */
+
+/* Channels, in the order of nes_apu.levels and APU_channel_out() */
+#define APU_PULSE1              0
+#define APU_PULSE2              1
+#define APU_TRIANGLE            2
+#define APU_NOISE               3
+#define APU_DMC                 4
+#define APU_CHANNELS            5
+
+typedef struct _APU_blip
+{
+    float   buf[APU_FRAME_SAMPLES_MAX + APU_BLEP_TAPS];
+    float   sum;                                /* Running sum (the output level) at the start of buf */
+}
+_APU_blip;
+
+/* First-order filters between the mixer and the output jack, and what they last saw */
+typedef struct _APU_filters
+{
+    float   hp90, hp440, lp14k;                 /* Coefficients for the output sample rate */
+    float   hp90_x, hp90_y, hp440_x, hp440_y, lp14k_y;
+}
+_APU_filters;
+
+typedef struct _APU_envelope
+{
+    bool    start, loop, constant;
+    uint8_t period, divider, decay;
+}
+_APU_envelope;
+
+typedef struct _APU_pulse
+{
+    bool            enabled;
+    uint8_t         duty, step, length;
+    uint16_t        period;
+    uint64_t        next;                       /* CPU cycle of the next timer clock */
+    _APU_envelope   env;
+
+    bool            sweep_enabled, sweep_negate, sweep_reload;
+    uint8_t         sweep_period, sweep_shift, sweep_divider;
+    bool            ones_complement;            /* Pulse 1 negates with the ones' complement */
+}
+_APU_pulse;
+
+typedef struct _APU_triangle
+{
+    bool        enabled, control, linear_reload;
+    uint8_t     step, length, linear, linear_period;
+    uint16_t    period;
+    uint64_t    next;
+}
+_APU_triangle;
+
+typedef struct _APU_noise
+{
+    bool            enabled, mode;
+    uint8_t         length, period_i;
+    uint16_t        lfsr;
+    uint64_t        next;
+    _APU_envelope   env;
+}
+_APU_noise;
+
+typedef struct _APU_dmc
+{
+    bool        irq_enabled, loop, silence, buffer_full;
+    uint8_t     rate_i, level, shift, bits, buffer;
+    uint16_t    start, length,                  /* Sample address and length as written */
+                addr, left;                     /* Memory reader */
+    uint64_t    next;
+}
+_APU_dmc;
+
+typedef struct _nes_apu
+{
+    uint64_t        cycle;                      /* CPU cycle the APU has been run up to */
+    uint64_t        sync;                       /* CPU cycle it has to be caught up by, for its next IRQ */
+
+    _APU_pulse      pulse[2];
+    _APU_triangle   triangle;
+    _APU_noise      noise;
+    _APU_dmc        dmc;
+
+    /* Frame counter */
+    bool            five_step, irq_inhibit;
+    uint8_t         frame_step;
+    uint64_t        frame_next;                 /* CPU cycle of the next frame counter step */
+    bool            frame_irq, dmc_irq;
+
+    /* Output */
+    uint8_t         levels[APU_CHANNELS];                  /* Current output of pulse 1, pulse 2, triangle, noise, DMC */
+    float           amp;                        /* Mixed output */
+    uint32_t        sample_rate;
+    int32_t         rate_ppm;                   /* Correction of the sample rate, in parts per million */
+    uint64_t        rate_step;                  /* Sample position advance per CPU cycle */
+    uint64_t        frame_cycle,                /* CPU cycle at the start of the output frame */
+                    frame_carry;                /* Fraction of a sample left over from the last frame */
+    _APU_blip       mix;
+    _APU_filters    filters;
+    float           out[APU_FRAME_SAMPLES_MAX]; /* Samples of the last output frame, filtered */
+    uint32_t        out_count;
+
+    /* Output of each channel on its own, only made while 'channels_on' is set (see APU_set_channel_output()) */
+    bool            channels_on;
+    float           channel_amp[APU_CHANNELS];
+    _APU_blip       channel[APU_CHANNELS];
+    _Alignas(64) float channel_out[APU_CHANNELS][APU_FRAME_SAMPLES_MAX];
+    const float     * channel_ptr[APU_CHANNELS];
+
+    /* Time spent in the APU (performance counter ticks), only measured when 'profile' is set */
+    bool            profile;
+    uint64_t        cost, cost_sum, cost_max;
+    uint32_t        cost_frames;
+}
+_nes_apu;
+_nes_apu nes_apu;
+
+/* Reads sample bytes for the DMC from the CPU bus, set by the cartridge */
+uint8_t (*APU_dmc_read)(uint16_t addr);
+
+/* IRQ line of the CPU, one bit per device */
+#define APU_IRQ_FRAME           0x01
+#define APU_IRQ_DMC             0x02
+
+static const uint8_t APU_length_table[32] = {
+    10, 254, 20,  2, 40,  4, 80,  6, 160,  8, 60, 10, 14, 12, 26, 14,
+    12,  16, 24, 18, 48, 20, 96, 22, 192, 24, 72, 26, 16, 28, 32, 30
+};
+
+static const uint8_t APU_duty_table[4] = { 0x02, 0x06, 0x1E, 0xF9 };   /* Sequencer steps that are high */
+
+static const uint8_t APU_triangle_table[32] = {
+    15, 14, 13, 12, 11, 10,  9,  8,  7,  6,  5,  4,  3,  2,  1,  0,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15
+};
+
+/* NTSC timer periods in CPU cycles */
+static const uint16_t APU_noise_periods[16] = {
+    4, 8, 16, 32, 64, 96, 128, 160, 202, 254, 380, 508, 762, 1016, 2034, 4068
+};
+static const uint16_t APU_dmc_rates[16] = {
+    428, 380, 340, 320, 286, 254, 226, 214, 190, 160, 142, 128, 106, 84, 72, 54
+};
+
+/* Frame counter steps (CPU cycles after it was reset), the last one starts it over */
+static const uint16_t APU_frame_steps[2][5] = {
+    { 7457, 14913, 22371, 29829, 29830 },
+    { 7457, 14913, 22371, 29829, 37282 }
+};
+
+/* Nonlinear mixer, as lookup tables of the pulse sum and 3 * triangle + 2 * noise + DMC */
+float APU_pulse_table[31];
+float APU_tnd_table[203];
+
+/* Band-limited step kernels, one per phase */
+float APU_blep[APU_BLEP_PHASES][APU_BLEP_TAPS];
+
+/* Set the output sample rate, (re)builds the step kernels */
+static inline void APU_set_sample_rate(uint32_t rate)
+{
+    const double pi = 3.14159265358979323846, cutoff = 0.45;   /* Of the output sample rate */
+
+    for (int p = 0; p < APU_BLEP_PHASES; p++)
+    {
+        double sum = 0;
+        for (int j = 0; j < APU_BLEP_TAPS; j++)
+        {
+            double x = j - (APU_BLEP_TAPS / 2 - 1) - (double) p / APU_BLEP_PHASES,
+                   s = x == 0 ? 2 * cutoff : sin(2 * pi * cutoff * x) / (pi * x),
+                   w = 0.42 + 0.5 * cos(pi * x / (APU_BLEP_TAPS / 2)) + 0.08 * cos(2 * pi * x / (APU_BLEP_TAPS / 2));
+
+            APU_blep[p][j] = (float)(s * w);
+            sum += s * w;
+        }
+        for (int j = 0; j < APU_BLEP_TAPS; j++)
+            APU_blep[p][j] /= (float) sum;
+    }
+
+    /* RC filters: high-pass y = a * (y + x - x'), a = RC / (RC + dt), low-pass y += b * (x - y), b = dt / (RC + dt) */
+    double dt = 1.0 / rate;
+    nes_apu.filters.hp90    = (float)(1.0 / (2 * pi * 90)  / (1.0 / (2 * pi * 90)  + dt));
+    nes_apu.filters.hp440   = (float)(1.0 / (2 * pi * 440) / (1.0 / (2 * pi * 440) + dt));
+    nes_apu.filters.lp14k   = (float)(dt / (1.0 / (2 * pi * 14000) + dt));
+
+    nes_apu.sample_rate = rate;
+    nes_apu.rate_step   = rate * (APU_RATE_ONE + nes_apu.rate_ppm) * APU_CPU_CLOCK_DEN;
+}
+
+/* Make samples 'ppm' parts per million faster (or slower), to follow the clock of the audio device. Only called between frames */
+static inline void APU_set_rate_correction(int32_t ppm)
+{
+    nes_apu.rate_ppm    = ppm;
+    nes_apu.rate_step   = nes_apu.sample_rate * (APU_RATE_ONE + ppm) * APU_CPU_CLOCK_DEN;
+}
+
+/* Output sample a CPU cycle falls on, and the phase within it */
+static inline uint32_t APU_sample_at(uint64_t cycle, uint32_t * phase)
+{
+    uint64_t pos = (cycle - nes_apu.frame_cycle) * nes_apu.rate_step + nes_apu.frame_carry;
+
+    *phase = (uint32_t)((pos % APU_SAMPLE_UNIT) * APU_BLEP_PHASES / APU_SAMPLE_UNIT);
+    return (uint32_t)(pos / APU_SAMPLE_UNIT);
+}
+
+/* Add a step of 'delta' to the output at CPU cycle 'cycle' */
+static inline void APU_blip_add(_APU_blip * b, uint64_t cycle, float delta)
+{
+    uint32_t phase, i = APU_sample_at(cycle, &phase);
+
+    if (i >= APU_FRAME_SAMPLES_MAX)
+        i = APU_FRAME_SAMPLES_MAX - 1;      /* Frame went on too long, pile the rest up at its end */
+
+    const float * k = APU_blep[phase];
+#if defined(__SSE2__)
+    const __m128 d = _mm_set1_ps(delta);
+    for (int j = 0; j < APU_BLEP_TAPS; j += 4)
+        _mm_storeu_ps(&b->buf[i + j], _mm_add_ps(_mm_loadu_ps(&b->buf[i + j]), _mm_mul_ps(d, _mm_loadu_ps(&k[j]))));
+#else
+    for (int j = 0; j < APU_BLEP_TAPS; j++)
+        b->buf[i + j] += delta * k[j];
+#endif
+}
+
+/*
+First-order recursion x[i] = a * x[i - 1] + g * x[i] over a block, in place, 'y' is the
+output before it. Returns the last output. With SSE2 it is a scan within each 4 samples
+(shifted by 1, then by 2) plus what carries over from the 4 before.
+*/
+static inline float APU_scan(float * x, uint32_t n, float a, float g, float y)
+{
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    const __m128 gv = _mm_set1_ps(g),
+                 a1 = _mm_set1_ps(a),
+                 a2 = _mm_set1_ps(a * a),
+                 ay = _mm_setr_ps(a, a * a, a * a * a, a * a * a * a);
+    __m128 carry = _mm_set1_ps(y);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_mul_ps(gv, _mm_loadu_ps(&x[i]));
+        v = _mm_add_ps(v, _mm_mul_ps(a1, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4))));
+        v = _mm_add_ps(v, _mm_mul_ps(a2, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 8))));
+        v = _mm_add_ps(v, _mm_mul_ps(ay, carry));
+        _mm_storeu_ps(&x[i], v);
+        carry = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    y = _mm_cvtss_f32(carry);
+#endif
+    for (; i < n; i++)
+        x[i] = y = a * y + g * x[i];
+    return y;
+}
+
+/* x[i] = g * (x[i] - x[i - 1]) over a block, in place, 'prev' is the input before it (and becomes the last one) */
+static inline void APU_diff(float * x, uint32_t n, float g, float * prev)
+{
+    uint32_t i = 0;
+    float p = *prev;
+#if defined(__SSE2__)
+    const __m128 gv = _mm_set1_ps(g);
+    __m128 last = _mm_set_ss(p);
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128 v = _mm_loadu_ps(&x[i]),
+               s = _mm_move_ss(_mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(v), 4)), last);
+        _mm_storeu_ps(&x[i], _mm_mul_ps(gv, _mm_sub_ps(v, s)));
+        last = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    p = _mm_cvtss_f32(last);
+#endif
+    for (; i < n; i++)
+    {
+        float v = x[i];
+        x[i] = g * (v - p);
+        p = v;
+    }
+    *prev = p;
+}
+
+/* Sum the first 'n' samples up into 'out', and move the rest to the start */
+static inline void APU_blip_read(_APU_blip * b, float * out, uint32_t n)
+{
+    memcpy(out, b->buf, n * sizeof(float));
+    b->sum = APU_scan(out, n, 1.0f, 1.0f, b->sum);
+
+    memmove(b->buf, &b->buf[n], APU_BLEP_TAPS * sizeof(float));
+    memset(&b->buf[APU_BLEP_TAPS], 0, n * sizeof(float));
+}
+
+/* The output filters of the NES over a block of samples, in place */
+static inline void APU_filter_block(_APU_filters * f, float * x, uint32_t n)
+{
+    /* High-passes: y = a * y + a * (x - x') */
+    APU_diff(x, n, f->hp90, &f->hp90_x);
+    f->hp90_y   = APU_scan(x, n, f->hp90, 1.0f, f->hp90_y);
+    APU_diff(x, n, f->hp440, &f->hp440_x);
+    f->hp440_y  = APU_scan(x, n, f->hp440, 1.0f, f->hp440_y);
+
+    /* Low-pass: y = (1 - b) * y + b * x */
+    f->lp14k_y  = APU_scan(x, n, 1.0f - f->lp14k, f->lp14k, f->lp14k_y);
+}
+
+/* Envelope, clocked every quarter frame */
+static inline void APU_envelope_clock(_APU_envelope * e)
+{
+    if (e->start)
+    {
+        e->start    = false;
+        e->decay    = 15;
+        e->divider  = e->period;
+    }
+    else if (e->divider == 0)
+    {
+        e->divider = e->period;
+        if (e->decay > 0)
+            e->decay--;
+        else if (e->loop)
+            e->decay = 15;
+    }
+    else
+        e->divider--;
+}
+
+static inline uint8_t APU_envelope_volume(const _APU_envelope * e)
+{
+    return e->constant ? e->period : e->decay;
+}
+
+/* Period the sweep unit would change a pulse to */
+static inline uint16_t APU_sweep_target(const _APU_pulse * p)
+{
+    uint16_t change = p->period >> p->sweep_shift;
+
+    if (!p->sweep_negate)
+        return p->period + change;
+
+    change += p->ones_complement;
+    return change > p->period ? 0 : p->period - change;
+}
+
+static inline bool APU_pulse_muted(const _APU_pulse * p)
+{
+    return p->period < 8 || (!p->sweep_negate && APU_sweep_target(p) > 0x7FF);
+}
+
+/* Sweep unit, clocked every half frame */
+static inline void APU_sweep_clock(_APU_pulse * p)
+{
+    if (p->sweep_divider == 0 && p->sweep_enabled && p->sweep_shift > 0 && !APU_pulse_muted(p))
+        p->period = APU_sweep_target(p);
+
+    if (p->sweep_divider == 0 || p->sweep_reload)
+    {
+        p->sweep_divider    = p->sweep_period;
+        p->sweep_reload     = false;
+    }
+    else
+        p->sweep_divider--;
+}
+
+static inline void APU_quarter_frame()
+{
+    APU_envelope_clock(&nes_apu.pulse[0].env);
+    APU_envelope_clock(&nes_apu.pulse[1].env);
+    APU_envelope_clock(&nes_apu.noise.env);
+
+    _APU_triangle * t = &nes_apu.triangle;
+    if (t->linear_reload)
+        t->linear = t->linear_period;
+    else if (t->linear > 0)
+        t->linear--;
+    if (!t->control)
+        t->linear_reload = false;
+}
+
+static inline void APU_half_frame()
+{
+    for (int i = 0; i < 2; i++)
+    {
+        _APU_pulse * p = &nes_apu.pulse[i];
+        if (p->length > 0 && !p->env.loop)
+            p->length--;
+        APU_sweep_clock(p);
+    }
+
+    if (nes_apu.triangle.length > 0 && !nes_apu.triangle.control)
+        nes_apu.triangle.length--;
+    if (nes_apu.noise.length > 0 && !nes_apu.noise.env.loop)
+        nes_apu.noise.length--;
+}
+
+/* Raise or drop the APU's share of the IRQ line */
+static inline void APU_update_irq()
+{
+    nes_cpu_bus.IRQ = (nes_cpu_bus.IRQ & ~(APU_IRQ_FRAME | APU_IRQ_DMC))
+                    | (nes_apu.frame_irq ? APU_IRQ_FRAME : 0)
+                    | (nes_apu.dmc_irq   ? APU_IRQ_DMC   : 0);
+}
+
+/*
+The next CPU cycle an IRQ can go up at: the frame counter's last step (4-step mode, not
+inhibited) or the DMC fetching the last byte of a sample. Has to be redone whenever
+anything these depend on changes.
+*/
+static inline void APU_update_sync()
+{
+    const _APU_dmc * d = &nes_apu.dmc;
+    uint64_t sync = UINT64_MAX;
+
+    if (!nes_apu.frame_irq && !nes_apu.five_step && !nes_apu.irq_inhibit)
+        sync = nes_apu.frame_next + APU_frame_steps[0][3]
+             - (nes_apu.frame_step <= 3 ? APU_frame_steps[0][nes_apu.frame_step] : 0);
+
+    /* Bytes are fetched as soon as the buffer empties, one every 8 DMC clocks */
+    if (!nes_apu.dmc_irq && d->irq_enabled && !d->loop && d->left > 0)
+    {
+        uint64_t last = d->next + ((uint64_t)(d->bits - 1) + (uint64_t)(d->left - 1) * 8) * APU_dmc_rates[d->rate_i];
+        sync = last < sync ? last : sync;
+    }
+
+    nes_apu.sync = sync;
+}
+
+static inline void APU_frame_clock()
+{
+    uint8_t step = nes_apu.frame_step;
+
+    /* The 5-step sequence skips the 4th step, its 5th clocks everything instead */
+    if (step < 3 || (step == 3 && !nes_apu.five_step) || (step == 4 && nes_apu.five_step))
+    {
+        APU_quarter_frame();
+        if (step & 0x1 || step >= 3)
+            APU_half_frame();
+    }
+
+    if (step == 3 && !nes_apu.five_step && !nes_apu.irq_inhibit)
+    {
+        nes_apu.frame_irq = true;
+        APU_update_irq();
+    }
+
+    if (step == 4)
+    {
+        nes_apu.frame_step  = 0;
+        nes_apu.frame_next += APU_frame_steps[0][0];
+    }
+    else
+    {
+        nes_apu.frame_step++;
+        nes_apu.frame_next += APU_frame_steps[nes_apu.five_step][step + 1] - APU_frame_steps[nes_apu.five_step][step];
+    }
+}
+
+/* DMC memory reader, fills the sample buffer when it's empty */
+static inline void APU_dmc_fetch()
+{
+    _APU_dmc * d = &nes_apu.dmc;
+    if (d->buffer_full || d->left == 0)
+        return;
+
+    d->buffer       = APU_dmc_read(d->addr);
+    d->buffer_full  = true;
+    d->addr         = d->addr == 0xFFFF ? 0x8000 : d->addr + 1;
+
+    if (--d->left == 0)
+    {
+        if (d->loop)
+        {
+            d->addr = d->start;
+            d->left = d->length;
+        }
+        else if (d->irq_enabled)
+        {
+            nes_apu.dmc_irq = true;
+            APU_update_irq();
+        }
+    }
+}
+
+static inline void APU_dmc_clock()
+{
+    _APU_dmc * d = &nes_apu.dmc;
+
+    if (!d->silence)
+    {
+        if (d->shift & 0x1)
+            d->level += d->level <= 125 ? 2 : 0;
+        else
+            d->level -= d->level >= 2 ? 2 : 0;
+    }
+    d->shift >>= 1;
+
+    if (--d->bits == 0)
+    {
+        d->bits     = 8;
+        d->silence  = !d->buffer_full;
+        d->shift    = d->buffer;
+        d->buffer_full = false;
+        APU_dmc_fetch();
+    }
+}
+
+/* What channel 'ch' would put out at 'level' if it was the only one playing */
+static inline float APU_channel_amp(int ch, uint8_t level)
+{
+    static const uint8_t tnd_weight[APU_CHANNELS] = { 0, 0, 3, 2, 1 };
+
+    return ch <= APU_PULSE2 ? APU_pulse_table[level] : APU_tnd_table[tnd_weight[ch] * level];
+}
+
+/* Output of every channel, and the change of the mix (if any) at CPU cycle 'cycle' */
+static inline void APU_output(uint64_t cycle)
+{
+    uint8_t levels[APU_CHANNELS];
+
+    for (int i = 0; i < 2; i++)
+    {
+        const _APU_pulse * p = &nes_apu.pulse[i];
+        levels[i] = (p->length > 0 && !APU_pulse_muted(p) && (APU_duty_table[p->duty] >> p->step & 0x1))
+                  ? APU_envelope_volume(&p->env) : 0;
+    }
+
+    levels[2] = APU_triangle_table[nes_apu.triangle.step];
+    levels[3] = (nes_apu.noise.length > 0 && !(nes_apu.noise.lfsr & 0x1)) ? APU_envelope_volume(&nes_apu.noise.env) : 0;
+    levels[4] = nes_apu.dmc.level;
+
+    if (memcmp(levels, nes_apu.levels, sizeof(levels)) == 0)
+        return;
+
+    if (nes_apu.channels_on)
+        for (int i = 0; i < APU_CHANNELS; i++)
+            if (levels[i] != nes_apu.levels[i])
+            {
+                float amp = APU_channel_amp(i, levels[i]);
+                APU_blip_add(&nes_apu.channel[i], cycle, amp - nes_apu.channel_amp[i]);
+                nes_apu.channel_amp[i] = amp;
+            }
+
+    memcpy(nes_apu.levels, levels, sizeof(levels));
+
+    float amp = APU_pulse_table[levels[0] + levels[1]] + APU_tnd_table[3 * levels[2] + 2 * levels[3] + levels[4]];
+    APU_blip_add(&nes_apu.mix, cycle, amp - nes_apu.amp);
+    nes_apu.amp = amp;
+}
+
+/* Move a timer past CPU cycle 'cycle' in one go, returns the number of times it was clocked */
+static inline uint64_t APU_timer_skip(uint64_t * next, uint64_t period, uint64_t cycle)
+{
+    if (*next > cycle)
+        return 0;
+
+    uint64_t clocks = (cycle - *next) / period + 1;
+    *next += clocks * period;
+    return clocks;
+}
+
+/*
+Run the APU up to CPU cycle 'cycle'. It goes from one event to the next (timer clocks of
+the channels, frame counter steps) instead of cycle by cycle, every event that changes
+the output adds a step to the output buffer.
+*/
+static inline void APU_run_to(uint64_t cycle)
+{
+    _APU_pulse      * p1    = &nes_apu.pulse[0],
+                    * p2    = &nes_apu.pulse[1];
+    _APU_triangle   * t     = &nes_apu.triangle;
+    _APU_noise      * n     = &nes_apu.noise;
+    _APU_dmc        * d     = &nes_apu.dmc;
+
+    /*
+    Channels that stay silent until a register is written (no length left, or a period that
+    mutes them for good) would still have a timer event every few cycles, so they are moved
+    along in one go instead. The noise LFSR holds while it isn't heard.
+    */
+    if (p1->length == 0 || p1->period < 8)
+        p1->step = (p1->step - APU_timer_skip(&p1->next, (p1->period + 1) * 2, cycle)) & 0x7;
+    if (p2->length == 0 || p2->period < 8)
+        p2->step = (p2->step - APU_timer_skip(&p2->next, (p2->period + 1) * 2, cycle)) & 0x7;
+    if (t->length == 0 || t->period < 2)
+        APU_timer_skip(&t->next, t->period + 1, cycle);
+    if (n->length == 0)
+        APU_timer_skip(&n->next, APU_noise_periods[n->period_i], cycle);
+
+    for (;;)
+    {
+        uint64_t next = nes_apu.frame_next;
+        next = p1->next < next ? p1->next : next;
+        next = p2->next < next ? p2->next : next;
+        next = t->next  < next ? t->next  : next;
+        next = n->next  < next ? n->next  : next;
+        next = d->next  < next ? d->next  : next;
+
+        if (next > cycle)
+            break;
+
+        /* Pulse timers count APU cycles (every other CPU cycle), the sequence runs backwards */
+        if (p1->next == next)
+        {
+            p1->step = (p1->step - 1) & 0x7;
+            p1->next += (p1->period + 1) * 2;
+        }
+        if (p2->next == next)
+        {
+            p2->step = (p2->step - 1) & 0x7;
+            p2->next += (p2->period + 1) * 2;
+        }
+
+        /* Ultrasonic triangle periods are held, like most emulators do (it would only alias) */
+        if (t->next == next)
+        {
+            if (t->length > 0 && t->linear > 0 && t->period >= 2)
+                t->step = (t->step + 1) & 0x1F;
+            t->next += t->period + 1;
+        }
+
+        if (n->next == next)
+        {
+            uint16_t feedback = (n->lfsr ^ (n->lfsr >> (n->mode ? 6 : 1))) & 0x1;
+            n->lfsr = (n->lfsr >> 1) | (feedback << 14);
+            n->next += APU_noise_periods[n->period_i];
+        }
+
+        if (d->next == next)
+        {
+            APU_dmc_clock();
+            d->next += APU_dmc_rates[d->rate_i];
+        }
+
+        if (nes_apu.frame_next == next)
+            APU_frame_clock();
+
+        APU_output(next);
+    }
+
+    if (cycle > nes_apu.cycle)
+        nes_apu.cycle = cycle;
+
+    APU_update_sync();
+}
+
+/* Profiling of the APU, around every entry point */
+static inline uint64_t APU_profile_begin()
+{
+    return nes_apu.profile ? SDL_GetPerformanceCounter() : 0;
+}
+
+static inline void APU_profile_end(uint64_t start)
+{
+    if (nes_apu.profile)
+        nes_apu.cost += SDL_GetPerformanceCounter() - start;
+}
+
+/* Catch up with the CPU at CPU cycle 'cycle', because an IRQ may be due (called when the CPU passes nes_apu.sync) */
+static inline void APU_sync(uint64_t cycle)
+{
+    uint64_t start = APU_profile_begin();
+    APU_run_to(cycle);
+    APU_profile_end(start);
+}
+
+/* Reset the frame counter from a $4017 write at CPU cycle 'cycle' */
+static inline void APU_frame_reset(uint64_t cycle, uint8_t data)
+{
+    nes_apu.five_step   = data & 0x80;
+    nes_apu.irq_inhibit = data & 0x40;
+    if (nes_apu.irq_inhibit)
+    {
+        nes_apu.frame_irq = false;
+        APU_update_irq();
+    }
+
+    /* The sequencer restarts 3 or 4 cycles later (on an APU cycle), the 5-step mode clocks everything right away */
+    uint64_t origin = cycle + 3 + (cycle & 0x1);
+    nes_apu.frame_step  = 0;
+    nes_apu.frame_next  = origin + APU_frame_steps[0][0];
+
+    if (nes_apu.five_step)
+    {
+        APU_quarter_frame();
+        APU_half_frame();
+    }
+}
+
+/* CPU writes register $4000-$4017 ('addr') at CPU cycle 'cycle' */
+static inline void APU_write(uint64_t cycle, uint16_t addr, uint8_t data)
+{
+    uint64_t start = APU_profile_begin();
+    APU_run_to(cycle);
+
+    switch (addr)
+    {
+        case 0x4000: case 0x4004:
+        {
+            _APU_pulse * p = &nes_apu.pulse[(addr >> 2) & 0x1];
+            p->duty         = data >> 6;
+            p->env.loop     = data & 0x20;
+            p->env.constant = data & 0x10;
+            p->env.period   = data & 0x0F;
+            break;
+        }
+        case 0x4001: case 0x4005:
+        {
+            _APU_pulse * p = &nes_apu.pulse[(addr >> 2) & 0x1];
+            p->sweep_enabled    = data & 0x80;
+            p->sweep_period     = (data >> 4) & 0x7;
+            p->sweep_negate     = data & 0x08;
+            p->sweep_shift      = data & 0x07;
+            p->sweep_reload     = true;
+            break;
+        }
+        case 0x4002: case 0x4006:
+        {
+            _APU_pulse * p = &nes_apu.pulse[(addr >> 2) & 0x1];
+            p->period = (p->period & 0x700) | data;
+            break;
+        }
+        case 0x4003: case 0x4007:
+        {
+            _APU_pulse * p = &nes_apu.pulse[(addr >> 2) & 0x1];
+            p->period = (p->period & 0xFF) | (uint16_t)(data & 0x7) << 8;
+            if (p->enabled)
+                p->length = APU_length_table[data >> 3];
+            p->step         = 0;
+            p->env.start    = true;
+            break;
+        }
+        case 0x4008:
+            nes_apu.triangle.control        = data & 0x80;
+            nes_apu.triangle.linear_period  = data & 0x7F;
+            break;
+        case 0x400A:
+            nes_apu.triangle.period = (nes_apu.triangle.period & 0x700) | data;
+            break;
+        case 0x400B:
+            nes_apu.triangle.period = (nes_apu.triangle.period & 0xFF) | (uint16_t)(data & 0x7) << 8;
+            if (nes_apu.triangle.enabled)
+                nes_apu.triangle.length = APU_length_table[data >> 3];
+            nes_apu.triangle.linear_reload = true;
+            break;
+        case 0x400C:
+            nes_apu.noise.env.loop      = data & 0x20;
+            nes_apu.noise.env.constant  = data & 0x10;
+            nes_apu.noise.env.period    = data & 0x0F;
+            break;
+        case 0x400E:
+            nes_apu.noise.mode      = data & 0x80;
+            nes_apu.noise.period_i  = data & 0x0F;
+            break;
+        case 0x400F:
+            if (nes_apu.noise.enabled)
+                nes_apu.noise.length = APU_length_table[data >> 3];
+            nes_apu.noise.env.start = true;
+            break;
+        case 0x4010:
+            nes_apu.dmc.irq_enabled = data & 0x80;
+            nes_apu.dmc.loop        = data & 0x40;
+            nes_apu.dmc.rate_i      = data & 0x0F;
+            if (!nes_apu.dmc.irq_enabled)
+            {
+                nes_apu.dmc_irq = false;
+                APU_update_irq();
+            }
+            break;
+        case 0x4011:
+            nes_apu.dmc.level = data & 0x7F;
+            break;
+        case 0x4012:
+            nes_apu.dmc.start = 0xC000 | (uint16_t) data << 6;
+            break;
+        case 0x4013:
+            nes_apu.dmc.length = ((uint16_t) data << 4) | 1;
+            break;
+        case 0x4015:
+            nes_apu.pulse[0].enabled    = data & 0x01;
+            nes_apu.pulse[1].enabled    = data & 0x02;
+            nes_apu.triangle.enabled    = data & 0x04;
+            nes_apu.noise.enabled       = data & 0x08;
+            if (!nes_apu.pulse[0].enabled)  nes_apu.pulse[0].length = 0;
+            if (!nes_apu.pulse[1].enabled)  nes_apu.pulse[1].length = 0;
+            if (!nes_apu.triangle.enabled)  nes_apu.triangle.length = 0;
+            if (!nes_apu.noise.enabled)     nes_apu.noise.length    = 0;
+
+            if (!(data & 0x10))
+                nes_apu.dmc.left = 0;
+            else if (nes_apu.dmc.left == 0)
+            {
+                nes_apu.dmc.addr = nes_apu.dmc.start;
+                nes_apu.dmc.left = nes_apu.dmc.length;
+                APU_dmc_fetch();
+            }
+            nes_apu.dmc_irq = false;
+            APU_update_irq();
+            break;
+        case 0x4017:
+            APU_frame_reset(cycle, data);
+            break;
+    }
+
+    APU_output(cycle);
+    APU_update_sync();
+    APU_profile_end(start);
+}
+
+/* CPU reads $4015 at CPU cycle 'cycle', which acknowledges the frame IRQ */
+static inline uint8_t APU_read_status(uint64_t cycle)
+{
+    uint64_t start = APU_profile_begin();
+    APU_run_to(cycle);
+
+    uint8_t status  = (nes_apu.pulse[0].length > 0 ? 0x01 : 0)
+                    | (nes_apu.pulse[1].length > 0 ? 0x02 : 0)
+                    | (nes_apu.triangle.length > 0 ? 0x04 : 0)
+                    | (nes_apu.noise.length    > 0 ? 0x08 : 0)
+                    | (nes_apu.dmc.left        > 0 ? 0x10 : 0)
+                    | (nes_apu.frame_irq           ? 0x40 : 0)
+                    | (nes_apu.dmc_irq             ? 0x80 : 0);
+
+    nes_apu.frame_irq = false;
+    APU_update_irq();
+    APU_update_sync();
+
+    APU_profile_end(start);
+    return status;
+}
+
+/*
+End the output frame at CPU cycle 'cycle': the samples up to it are made, in
+nes_apu.out[0 .. out_count - 1] until the next frame ends.
+*/
+static inline uint32_t APU_end_frame(uint64_t cycle)
+{
+    uint64_t start = APU_profile_begin();
+    APU_run_to(cycle);
+
+    uint32_t phase, n = APU_sample_at(cycle, &phase);
+    uint64_t pos = (cycle - nes_apu.frame_cycle) * nes_apu.rate_step + nes_apu.frame_carry;
+
+    if (n > APU_FRAME_SAMPLES_MAX)
+        n = APU_FRAME_SAMPLES_MAX;
+
+    APU_blip_read(&nes_apu.mix, nes_apu.out, n);
+    APU_filter_block(&nes_apu.filters, nes_apu.out, n);
+    if (nes_apu.channels_on)
+        for (int i = 0; i < APU_CHANNELS; i++)
+            APU_blip_read(&nes_apu.channel[i], nes_apu.channel_out[i], n);
+    nes_apu.out_count   = n;
+    nes_apu.frame_cycle = cycle;
+    nes_apu.frame_carry = pos - (uint64_t) n * APU_SAMPLE_UNIT;
+    if (nes_apu.frame_carry >= APU_SAMPLE_UNIT)
+        nes_apu.frame_carry = 0;
+
+    APU_profile_end(start);
+    if (nes_apu.profile)
+    {
+        nes_apu.cost_sum += nes_apu.cost;
+        nes_apu.cost_max  = nes_apu.cost > nes_apu.cost_max ? nes_apu.cost : nes_apu.cost_max;
+        nes_apu.cost_frames++;
+        nes_apu.cost = 0;
+    }
+
+    return n;
+}
+
+/*
+Per-channel output: pulse 1, pulse 2, triangle, noise and DMC each get a buffer of their
+own, made like the mix (band-limited, at the output rate, over the same samples), but
+before the output filters and as if the channel played alone, so they keep their DC level
+and don't add up to the mix exactly (the mixer isn't linear). Nothing of it is done
+while it's off. Only switched between frames.
+*/
+static inline void APU_set_channel_output(bool on)
+{
+    if (on && !nes_apu.channels_on)
+        for (int i = 0; i < APU_CHANNELS; i++)
+        {
+            memset(&nes_apu.channel[i], 0, sizeof(nes_apu.channel[i]));
+            nes_apu.channel[i].sum  = nes_apu.channel_amp[i] = APU_channel_amp(i, nes_apu.levels[i]);
+        }
+
+    nes_apu.channels_on = on;
+}
+
+/*
+The channels of the last output frame, APU_CHANNELS pointers to nes_apu.out_count samples
+each (indexed by APU_PULSE1 .. APU_DMC), NULL while per-channel output is off. They point
+straight at the APU's buffers (64 byte aligned), good until the next frame ends.
+*/
+static inline const float * const * APU_channel_out()
+{
+    return nes_apu.channels_on ? nes_apu.channel_ptr : NULL;
+}
+
+/* Print and reset the time spent in the APU per frame */
+static inline void APU_report()
+{
+    if (nes_apu.cost_frames == 0)
+        return;
+
+    uint64_t freq   = SDL_GetPerformanceFrequency(),
+             mean   = nes_apu.cost_sum * 1000000000ull / freq / nes_apu.cost_frames,     /* ns */
+             max    = nes_apu.cost_max * 1000000000ull / freq;
+
+    fprintf(stderr, "apu: %u frames, %llu.%03llu us avg, %llu.%03llu us max\n",
+            nes_apu.cost_frames,
+            (unsigned long long)(mean / 1000), (unsigned long long)(mean % 1000),
+            (unsigned long long)(max / 1000), (unsigned long long)(max % 1000));
+
+    nes_apu.cost_sum    = nes_apu.cost_max = 0;
+    nes_apu.cost_frames = 0;
+}
+
+/* Power up the APU at CPU cycle 'cycle' */
+static inline void nes_init_apu(uint64_t cycle)
+{
+    memset(&nes_apu, 0, sizeof(nes_apu));
+
+    for (int i = 1; i < 31; i++)
+        APU_pulse_table[i] = 95.52f / (8128.0f / i + 100.0f);
+    for (int i = 1; i < 203; i++)
+        APU_tnd_table[i] = 163.67f / (24329.0f / i + 100.0f);
+
+    APU_set_sample_rate(APU_SAMPLE_RATE);
+    for (int i = 0; i < APU_CHANNELS; i++)
+        nes_apu.channel_ptr[i] = nes_apu.channel_out[i];
+
+    nes_apu.cycle                   = nes_apu.frame_cycle = cycle;
+    nes_apu.pulse[0].ones_complement = true;
+    nes_apu.pulse[0].next           = nes_apu.pulse[1].next = cycle + 2;
+    nes_apu.triangle.next           = cycle + 1;
+    nes_apu.noise.lfsr              = 1;
+    nes_apu.noise.next              = cycle + APU_noise_periods[0];
+    nes_apu.dmc.bits                = 8;
+    nes_apu.dmc.silence             = true;
+    nes_apu.dmc.length              = 1;
+    nes_apu.dmc.start               = 0xC000;
+    nes_apu.dmc.next                = cycle + APU_dmc_rates[0];
+
+    /* Powers up as if $4017 was written with 0 */
+    APU_frame_reset(cycle, 0x00);
+    APU_output(cycle);
+    APU_update_sync();
+}
@@ -1,10 +1,231 @@
 #pragma once
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
 #include "nes_ppu.h"
+#include "nes_apu.h"
 
-/* Clock information here */
-const float NES_MASTER_CLOCK    = 1 / (21.47727273f * 100000),  //21.477... MHz to seconds
-            NES_PPU_CLOCK       = (NES_MASTER_CLOCK * 4),       // Divide MSC by 4 and 12 (in this case, multiply to increase duration in seconds)
-            NES_CPU_CLOCK       = (NES_MASTER_CLOCK * 12);
+/* Master clock cycles per CPU and PPU cycle (real time is kept in nes_pacing.h) */
+#define NES_CPU_DIVIDER     12
+#define NES_PPU_DIVIDER     4
+
+/* 
+Master clock timestamps
+
+The CPU runs ahead on its own, the PPU is only run up to the CPU's timestamp when 
+something depends on it: a PPU register or OAMDMA access, or the sync point for the 
+next frame end / v-blank NMI. The PPU then does its whole stretch in one tight loop.
+*/
+typedef struct _nes_clock
+{
+    uint64_t    cpu,                /* Master cycle the CPU is at */
+                ppu,                /* Master cycle the PPU has been run up to */
+                sync;               /* Master cycle of the PPU's next sync point */
+}
+_nes_clock;
+_nes_clock nes_clock;
+
+/* Run the PPU up to master cycle 'when' */
+static inline void PPU_run_to(uint64_t when)
+{
+    if (nes_clock.ppu + NES_PPU_DIVIDER <= when)
+    {
+        uint64_t n = (when - nes_clock.ppu) / NES_PPU_DIVIDER;
+
+        nes_clock.ppu += n * NES_PPU_DIVIDER;
+        while (n-- > 0)
+            PPU_tick();
+    }
+}
+
+/* 
+PPU thread (optional, see PPU_thread_start())
+
+The CPU pushes PPU register writes stamped with its master cycle into a single producer,
+single consumer ring, and a PPU thread replays them at those cycles while it renders. In 
+between it runs up to the CPU's published master cycle. The CPU only waits for the PPU 
+when it needs a result: PPU register reads, the sync points (frame end and NMI, so it 
+sees the same NMI at the same instruction), and PPUCTRL writes that can raise NMI right 
+away. Every write lands on the same PPU cycle as in single threaded mode, so the output 
+is identical.
+
+While the PPU thread is running, PPU state is only touched from the CPU side right after 
+PPU_catch_up().
+*/
+#define NES_PPU_QUEUE_SIZE  4096                /* Entries, power of 2 */
+#define NES_PPU_QUEUE_OAM   8                   /* Queue entry for a byte of OAM DMA */
+
+typedef struct _nes_ppu_write
+{
+    uint64_t    when;                           /* Master cycle of the write */
+    uint8_t     reg;                            /* PPU register, or NES_PPU_QUEUE_OAM */
+    uint8_t     index;                          /* OAM byte index for NES_PPU_QUEUE_OAM */
+    uint8_t     data;
+}
+_nes_ppu_write;
+
+typedef struct _nes_ppu_thread
+{
+    bool                    enabled;
+    SDL_Thread              * thread;
+
+    _nes_ppu_write          queue[NES_PPU_QUEUE_SIZE];
+    atomic_uint             head,               /* Next entry to replay (PPU thread) */
+                            tail;               /* Next free entry (CPU) */
+
+    atomic_uint_least64_t   cpu_now,            /* CPU's master cycle, the PPU can run up to it */
+                            ppu_now;            /* Master cycle the PPU thread is done with */
+    atomic_bool             stop;
+
+    uint8_t                 ctrl;               /* Last PPUCTRL write, seen from the CPU */
+    uint8_t                 oam[256],           /* OAM and OAMADDR as the CPU wrote them */
+                            oam_addr;
+}
+_nes_ppu_thread;
+_nes_ppu_thread nes_ppu_thread;
+
+/* Replay a queued write */
+static inline void PPU_thread_apply(const _nes_ppu_write * w)
+{
+    if (w->reg != NES_PPU_QUEUE_OAM)
+    {
+        USE_REGS(w->reg, 1, w->data);
+        return;
+    }
+
+    /* Only Y bytes affect the sorted sprite index */
+    if ((w->index & 0x3) == 0 && nes_ppu.PPU_OAM_Bytes[w->index] != w->data)
+        nes_ppu.PPU_OAM_dirty = true;
+    nes_ppu.PPU_OAM_Bytes[w->index] = w->data;
+}
+
+/* PPU thread, replays writes and keeps up with the CPU */
+static int PPU_thread_main(void * arg)
+{
+    uint32_t idle = 0;
+
+    while (!atomic_load_explicit(&nes_ppu_thread.stop, memory_order_relaxed))
+    {
+        /* Writes up to 'target' were pushed before it was published */
+        uint64_t target = atomic_load_explicit(&nes_ppu_thread.cpu_now, memory_order_acquire);
+        unsigned head   = atomic_load_explicit(&nes_ppu_thread.head, memory_order_relaxed),
+                 tail   = atomic_load_explicit(&nes_ppu_thread.tail, memory_order_acquire);
+
+        if (head != tail)
+        {
+            const _nes_ppu_write * w = &nes_ppu_thread.queue[head & (NES_PPU_QUEUE_SIZE - 1)];
+
+            PPU_run_to(w->when);
+            PPU_thread_apply(w);
+            atomic_store_explicit(&nes_ppu_thread.head, head + 1, memory_order_release);
+        }
+        else if (nes_clock.ppu + NES_PPU_DIVIDER <= target)
+            PPU_run_to(target);
+        else if (++idle > 64)
+        {
+            idle = 0;
+            SDL_Delay(0);
+        }
+
+        atomic_store_explicit(&nes_ppu_thread.ppu_now, nes_clock.ppu, memory_order_release);
+    }
+
+    return 0;
+}
+
+/* Queue a write at the CPU's current master cycle */
+static inline void PPU_thread_push(uint8_t reg, uint8_t index, uint8_t data)
+{
+    unsigned tail = atomic_load_explicit(&nes_ppu_thread.tail, memory_order_relaxed);
+
+    while (tail - atomic_load_explicit(&nes_ppu_thread.head, memory_order_acquire) >= NES_PPU_QUEUE_SIZE)
+        SDL_Delay(0);
+
+    nes_ppu_thread.queue[tail & (NES_PPU_QUEUE_SIZE - 1)] = (_nes_ppu_write){
+        .when = nes_clock.cpu, .reg = reg, .index = index, .data = data
+    };
+    atomic_store_explicit(&nes_ppu_thread.tail, tail + 1, memory_order_release);
+}
+
+/* Let the PPU thread run up to the CPU, then wait until it got there and the queue is empty */
+static inline void PPU_thread_wait()
+{
+    atomic_store_explicit(&nes_ppu_thread.cpu_now, nes_clock.cpu, memory_order_release);
+
+    for (uint32_t spin = 0; 
+         atomic_load_explicit(&nes_ppu_thread.head, memory_order_acquire) != atomic_load_explicit(&nes_ppu_thread.tail, memory_order_relaxed) ||
+         atomic_load_explicit(&nes_ppu_thread.ppu_now, memory_order_acquire) + NES_PPU_DIVIDER <= nes_clock.cpu; 
+         spin++)
+    {
+        if (spin > 64)
+            SDL_Delay(0);
+    }
+}
+
+/* Start replaying PPU writes on a thread of its own */
+static inline bool PPU_thread_start()
+{
+    atomic_store(&nes_ppu_thread.head, 0);
+    atomic_store(&nes_ppu_thread.tail, 0);
+    atomic_store(&nes_ppu_thread.cpu_now, nes_clock.cpu);
+    atomic_store(&nes_ppu_thread.ppu_now, nes_clock.ppu);
+    atomic_store(&nes_ppu_thread.stop, false);
+    nes_ppu_thread.ctrl = nes_ppu.PPU_registers[PPUCTRL];
+
+    nes_ppu_thread.thread = SDL_CreateThread(PPU_thread_main, "PPU", NULL);
+    if (nes_ppu_thread.thread == NULL)
+    {
+        fprintf(stderr, "error: Failed to start the PPU thread: %s. Running it in lockstep.\n", SDL_GetError());
+        return false;
+    }
+
+    nes_ppu_thread.enabled = true;
+    return true;
+}
+
+/* Finish all queued writes and stop the PPU thread */
+static inline void PPU_thread_stop()
+{
+    if (!nes_ppu_thread.enabled)
+        return;
+
+    PPU_thread_wait();
+    atomic_store(&nes_ppu_thread.stop, true);
+    SDL_WaitThread(nes_ppu_thread.thread, NULL);
+    nes_ppu_thread.enabled = false;
+}
+
+/* Run the PPU up to the CPU */
+static inline void PPU_catch_up()
+{
+    if (nes_ppu_thread.enabled)
+        PPU_thread_wait();
+    else
+        PPU_run_to(nes_clock.cpu);
+
+    nes_clock.sync = nes_clock.ppu + (uint64_t)PPU_cycles_to_sync() * NES_PPU_DIVIDER;
+}
+
+/* CPU write to a PPU register */
+static inline void PPU_write(uint8_t reg, uint8_t data)
+{
+    /* Enabling NMI can raise it right away, the CPU has to see that on the next instruction */
+    bool nmi_enable = reg == PPUCTRL && (data & ~nes_ppu_thread.ctrl & 0x80);
+
+    if (reg == PPUCTRL)
+        nes_ppu_thread.ctrl = data;
+    else if (reg == OAMADDR)
+        nes_ppu_thread.oam_addr = data;
+    else if (reg == OAMDATA)
+        nes_ppu_thread.oam[nes_ppu_thread.oam_addr++] = data;
+
+    if (nes_ppu_thread.enabled && !nmi_enable)
+        PPU_thread_push(reg, 0, data);
+    else
+    {
+        PPU_catch_up();
+        USE_REGS(reg, 1, data);
+    }
+}
 
 /* NES Cartridge data */
 typedef struct _nes_cartridge
@@ -14,298 +235,1046 @@ typedef struct _nes_cartridge
     
     /* Pointer to NES address space */
     uint8_t * nes_mem;
+
+    /* 
+    Host memory behind each 2KB page of the CPU bus, NULL where reads aren't plain memory 
+    (registers, open bus). Mappers keep it up to date with their PRG banks, so blocks of 
+    memory can be copied straight from the host.
+    */
+    uint8_t * cpu_page[32];
+
+    /*
+    PRG-ROM and CHR (ROM, or 8 KiB of RAM at nes_ppu_bus.mem) stay in buffers of their own,
+    a bank switch only repoints pages of the CPU bus ($8000-$FFFF) and of the PPU bus.
+    */
+    uint8_t         * PRG_ROM,
+                    * CHR;
+    size_t          CHR_size;
+    PPU_mirroring   mirroring;                  /* As the header has it */
+
+    /* Mapper register write ($8000-$FFFF), NULL if there are none */
+    void (*write)(uint16_t addr, uint8_t data);
+
+    /* Mappers that watch the PPU: a CPU write to a PPU register or NES_PPU_QUEUE_OAM for OAM DMA, before it goes through (NULL if not needed) */
+    void (*ppu_write)(uint8_t reg, uint8_t data);
+
+    /* Timed mapper event (an IRQ), run by tick() once the CPU gets to master cycle 'sync' */
+    uint64_t    sync;
+    void        (*event)(void);
 }
 _nes_cartridge;
-_nes_cartridge nes_cartridge;
+_nes_cartridge nes_cartridge = { .sync = UINT64_MAX };
+
+/* The cartridge's share of the IRQ line (the APU has the bits below it) */
+#define MAPPER_IRQ          0x04
+
+/*
+The PPU starts on the pre-render scanline at master cycle 0 and every frame has 262 x 341
+dots, so PPU tick 't' (the one done by master cycle 4t + 4) is always on the same dot.
+Mappers that count scanlines use it to work out when things happen without asking the PPU.
+*/
+#define NES_PPU_FRAME_DOTS  (262 * 341)
+
+/* Scanline of PPU tick 't' */
+static inline uint16_t PPU_tick_line(uint64_t t)
+{
+    return (261 + t / 341) % 262;
+}
+
+/* PPU ticks done by the CPU's current master cycle */
+static inline uint64_t PPU_ticks_now()
+{
+    return nes_clock.cpu / NES_PPU_DIVIDER;
+}
+
+#define NES_CPU_PAGE_SHIFT  11
+#define NES_CPU_PAGE_SIZE   (1 << NES_CPU_PAGE_SHIFT)
+
+/* Point page 'i' ($0800 * i) of the CPU bus at host memory 'mem' */
+static inline void CPU_map_page(uint8_t i, uint8_t * mem)
+{
+    nes_cartridge.cpu_page[i] = mem;
+}
+
+/*
+Map 'size' bytes of PRG-ROM (a multiple of 2 KiB) at CPU address 'addr': bank 'bank', in
+'size' units, counted from the end if negative. Banks past the end wrap around, so smaller
+ROMs are mirrored.
+*/
+static inline void CPU_map_prg(uint16_t addr, uint32_t size, int32_t bank)
+{
+    uint32_t banks  = nes_cartridge.PRG_ROM_size > size ? nes_cartridge.PRG_ROM_size / size : 1,
+             b      = (uint32_t)(bank < 0 ? bank + (int32_t) banks : bank) % banks;
+
+    for (uint32_t o = 0; o < size; o += NES_CPU_PAGE_SIZE)
+        CPU_map_page((addr + o) >> NES_CPU_PAGE_SHIFT, &nes_cartridge.PRG_ROM[(b * size + o) % nes_cartridge.PRG_ROM_size]);
+}
+
+/* Map 'size' bytes of CHR (a multiple of 1 KiB) at PPU address 'addr', bank 'bank' in 'size' units */
+static inline void PPU_map_chr(uint16_t addr, uint32_t size, uint32_t bank)
+{
+    for (uint32_t o = 0; o < size; o += 0x400)
+        PPU_map_page((addr + o) >> 10, &nes_cartridge.CHR[(bank * size + o) % nes_cartridge.CHR_size]);
+}
 
 /* Function pointers to select method of memory access */
 uint8_t (*PEEK_MAPPER)(uint16_t);
 void    (*POKE_MAPPER)(uint16_t, uint8_t);
 
+/* 
+OAM DMA
+
+Writing $XX to $4014 copies $XX00-$XXFF to OAM, with the CPU halted while it happens: a 
+cycle for the write to finish, one more to line up with a read cycle if the DMA would 
+start on an odd cycle, then 256 read/write pairs (513 or 514 cycles). The bytes land in 
+OAM at once, the stall is spent right after the instruction that wrote $4014 (when its 
+last cycle, and so the alignment, is known).
+*/
+#define NES_OAMDMA_CYCLES   513
+
+bool nes_oamdma_pending;                    /* The last instruction started a DMA */
+
 /* OAMDMA (copy from CPU address space to OAM from $XX00 - $XXFF) */
 void EXEC_OAMDMA(uint8_t oam_copy_addr_hb);
 
-/* Mapper 000 PEEK */
-uint8_t PEEK_000(uint16_t addr)
+/* CPU cycles the DMA started by an instruction that ends at CPU cycle 'end' halts the CPU for */
+static inline uint16_t OAMDMA_stall(uint64_t end)
+{
+    nes_oamdma_pending = false;
+    return NES_OAMDMA_CYCLES + (end & 0x1);
+}
+
+/* 
+Status poll skipping
+
+Games wait for v-blank or sprite 0 hit with loops like
+
+    loop:   BIT $2002
+            BVC loop
+
+which can't see anything new until the PPU's next scheduled PPUSTATUS change. When the 
+read at one address returns the same value twice in a row, the code there is checked 
+(every time, a bank switch or a write to RAM can change it) and if it's such a loop, the 
+PPU is run straight up to that change instead of interpreting the loop all the way there.
+*/
+typedef struct _nes_status_poll
+{
+    uint16_t    pc;                 /* Address of the last PPUSTATUS read */
+    uint8_t     value;              /* Value it returned */
+}
+_nes_status_poll;
+_nes_status_poll nes_status_poll;
+
+/* 
+Check if the code at 'pc' only reads PPUSTATUS, maybe masks/compares it, and branches back 
+to 'pc'. Returns the bits the loop depends on (0 if it's not such a loop).
+*/
+static inline uint8_t status_poll_loop_bits(uint16_t pc)
+{
+    uint8_t  op     = PEEK_MAPPER(pc),
+             bits   = 0xE0;
+    uint16_t addr   = (uint16_t)PEEK_MAPPER(pc + 2) << 8 | PEEK_MAPPER(pc + 1);
+
+    if ((op != LDA_ABS && op != BIT_ABS) || addr < 0x2000 || addr >= 0x4000 || (addr & 0x7) != PPUSTATUS)
+        return 0;
+
+    uint16_t br = pc + 3;
+    if (op == LDA_ABS && PEEK_MAPPER(br) == AND_IMM)
+    {
+        bits = PEEK_MAPPER(br + 1) & 0xE0;
+        br  += 2;
+    }
+    else if (op == LDA_ABS && PEEK_MAPPER(br) == CMP_IMM)
+        br  += 2;
+
+    switch (PEEK_MAPPER(br))
+    {
+        case BPL_REL: case BMI_REL:                 /* N is bit 7 unless it was masked */
+            if (bits == 0xE0) bits = 0x80;
+            break;
+        case BVC_REL: case BVS_REL:                 /* Only BIT puts bit 6 in V */
+            if (op == BIT_ABS) bits = 0x40;
+            break;
+        case BCC_REL: case BCS_REL: case BNE_REL: case BEQ_REL:
+            break;
+        default:
+            return 0;
+    }
+
+    return ((uint16_t)(br + 2 + (int8_t)PEEK_MAPPER(br + 1)) == pc) ? bits : 0;
+}
+
+/* Called on every PPUSTATUS read */
+static inline void status_poll_skip()
+{
+    uint16_t pc     = nes_cpu_registers.PC;
+    uint8_t  bits   = 0;
+
+    if (pc != nes_status_poll.pc)
+        nes_status_poll.pc = pc;
+    else if (nes_status_poll.value == nes_ppu.PPU_registers[PPUSTATUS] && (bits = status_poll_loop_bits(pc)))
+    {
+        /* The CPU spends that time in the loop, rounded up to whole CPU cycles */
+        uint64_t wait = (uint64_t)PPU_cycles_to_status_change(bits) * NES_PPU_DIVIDER;
+
+        /* An APU IRQ would interrupt the loop first (if it isn't masked) */
+        if (!(nes_cpu_registers.S & I) && nes_apu.sync != UINT64_MAX)
+        {
+            uint64_t irq = nes_apu.sync * NES_CPU_DIVIDER;
+            wait = irq > nes_clock.cpu ? (irq - nes_clock.cpu < wait ? irq - nes_clock.cpu : wait) : 0;
+        }
+
+        /* So would the mapper's next event */
+        if (nes_cartridge.sync != UINT64_MAX)
+            wait = nes_cartridge.sync > nes_clock.cpu ? (nes_cartridge.sync - nes_clock.cpu < wait ? nes_cartridge.sync - nes_clock.cpu : wait) : 0;
+
+        wait = (wait + NES_CPU_DIVIDER - 1) / NES_CPU_DIVIDER * NES_CPU_DIVIDER;
+
+        /*
+        The PPU's next sync point (frame end, v-blank NMI) can come before the change waited for, 
+        the read stops short of it then, and the loop runs into it (so an NMI is taken on time)
+        */
+        if (nes_clock.cpu + wait >= nes_clock.sync)
+            wait = nes_clock.sync > nes_clock.cpu ? (nes_clock.sync - nes_clock.cpu - 1) / NES_CPU_DIVIDER * NES_CPU_DIVIDER : 0;
+
+        nes_clock.cpu += wait;
+        PPU_catch_up();
+    }
+
+    nes_status_poll.value = nes_ppu.PPU_registers[PPUSTATUS];
+}
+
+/* 
+PPUDATA upload loops
+
+Nametables, palettes and CHR-RAM are uploaded with loops like
+
+    loop:   LDA $0300,X         (or LDA abs,Y / LDA (zp),Y / LDA #imm, or nothing when filling with A)
+            STA $2007
+            INX                 (or INY, DEX, DEY)
+            CPX #$40            (optional, CPY when counting with Y)
+            BNE loop
+
+The first STA $2007 of a loop checks that it has exactly that shape. The next time the 
+CPU is at the top of the loop, the shape is checked again (a bank switch or a write to RAM 
+can put other code there) and every iteration but the last one is done in one go: the 
+bytes are read, written to VRAM with the PPUCTRL increment, and the cycles the interpreter 
+would charge are spent at once. The last iteration is interpreted, so registers and flags 
+end up just the same. Iterations are only batched as long as the PPU can't tell the 
+difference: it isn't fetching during them, and they end before its next sync point 
+(frame end, v-blank NMI) and before the pre-render scanline.
+*/
+typedef struct _nes_ppudata_loop
+{
+    uint16_t    pc;                 /* Address of the last STA $2007 */
+    bool        match;              /* It is in an upload loop */
+    uint16_t    head;               /* First instruction of the loop */
+    uint8_t     load;               /* LDA opcode, 0 when filling with A */
+    uint8_t     step;               /* INX, INY, DEX or DEY */
+    uint8_t     end;                /* Index register value the loop ends at */
+    uint8_t     cycles;             /* CPU cycles per iteration, besides the page crossing of LDA (zp),Y */
+}
+_nes_ppudata_loop;
+_nes_ppudata_loop nes_ppudata_loop;
+
+/* Check if the STA $2007 at 'pc' is in an upload loop, and fill in 'loop' */
+static inline bool ppudata_loop_match(uint16_t pc, _nes_ppudata_loop * loop)
+{
+    if (PEEK_MAPPER(pc) != STA_ABS || PEEK_MAPPER(pc + 1) != 0x07 || PEEK_MAPPER(pc + 2) != 0x20)
+        return false;
+
+    uint16_t br     = pc + 4;
+    uint8_t  step   = PEEK_MAPPER(pc + 3);
+    bool     x      = step == INX_IMP || step == DEX_IMP;
+
+    if (!x && step != INY_IMP && step != DEY_IMP)
+        return false;
+
+    loop->step  = step;
+    loop->end   = 0;
+    loop->cycles = 4 + 2 + 2;
+
+    if (PEEK_MAPPER(br) == (x ? CPX_IMM : CPY_IMM))
+    {
+        loop->end       = PEEK_MAPPER(br + 1);
+        loop->cycles   += 2;
+        br             += 2;
+    }
+
+    if (PEEK_MAPPER(br) != BNE_REL)
+        return false;
+    loop->head = br + 2 + (int8_t)PEEK_MAPPER(br + 1);
+
+    /* The load has to use the index register the loop counts with */
+    uint8_t load = (loop->head == pc - 3 || loop->head == pc - 2) ? PEEK_MAPPER(loop->head) : 0;
+
+    if (loop->head == pc - 3 && load == (x ? LDA_ABSX : LDA_ABSY))
+        loop->cycles += 4;
+    else if (loop->head == pc - 2 && load == LDA_INDY && !x)
+        loop->cycles += 5;
+    else if (loop->head == pc - 2 && load == LDA_IMM)
+        loop->cycles += 2;
+    else if (loop->head == pc)
+        load = 0;
+    else
+        return false;
+
+    loop->load = load;
+    return true;
+}
+
+/* Called on every PPUDATA write */
+static inline void ppudata_loop_seen()
+{
+    uint16_t pc = nes_cpu_registers.PC;
+
+    if (pc != nes_ppudata_loop.pc)
+    {
+        nes_ppudata_loop.pc     = pc;
+        nes_ppudata_loop.match  = ppudata_loop_match(pc, &nes_ppudata_loop);
+    }
+}
+
+static inline void tick(uint16_t cycles);
+
+/* Called with the CPU at the top of the last upload loop seen, does all of its iterations but the last one */
+static inline void ppudata_loop_run()
+{
+    const _nes_ppudata_loop * loop = &nes_ppudata_loop;
+
+    /* A bank switch or a write to RAM may have put other code there since the loop was seen */
+    _nes_ppudata_loop now_seen;
+    if (!ppudata_loop_match(loop->pc, &now_seen) || now_seen.head != loop->head || now_seen.load != loop->load
+        || now_seen.step != loop->step || now_seen.end != loop->end)
+    {
+        nes_ppudata_loop.match = false;
+        return;
+    }
+
+    bool     x      = loop->step == INX_IMP || loop->step == DEX_IMP;
+    uint8_t  * reg  = x ? &nes_cpu_registers.X : &nes_cpu_registers.Y,
+             dir    = (loop->step == INX_IMP || loop->step == INY_IMP) ? 1 : 0xFF,
+             left   = (uint8_t)((loop->end - *reg) * dir) - 1;  /* All iterations but the last (255 if it wraps all the way) */
+
+    if (left < 2)
+        return;
+
+    PPU_catch_up();
+
+    /* PPU cycles it can go without noticing, from where it is now */
+    uint32_t now    = nes_ppu.s * 341 + nes_ppu.c,
+             limit  = now;
+    bool     fetch  = (nes_ppu.PPU_registers[PPUMASK] & 0x18) != 0;
+
+    if (nes_ppu.s < 240)
+        limit = fetch ? now : 240 * 341;
+    else if (nes_ppu.s < 261)
+        limit = 261 * 341;
+    else
+        limit = fetch ? now : 262 * 341;
+
+    uint64_t budget = (limit - now) / 3;
+    if (nes_clock.sync <= nes_clock.cpu)
+        return;
+    if ((nes_clock.sync - nes_clock.cpu) / NES_CPU_DIVIDER < budget)
+        budget = (nes_clock.sync - nes_clock.cpu) / NES_CPU_DIVIDER;
+
+    /* Read the bytes first, registers with side effects end the batch */
+    bool     fill   = loop->load == 0 || loop->load == LDA_IMM;
+    uint8_t  data[256], 
+             r      = *reg,
+             value  = loop->load ? PEEK_MAPPER(loop->head + 1) : nes_cpu_registers.A;    /* What a fill writes */
+    uint16_t base   = (uint16_t)PEEK_MAPPER(loop->head + 2) << 8 | PEEK_MAPPER(loop->head + 1),
+             n      = 0,
+             cycles = 0;
+
+    if (loop->load == LDA_INDY)
+    {
+        uint8_t op = PEEK_MAPPER(loop->head + 1);
+        base = (uint16_t)nes_cpu_mem.zp[(uint8_t)(op + 1)] << 8 | nes_cpu_mem.zp[op];
+    }
+
+    for (; n < left; n++, r += dir)
+    {
+        uint16_t addr   = base + r;
+        uint8_t  c      = loop->cycles;
+
+        if (loop->load == LDA_INDY && (addr & 0xFF00) != (base >> 8))
+            c++;
+        if (cycles + c >= budget || (!fill && addr >= 0x2000 && addr < 0x4020))
+            break;
+
+        data[n]  = fill ? value : PEEK_MAPPER(addr);
+        cycles  += c;
+    }
+
+    if (n == 0)
+        return;
+
+    PPU_data_write_block(data, n);
+
+    *reg = r;
+    nes_cpu_registers.A = data[n - 1];
+
+    tick(cycles);
+}
+
+/*
+Mapper registers change what the PPU and the DMC see, both are caught up before a write
+goes through (with the PPU thread running, it is idle at the CPU's cycle then)
+*/
+static inline void cartridge_sync()
+{
+    PPU_catch_up();
+    APU_sync(nes_clock.cpu / NES_CPU_DIVIDER);
+}
+
+/* Cartridge PEEK, the same for every mapper, banks are read through the page table */
+uint8_t PEEK_CART(uint16_t addr)
 {
+    /* PRG-ROM and WRAM */
+    if (addr >= 0x6000)
+        return nes_cartridge.cpu_page[addr >> NES_CPU_PAGE_SHIFT][addr & (NES_CPU_PAGE_SIZE - 1)];
     /* Internal NES memory */
-    if (addr >= 0x0 && addr < 0x2000)
+    if (addr < 0x2000)
         return nes_cartridge.nes_mem[(addr & 0x07FF)];
     /* PPU Registers */
-    if (addr >= 0x2000 && addr < 0x4000)
+    if (addr < 0x4000)
     {
+        PPU_catch_up();
+        if ((addr & 0x7) == PPUSTATUS)
+            status_poll_skip();
+
+        /* Readable registers leave their value on the data bus */
         USE_REGS((addr & 0x7), 0, 0x0);
-        return nes_ppu.PPU_registers[(addr & 0x7)];
-    }
-    /* Mirror if PRG_ROM is only 16 KiB */
-    if (addr >= 0x8000)
-    {
-        if (nes_cartridge.PRG_ROM_size == 0x4000)
-            return nes_cartridge.nes_mem[(addr & 0x3FFF) + 0x8000];
-        else
-            return nes_cartridge.nes_mem[addr];
+        return nes_ppu_bus.DB;
     }
+    /* APU status, the rest of the APU and I/O registers read back open bus (no controllers yet), and so does $4020-$5FFF */
+    return addr == 0x4015 ? APU_read_status(nes_clock.cpu / NES_CPU_DIVIDER) : (addr >> 8);
 }
 
-/* Mapper 000 POKE */
-void POKE_000(uint16_t addr, uint8_t data)
+/* Cartridge POKE, writes to $8000-$FFFF go to the mapper's registers */
+void POKE_CART(uint16_t addr, uint8_t data)
 {
     /* Internal NES memory */
-    if (addr >= 0x0 && addr < 0x2000)
+    if (addr < 0x2000)
         nes_cartridge.nes_mem[(addr & 0x07FF)] = data;
     /* PPU Registers */
-    else if (addr >= 0x2000 && addr < 0x4000)
-        USE_REGS((addr & 0x7), 1, data);
+    else if (addr < 0x4000)
+    {
+        if ((addr & 0x7) == PPUDATA)
+            ppudata_loop_seen();
+        if (nes_cartridge.ppu_write != NULL)
+            nes_cartridge.ppu_write((addr & 0x7), data);
+        PPU_write((addr & 0x7), data);
+    }
     else if (addr == 0x4014)
         EXEC_OAMDMA(data);
-    /* Mirror if PRG_ROM is only 16 KiB */
+    /* APU registers ($4016 is the controller strobe) */
+    else if (addr <= 0x4017 && addr != 0x4016)
+        APU_write(nes_clock.cpu / NES_CPU_DIVIDER, addr, data);
+    /* Mapper registers */
     else if (addr >= 0x8000)
     {
-        if (nes_cartridge.PRG_ROM_size == 0x4000)
-            nes_cartridge.nes_mem[(addr & 0x3FFF) + 0x8000] = data;
-        else
-            nes_cartridge.nes_mem[addr] = data;
+        if (nes_cartridge.write != NULL)
+        {
+            cartridge_sync();
+            nes_cartridge.write(addr, data);
+        }
     }
+    /* WRAM */
+    else if (addr >= 0x6000)
+        nes_cartridge.cpu_page[addr >> NES_CPU_PAGE_SHIFT][addr & (NES_CPU_PAGE_SIZE - 1)] = data;
 }
 
 /* OAMDMA (copy from CPU address space to OAM from $XX00 - $XXFF) */
 void EXEC_OAMDMA(uint8_t oam_copy_addr_hb)
 {
     uint16_t oam_copy_addr = (uint16_t) oam_copy_addr_hb << 8;
-    memcpy(nes_ppu.PPU_OAM_Bytes, &nes_cartridge.nes_mem[oam_copy_addr], 256);
+    const uint8_t * src = nes_cartridge.cpu_page[oam_copy_addr >> NES_CPU_PAGE_SHIFT];
+    uint8_t bytes[256];
+
+    /* Plain memory is copied straight from the host, anything else is read like the CPU would */
+    if (src != NULL)
+        src += oam_copy_addr & ((1 << NES_CPU_PAGE_SHIFT) - 1);
+    else
+    {
+        for (size_t i = 0; i < 256; i++)
+            bytes[i] = PEEK_MAPPER(oam_copy_addr | i);
+        src = bytes;
+    }
+
+    nes_oamdma_pending = true;
+
+    if (nes_cartridge.ppu_write != NULL)
+        nes_cartridge.ppu_write(NES_PPU_QUEUE_OAM, 0);
+    memcpy(nes_ppu_thread.oam, src, 256);
+
+    /* The PPU thread gets a copy, the page can change before the writes are replayed */
+    if (nes_ppu_thread.enabled)
+    {
+        for (size_t i = 0; i < 256; i++)
+            PPU_thread_push(NES_PPU_QUEUE_OAM, i, src[i]);
+        return;
+    }
+
+    PPU_catch_up();
+
+    /* Only rebuild the sorted sprite index if a Y byte actually changed */
+    for (size_t i = 0; i < 256 && !nes_ppu.PPU_OAM_dirty; i += 4)
+        nes_ppu.PPU_OAM_dirty = nes_ppu.PPU_OAM_Bytes[i] != src[i];
+
+    memcpy(nes_ppu.PPU_OAM_Bytes, src, 256);
+}
+
+/* Mapper 000 (NROM): 16 or 32 KiB of PRG-ROM, 8 KiB of CHR, no registers */
+void mapper_000()
+{
+    CPU_map_prg(0x8000, 0x8000, 0);
+    PPU_map_chr(0x0000, 0x2000, 0);
+}
+
+/*
+Mapper 001 (MMC1)
+
+Registers are written one bit at a time (bit 0 of 5 writes, LSB first), the 5th write's
+address picks the register. A write with bit 7 set resets the shift register and goes
+back to PRG mode 3.
+
+$8000-$9FFF     Control         CPPMM: CHR mode (8 KiB / two 4 KiB), PRG mode, mirroring
+$A000-$BFFF     CHR bank 0      (bit 4 also selects the 256 KiB half of 512 KiB PRG-ROMs)
+$C000-$DFFF     CHR bank 1
+$E000-$FFFF     PRG bank        PRG modes 0/1: 32 KiB, 2: $C000 switchable, 3: $8000 switchable
+*/
+typedef struct _mapper_001_regs
+{
+    uint8_t shift, count;
+    uint8_t control, chr[2], prg;
+}
+_mapper_001_regs;
+_mapper_001_regs mapper_001_regs;
+
+static inline void mapper_001_update()
+{
+    static const PPU_mirroring mirroring[4] = {
+        PPU_MIRROR_SINGLE_LO, PPU_MIRROR_SINGLE_HI, PPU_MIRROR_VERTICAL, PPU_MIRROR_HORIZONTAL
+    };
+    const _mapper_001_regs * r = &mapper_001_regs;
+
+    uint8_t outer   = nes_cartridge.PRG_ROM_size > 0x40000 ? (r->chr[0] & 0x10) : 0,
+            prg     = outer | (r->prg & 0x0F);
+
+    PPU_set_mirroring(mirroring[r->control & 0x3]);
+
+    switch ((r->control >> 2) & 0x3)
+    {
+        case 0:
+        case 1:
+            CPU_map_prg(0x8000, 0x8000, prg >> 1);
+            break;
+        case 2:
+            CPU_map_prg(0x8000, 0x4000, outer);
+            CPU_map_prg(0xC000, 0x4000, prg);
+            break;
+        case 3:
+            CPU_map_prg(0x8000, 0x4000, prg);
+            CPU_map_prg(0xC000, 0x4000, outer | 0x0F);
+            break;
+    }
+
+    if (r->control & 0x10)
+    {
+        PPU_map_chr(0x0000, 0x1000, r->chr[0]);
+        PPU_map_chr(0x1000, 0x1000, r->chr[1]);
+    }
+    else
+        PPU_map_chr(0x0000, 0x2000, r->chr[0] >> 1);
+}
+
+void mapper_001_write(uint16_t addr, uint8_t data)
+{
+    _mapper_001_regs * r = &mapper_001_regs;
+
+    if (data & 0x80)
+    {
+        r->shift    = r->count = 0;
+        r->control |= 0x0C;
+        mapper_001_update();
+        return;
+    }
+
+    r->shift |= (data & 0x1) << r->count;
+    if (++r->count < 5)
+        return;
+
+    switch ((addr >> 13) & 0x3)
+    {
+        case 0: r->control  = r->shift; break;
+        case 1: r->chr[0]   = r->shift; break;
+        case 2: r->chr[1]   = r->shift; break;
+        case 3: r->prg      = r->shift; break;
+    }
+
+    r->shift = r->count = 0;
+    mapper_001_update();
+}
+
+void mapper_001()
+{
+    memset(&mapper_001_regs, 0, sizeof(mapper_001_regs));
+    mapper_001_regs.control = 0x0C;
+
+    nes_cartridge.write = mapper_001_write;
+    mapper_001_update();
+}
+
+/* Mapper 002 (UxROM): 16 KiB PRG bank at $8000, the last one is fixed at $C000 */
+void mapper_002_write(uint16_t addr, uint8_t data)
+{
+    CPU_map_prg(0x8000, 0x4000, data);
+}
+
+void mapper_002()
+{
+    nes_cartridge.write = mapper_002_write;
+    CPU_map_prg(0x8000, 0x4000, 0);
+    CPU_map_prg(0xC000, 0x4000, -1);
+    PPU_map_chr(0x0000, 0x2000, 0);
+}
+
+/* Mapper 003 (CNROM): 8 KiB CHR bank */
+void mapper_003_write(uint16_t addr, uint8_t data)
+{
+    PPU_map_chr(0x0000, 0x2000, data);
+}
+
+void mapper_003()
+{
+    nes_cartridge.write = mapper_003_write;
+    CPU_map_prg(0x8000, 0x8000, 0);
+    PPU_map_chr(0x0000, 0x2000, 0);
+}
+
+/*
+Mapper 004 (MMC3)
+
+$8000 (even)    Bank select     CP---RRR: CHR A12 inversion, PRG mode, register to write next
+$8001 (odd)     Bank data       R0/R1: 2 KiB CHR banks, R2-R5: 1 KiB CHR banks, R6/R7: 8 KiB PRG banks
+$A000 (even)    Mirroring       0: vertical, 1: horizontal (not on four-screen boards)
+$A001 (odd)     PRG-RAM protect (not emulated, WRAM is always there)
+$C000 (even)    IRQ latch
+$C001 (odd)     IRQ reload
+$E000 (even)    IRQ disable (and acknowledge)
+$E001 (odd)     IRQ enable
+
+PRG mode 0 has R6 at $8000 and the second to last bank at $C000, mode 1 swaps them. $A000 is
+R7 and $E000 the last bank either way. CHR inversion swaps $0000-$0FFF with $1000-$1FFF.
+
+The IRQ counter is clocked by rising edges of PPU A12 (see PPU_a12_edges()). Rather than 
+watching the PPU's fetches, the mapper works out the dots of the edges from PPUCTRL and 
+PPUMASK as the CPU writes them: with 8x8 sprites every visible scanline has the same ones,
+and so does every pre-render scanline. The counter is brought up to date only when the CPU
+does something it depends on, and the IRQ is a timed event at the edge that takes the
+counter to 0. 8x16 sprites take their pattern table from the tile number, so then the edges
+are worked out a scanline at a time from the sprites on it (found in the CPU's copy of OAM,
+the PPU thread isn't waited for), with an event at every edge and at the start of every 
+rendering scanline. A12 toggled through PPUADDR with rendering off isn't counted.
+*/
+typedef struct _mapper_004_regs
+{
+    uint8_t select, bank[8];
+    uint8_t irq_latch, irq_counter;
+    bool    irq_reload, irq_enabled;
+
+    /* Scanline counter */
+    uint8_t     ctrl, mask;                         /* PPUCTRL and PPUMASK as the CPU wrote them */
+    uint64_t    line;                               /* PPU tick of dot 0 of the scanline being counted */
+    uint16_t    edge[PPU_A12_EDGES_MAX];            /* Its A12 edges (dots) */
+    uint8_t     edges, next;                        /* How many, and the first one not counted yet */
+    uint16_t    low, low_next;                      /* Dots A12 has been down for at its start, and at its end */
+    uint8_t     line_ctrl, line_mask;               /* PPUCTRL and PPUMASK at its start, when the PPU looked for sprites */
+    uint8_t     line_spr;                           /* 8x16 sprites: pattern tables of its sprite slots */
+    bool        line_spr_done;
+
+    uint16_t    pre[PPU_A12_EDGES_MAX],             /* 8x8 sprites: edges of pre-render and visible scanlines */
+                vis[PPU_A12_EDGES_MAX],
+                pattern_low;                        /* A12 down time at the end of either */
+    uint8_t     pres, viss;
+}
+_mapper_004_regs;
+_mapper_004_regs mapper_004_regs;
+
+/* Edges on every rendering scanline with 8x8 sprites, for the current PPUCTRL */
+static inline void mapper_004_patterns()
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+    uint8_t  bg     = (r->ctrl & 0x10) >> 4,
+             spr    = (r->ctrl & 0x08) ? 0xFF : 0x00;
+    uint16_t low    = PPU_A12_LOW_LONG;
+
+    r->pres         = PPU_a12_edges(bg, spr, 0, 341, &low, r->pre);
+    r->viss         = PPU_a12_edges(bg, spr, 0, 341, &low, r->vis);
+    r->pattern_low  = low;
+}
+
+/* Rendering is on and sprites are 8x16, edges can't be known before the PPU gets to a scanline */
+static inline bool mapper_004_tall()
+{
+    return (mapper_004_regs.mask & 0x18) && (mapper_004_regs.ctrl & 0x20);
+}
+
+/*
+8x16 sprites: pattern tables of the sprite slots of the scanline being counted (bit i for slot i),
+from the first 8 sprites on it in OAM as the CPU wrote it, so the PPU isn't waited for. Empty 
+slots fetch tile $FF, and all of them are empty on the pre-render scanline or when rendering
+was off at the start of the scanline. Worked out once per scanline, before OAM is written.
+*/
+static inline uint8_t mapper_004_sprites()
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+    uint16_t s      = PPU_tick_line(r->line);
+    uint8_t  height = (r->line_ctrl & 0x20) ? 16 : 8,
+             n      = 0;
+
+    if (r->line_spr_done)
+        return r->line_spr;
+
+    r->line_spr         = 0xFF;
+    r->line_spr_done    = true;
+    if (!(r->line_mask & 0x18) || s >= 240)
+        return r->line_spr;
+
+    for (uint8_t i = 0; i < 64 && n < 8; i++)
+    {
+        const uint8_t * sprite = &nes_ppu_thread.oam[i << 2];
+        if (sprite[0] <= s && s - sprite[0] < height)
+            r->line_spr &= ~((~sprite[1] & 0x1) << n++);
+    }
+
+    return r->line_spr;
+}
+
+/* Edges between dots 'from' and 'to' of the scanline at PPU tick r->line, with the current settings */
+static inline uint8_t mapper_004_edges(uint16_t from, uint16_t to, uint16_t * low, uint16_t * dots)
+{
+    const _mapper_004_regs * r = &mapper_004_regs;
+    uint16_t s      = PPU_tick_line(r->line);
+    uint8_t  spr    = (r->ctrl & 0x08) ? 0xFF : 0x00;
+
+    if (!(r->mask & 0x18) || (s >= 240 && s != 261))
+    {
+        *low = (*low + to - from < PPU_A12_LOW_LONG) ? *low + to - from : PPU_A12_LOW_LONG;
+        return 0;
+    }
+
+    if (r->ctrl & 0x20)
+        spr = mapper_004_sprites();
+
+    return PPU_a12_edges((r->ctrl & 0x10) >> 4, spr, from, to, low, dots);
+}
+
+/* Work out the edges of the scanline starting at PPU tick r->line */
+static inline void mapper_004_line_edges()
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+    uint16_t s = PPU_tick_line(r->line);
+
+    r->next             = 0;
+    r->low_next         = r->low;
+    r->line_ctrl        = r->ctrl;
+    r->line_mask        = r->mask;
+    r->line_spr_done    = false;
+
+    /* 8x8 sprites, and A12 was down for as long as usual before the scanline */
+    if ((r->mask & 0x18) && !(r->ctrl & 0x20) && r->low == ((s == 261) ? PPU_A12_LOW_LONG : r->pattern_low) && (s < 240 || s == 261))
+    {
+        r->edges    = (s == 261) ? r->pres : r->viss;
+        r->low_next = r->pattern_low;
+        memcpy(r->edge, (s == 261) ? r->pre : r->vis, r->edges * sizeof(uint16_t));
+    }
+    else
+        r->edges    = mapper_004_edges(0, 341, &r->low_next, r->edge);
+}
+
+/* One rising edge of A12 */
+static inline void mapper_004_clock()
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+
+    if (r->irq_counter == 0 || r->irq_reload)
+    {
+        r->irq_counter  = r->irq_latch;
+        r->irq_reload   = false;
+    }
+    else
+        r->irq_counter--;
+
+    if (r->irq_counter == 0 && r->irq_enabled)
+        nes_cpu_bus.IRQ |= MAPPER_IRQ;
 }
 
-/* Mapper 000 */
-void mapper_000(FILE * rom)
+/* Count the edges before PPU tick 'now' */
+static inline void mapper_004_run_to(uint64_t now)
 {
-    /* Set PEEK and POKE functions respectively */
-    PEEK_MAPPER = PEEK_000;
-    POKE_MAPPER = POKE_000;
+    _mapper_004_regs * r = &mapper_004_regs;
 
-    /* Program ROM, loaded in CPU bus in the range $8000-$FFFF */
-    if (fread(&nes_cartridge.nes_mem[0x8000], sizeof(uint8_t), nes_cartridge.PRG_ROM_size, rom) != nes_cartridge.PRG_ROM_size)
+    for (;;)
     {
-        fprintf(stderr, "error: Failed to copy PRG-ROM: %s. exiting\n", strerror(errno));
+        for (; r->next < r->edges && r->line + r->edge[r->next] < now; r->next++)
+            mapper_004_clock();
+
+        if (r->line + 341 >= now)
+            break;
+
+        r->line += 341;
+        r->low   = r->low_next;
+        mapper_004_line_edges();
+    }
+}
+
+/* Set up the next event: the edge that raises the IRQ, and with 8x16 sprites the next edge or scanline too */
+static inline void mapper_004_schedule()
+{
+    const _mapper_004_regs * r = &mapper_004_regs;
+    uint64_t at = UINT64_MAX;
+
+    if (mapper_004_tall())
+        at = (r->next < r->edges) ? r->line + r->edge[r->next] : r->line + 341;
+    else if (r->irq_enabled && (r->mask & 0x18) && PPU_tick_line(r->line + 341) < 240 && r->low_next != r->pattern_low)
+    {
+        /* The next scanline isn't like the others (the settings just changed), it is worked out when it starts */
+        at = (r->next < r->edges) ? r->line + r->edge[r->next] : r->line + 341;
+    }
+    else if (r->irq_enabled && (r->mask & 0x18) && (r->pres || r->viss))
+    {
+        /* Edges until the counter gets to 0 */
+        uint32_t n      = (r->irq_counter == 0 || r->irq_reload) ? r->irq_latch + 1 : r->irq_counter,
+                 frame  = r->pres + 240 * r->viss;
+        uint64_t line   = r->line;
+        uint8_t  i      = r->next,
+                 edges  = r->edges;
+        const uint16_t * edge = r->edge;
+
+        while (n > edges - i)
+        {
+            n    -= edges - i;
+            line += 341;
+            i     = 0;
+
+            /* Whole frames at a time from the pre-render scanline, nothing happens in v-blank */
+            uint16_t s = PPU_tick_line(line);
+            if (s == 261)
+            {
+                for (; n > frame; n -= frame)
+                    line += NES_PPU_FRAME_DOTS;
+            }
+            else if (s >= 240)
+            {
+                line += (uint64_t)(261 - s) * 341;
+                s     = 261;
+            }
+
+            edges = (s == 261) ? r->pres : r->viss;
+            edge  = (s == 261) ? r->pre  : r->vis;
+        }
+
+        at = line + edge[i + n - 1];
+    }
+
+    /* Tick 't' is done by master cycle 4t + 4 */
+    nes_cartridge.sync = (at == UINT64_MAX) ? UINT64_MAX : (at + 1) * NES_PPU_DIVIDER;
+}
+
+/* Timed event: the IRQ is due, or (8x16 sprites) the next edge or scanline */
+void mapper_004_event()
+{
+    mapper_004_run_to(PPU_ticks_now());
+    mapper_004_schedule();
+}
+
+/* PPUCTRL and PPUMASK decide where the edges are, and with 8x16 sprites so does OAM */
+void mapper_004_ppu_write(uint8_t reg, uint8_t data)
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+
+    /* OAM is about to change, the sprites of the scanline being counted were found before that */
+    if ((reg == OAMDATA || reg == NES_PPU_QUEUE_OAM) && ((r->mask | r->line_mask) & 0x18))
+    {
+        mapper_004_run_to(PPU_ticks_now());
+        mapper_004_sprites();
         return;
     }
 
-    /* Character ROM, loaded in PPU bus */
-    if (fread(nes_ppu_bus.mem, sizeof(uint8_t), nes_cartridge.CHR_ROM_size, rom) != nes_cartridge.CHR_ROM_size)
+    if (reg != PPUCTRL && reg != PPUMASK)
+        return;
+
+    uint8_t  ctrl   = (reg == PPUCTRL) ? data : r->ctrl,
+             mask   = (reg == PPUMASK) ? data : r->mask;
+    uint64_t now    = PPU_ticks_now();
+
+    /* Sprite size, pattern tables and rendering on or off */
+    if ((ctrl & 0x38) == (r->ctrl & 0x38) && ((mask & 0x18) != 0) == ((r->mask & 0x18) != 0))
     {
-        fprintf(stderr, "error: Failed to copy CHR-ROM: %s. exiting\n", strerror(errno));
+        r->ctrl = ctrl;
+        r->mask = mask;
         return;
     }
 
-    printf("Successfully mapped memory (mapper_000)!\n");
-}
-
-/* Default NULL mapper */
-void mapper_NULL(FILE * rom)
-{
-    return;
-}
-
-/* Function pointer to select correct mapper */
-void (*mapper[256])(FILE*) = {
-    mapper_000,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL,
-    mapper_NULL
+    mapper_004_run_to(now);
+
+    /* The rest of the scanline goes by the new settings, from where A12 is at with the old ones */
+    uint16_t dot = now - r->line,
+             low = r->low,
+             old[PPU_A12_EDGES_MAX];
+    mapper_004_edges(0, dot, &low, old);
+
+    r->ctrl     = ctrl;
+    r->mask     = mask;
+    r->next     = 0;
+    r->edges    = mapper_004_edges(dot, 341, &low, r->edge);
+    r->low_next = low;
+    mapper_004_patterns();
+
+    mapper_004_schedule();
+}
+
+static inline void mapper_004_update()
+{
+    const _mapper_004_regs * r = &mapper_004_regs;
+    bool     prg_mode   = r->select & 0x40;
+    uint16_t inv        = (r->select & 0x80) ? 0x1000 : 0;
+
+    CPU_map_prg(0x8000, 0x2000, prg_mode ? -2 : r->bank[6]);
+    CPU_map_prg(0xA000, 0x2000, r->bank[7]);
+    CPU_map_prg(0xC000, 0x2000, prg_mode ? r->bank[6] : -2);
+    CPU_map_prg(0xE000, 0x2000, -1);
+
+    PPU_map_chr(0x0000 ^ inv, 0x800, r->bank[0] >> 1);
+    PPU_map_chr(0x0800 ^ inv, 0x800, r->bank[1] >> 1);
+    for (uint8_t i = 0; i < 4; i++)
+        PPU_map_chr((0x1000 + i * 0x400) ^ inv, 0x400, r->bank[2 + i]);
+}
+
+void mapper_004_write(uint16_t addr, uint8_t data)
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+
+    switch (addr & 0xE001)
+    {
+        case 0x8000:
+            r->select = data;
+            mapper_004_update();
+            break;
+        case 0x8001:
+            r->bank[r->select & 0x7] = data;
+            mapper_004_update();
+            break;
+        case 0xA000:
+            if (nes_cartridge.mirroring != PPU_MIRROR_FOUR_SCREEN)
+                PPU_set_mirroring((data & 0x1) ? PPU_MIRROR_HORIZONTAL : PPU_MIRROR_VERTICAL);
+            break;
+        case 0xC000:
+            mapper_004_run_to(PPU_ticks_now());
+            r->irq_latch = data;
+            mapper_004_schedule();
+            break;
+        case 0xC001:
+            mapper_004_run_to(PPU_ticks_now());
+            r->irq_counter  = 0;
+            r->irq_reload   = true;
+            mapper_004_schedule();
+            break;
+        case 0xE000:
+            mapper_004_run_to(PPU_ticks_now());
+            r->irq_enabled  = false;
+            nes_cpu_bus.IRQ &= ~MAPPER_IRQ;
+            mapper_004_schedule();
+            break;
+        case 0xE001:
+            mapper_004_run_to(PPU_ticks_now());
+            r->irq_enabled  = true;
+            mapper_004_schedule();
+            break;
+    }
+}
+
+void mapper_004()
+{
+    _mapper_004_regs * r = &mapper_004_regs;
+
+    memset(r, 0, sizeof(mapper_004_regs));
+    r->line = PPU_ticks_now() - PPU_ticks_now() % 341;
+    r->low  = PPU_A12_LOW_LONG;
+    mapper_004_patterns();
+    mapper_004_line_edges();
+
+    nes_cartridge.write     = mapper_004_write;
+    nes_cartridge.ppu_write = mapper_004_ppu_write;
+    nes_cartridge.event     = mapper_004_event;
+    mapper_004_update();
+}
+
+/* Mapper 007 (AxROM): 32 KiB PRG bank, and the nametable all 4 slots show */
+void mapper_007_write(uint16_t addr, uint8_t data)
+{
+    CPU_map_prg(0x8000, 0x8000, data & 0x7);
+    PPU_set_mirroring((data & 0x10) ? PPU_MIRROR_SINGLE_HI : PPU_MIRROR_SINGLE_LO);
+}
+
+void mapper_007()
+{
+    nes_cartridge.write = mapper_007_write;
+    mapper_007_write(0x8000, 0x00);
+    PPU_map_chr(0x0000, 0x2000, 0);
+}
+
+/* Mappers by iNES number, NULL where there's no support for one */
+void (*mapper[256])(void) = {
+    [0] = mapper_000,
+    [1] = mapper_001,
+    [2] = mapper_002,
+    [3] = mapper_003,
+    [4] = mapper_004,
+    [7] = mapper_007
 };
 
-/* Tick function (1 CPU cycle = 3 PPU cycles) */
-static inline void tick()
+/*
+Set up the bus for mapper 'id', with PRG-ROM and CHR already loaded: internal RAM mirrored
+up to $1FFF, 8 KiB of WRAM at $6000, the header's mirroring and the mapper's power-on banks
+*/
+static inline void mapper_init(uint8_t id)
 {
-    PPU_tick();
-    PPU_tick();
-    PPU_tick();
-    //APU_tick();
+    PEEK_MAPPER     = PEEK_CART;
+    POKE_MAPPER     = POKE_CART;
+    APU_dmc_read    = PEEK_CART;
+
+    nes_cartridge.write     = NULL;
+    nes_cartridge.ppu_write = NULL;
+    nes_cartridge.event     = NULL;
+    nes_cartridge.sync      = UINT64_MAX;
+    for (uint8_t i = 0; i < 4; i++)
+        CPU_map_page(i, nes_cartridge.nes_mem);
+    for (uint8_t i = 12; i < 16; i++)
+        CPU_map_page(i, &nes_cartridge.nes_mem[i << NES_CPU_PAGE_SHIFT]);
+
+    PPU_set_mirroring(nes_cartridge.mirroring);
+    mapper[id]();
+}
+
+/* Tick function (1 CPU cycle = 3 PPU cycles), advances the CPU by 'cycles', the PPU and APU only run at their sync points */
+static inline void tick(uint16_t cycles)
+{
+    nes_clock.cpu += (uint64_t)cycles * NES_CPU_DIVIDER;
+
+    if (nes_ppu_thread.enabled)
+        atomic_store_explicit(&nes_ppu_thread.cpu_now, nes_clock.cpu, memory_order_release);
+
+    if (nes_clock.cpu >= nes_clock.sync)
+        PPU_catch_up();
+
+    if (nes_clock.cpu / NES_CPU_DIVIDER >= nes_apu.sync)
+        APU_sync(nes_clock.cpu / NES_CPU_DIVIDER);
+
+    if (nes_clock.cpu >= nes_cartridge.sync)
+        nes_cartridge.event();
 }
\ No newline at end of file
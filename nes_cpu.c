@@ -9,9 +9,30 @@
 
 #include "interface.h"
 #include "nes_cpu.h"
+#include "nes_ppu_debug.h"
+#include "nes_pacing.h"
+#include "nes_nsf.h"
+#include "nes_rom.h"
 
 size_t file_size;
 
+bool nes_cpu_trace = false;     /* Print every instruction (slow) */
+
+/* Frontend, the emulation runs on its own thread and hands finished frames to the presenter */
+Frame_mailbox   nes_frames;
+atomic_int      nes_exit_code;  /* Set by either side to stop both */
+
+/* Audio device, fed by the emulation thread once a frame */
+Audio           nes_audio;
+bool            nes_audio_on = false;
+
+/* Headless runs: no window, the emulation runs on the main thread and frames go nowhere */
+bool            nes_headless = false;
+uint64_t        nes_frame_limit = 0;        /* Stop after this many frames (0: never) */
+uint64_t        nes_frame_count = 0;
+Capture         nes_capture;                /* Audio written to a file */
+bool            nes_capture_on = false;
+
 /* init NES cpu internals */
 int nes_init_cpu()
 {
@@ -95,34 +116,15 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
     /* Mapper ID */
     uint8_t mapper_ID = 0;
 
-    /* Debug info to measure # of bytes copied */
-    size_t bytes_copied = 0;
-
-    /* If the file pointer is empty, something went wrong with opening it. */
-    FILE * rom;
-    rom = fopen(filename, "rb");
-    if (rom == NULL) 
-    {
-        fprintf(stderr, "error: failed to open %s for writing: %s\n", filename, strerror(errno));
+    /* The file is mapped, the header and the ROM banks are read right from it */
+    const _nes_rom_image * rom = nes_rom_open(filename);
+    if (rom == NULL)
         return -1;
-    }
-    else
-    {
-        printf("Successfully opened rom %s!\n", filename);
-    }
 
-    /* Get the size of the rom */
-    fseek(rom, 0, SEEK_END);
-    file_size = ftell(rom);
-    rewind(rom);
+    printf("Successfully opened rom %s!\n", filename);
+    file_size = rom->size;
 
-    /* Buffer for the header of the ROM */
-    uint8_t * header = malloc(16 * sizeof(uint8_t));
-    if(!fread(header, sizeof(uint8_t), 16, rom))
-    {
-        fprintf(stderr, "error: Failed to copy ROM header! exiting");
-        return -1;
-    }
+    const uint8_t * header = rom->data;
 
     /* Set cartridge address space to the NES address space */
     cart->nes_mem = nes_cpu_mem.mem;
@@ -159,25 +161,41 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
             /* Flags 6 and 7 combined into a single byte for your viewing pleasure B-) */
             uint8_t flags = (uint8_t)(header[7] & 0x0F) << 4 | ((header[6] & 0x0F));
 
-            /* TO-DO: check other flags in 6 & 7 */
+            /* Nametable mirroring (four-screen overrides the mirroring bit), mappers that switch it start from here */
+            cart->mirroring = (flags & 0x8) ? PPU_MIRROR_FOUR_SCREEN : 
+                              (flags & 0x1) ? PPU_MIRROR_VERTICAL : PPU_MIRROR_HORIZONTAL;
 
-            /* Check for trainer, load it into address space $7000 */
-            if (flags & 0x4)
-                fread(&nes_cpu_mem.mem[0x7000], sizeof(uint8_t), 0x200, rom);
+            /* TO-DO: check other flags in 6 & 7 */
 
-            /* Load rom according to which mapper is being used */
-            if(mapper_ID > 0)
+            if (mapper[mapper_ID] == NULL || cart->PRG_ROM_size == 0)
             {
                 fprintf(stderr, "error: Unimplemented mapper number %d. exiting.\n", mapper_ID);
                 return -1;
             }
-            else
+
+            /* Trainer (512 bytes after the header), PRG-ROM, then CHR-ROM */
+            size_t prg = NES_ROM_HEADER_SIZE + ((flags & 0x4) ? 0x200 : 0),
+                   chr = prg + cart->PRG_ROM_size;
+
+            if (chr + cart->CHR_ROM_size > rom->size)
             {
-                /* Call the mapper based on the ID */
-                (*mapper[mapper_ID])(rom);
+                fprintf(stderr, "error: %s is cut short (%zu bytes, the header says %zu). exiting\n", filename, rom->size, chr + cart->CHR_ROM_size);
+                return -1;
             }
-            
-            /* TO-DO: load CHR-ROM/RAM into memory and map memory accordingly. */
+
+            /* Check for trainer, load it into address space $7000 */
+            if (flags & 0x4)
+                memcpy(&nes_cpu_mem.mem[0x7000], &rom->data[NES_ROM_HEADER_SIZE], 0x200);
+
+            /* PRG-ROM and CHR-ROM stay in the file's mapping (never written to), no CHR-ROM means 8 KiB of CHR-RAM */
+            cart->PRG_ROM   = (uint8_t *) &rom->data[prg];
+            cart->CHR       = cart->CHR_ROM_size ? (uint8_t *) &rom->data[chr] : nes_ppu_bus.mem;
+            cart->CHR_size  = cart->CHR_ROM_size ? cart->CHR_ROM_size : 0x2000;
+            nes_ppu_bus.chr_rom = cart->CHR_ROM_size != 0;
+
+            /* Map the mapper's power-on banks */
+            mapper_init(mapper_ID);
+            printf("Successfully mapped memory (mapper %03d)!\n", mapper_ID);
         }
 
         printf("Format:\t%s\n", format);
@@ -188,796 +206,811 @@ int nes_load_rom(const char * filename, _nes_cartridge * cart)
         return -1;
     }
 
-    /* Finally, clear the file pointer and return 0 */
-    fclose(rom);
-
     nes_cpu_registers.PC = (uint16_t)PEEK(nes_cpu_registers.PC + 1) << 8 | PEEK(nes_cpu_registers.PC);
     //nes_cpu_registers.PC = 0x8000;
     return 0;
 }
 
-typedef union _PPU_pix
+/* NES screen */
+/*
+void PPU_write(Display * disp)
 {
-    uint16_t row;
-    struct 
-    {
-        uint8_t pix7 : 2;
-        uint8_t pix6 : 2;
-        uint8_t pix5 : 2;
-        uint8_t pix4 : 2;
-        uint8_t pix3 : 2;
-        uint8_t pix2 : 2;
-        uint8_t pix1 : 2;
-        uint8_t pix0 : 2;
-    };
+    for (size_t i = 0; i < 241; i++)
+        write_ARGB8888_arr_to_display(disp, 0, i, &(nes_ppu.screen_buffer[]))
 }
-_PPU_pix;
+*/
 
-/* PPU pattern table dump for debug purposes */
-static inline void PPU_pattern_table_dump(Display * disp, bool page)
+/* Finally, the "meat and potatoes" of the emulator, the interpreter! Runs one instruction, then takes a pending interrupt */
+static inline void CPU_step()
 {
-    const uint32_t gray_scale_pix[] = {
-        0xFF000000,
-        0xFF444444,
-        0xFFCCCCCC,
-        0xFFFFFFFF
-    };
+    uint8_t opcode;
 
-    uint32_t pix_seq[8];
+    /* PPUDATA upload loops are done in bulk */
+    if (nes_ppudata_loop.match && nes_cpu_registers.PC == nes_ppudata_loop.head)
+        ppudata_loop_run();
 
-    _PPU_pix pix_row;
+    /* Fetch opcode from memory */
+    opcode = PEEK(nes_cpu_registers.PC);
+    
+    /* Cycles are counted per instruction (page crossings are added while getting the operand) */
+    nes_cpu_registers.Cycles = 0;
+    operand_write_only = nes_2A02_cpu_opcode_map[opcode].W;
+    get_operand_AM(nes_2A02_cpu_opcode_map[opcode].AM);
+    if (nes_cpu_trace)
+        print_nes_cpu_trace(opcode);
 
-    for (size_t i = 0; i < 128; i++)
+    /* Decode and execute the opcode */
+    switch (opcode)
     {
-        for (size_t j = 0; j < 16; j++)
-        {
-            uint8_t t_row = (i >> 3);
-            uint8_t hi = nes_ppu.PPU_Pattern_bytes[page][(t_row << 8) | (j << 4) + 8 + (i & 0x7)],
-                    lo = nes_ppu.PPU_Pattern_bytes[page][(t_row << 8) | (j << 4) + (i & 0x7)];
+        case BRK_IMP:   
+            BRK();
+            nes_cpu_registers.Cycles = 7;
+            break;
+        case ORA_INDX:  
+            ORA();
+            nes_cpu_registers.Cycles = 6;
+            break;
+        case ORA_ZP:    
+            ORA(); 
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case ASL_ZP:    
+            ASL(); 
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case PHP_IMP:   
+            PHP();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case ORA_IMM:   
+            ORA(); 
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ASL_ACC:   
+            ASL();
+            nes_cpu_registers.A = nes_cpu_bus.DB;
+             
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ORA_ABS:   
+            ORA(); 
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ASL_ABS:   
+            ASL();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BPL_REL:   
+            BPL();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ORA_INDY:  
+            ORA();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case ORA_ZPX:   
+            ORA();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ASL_ZPX:   
+            ASL();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case CLC_IMP:   
+            CLC();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ORA_ABSY:  
+            ORA();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case ORA_ABSX:  
+            ORA();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case ASL_ABSX:  
+            ASL();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        case JSR_ABS:   
+            JSR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case AND_INDX:  
+            AND();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BIT_ZP:    
+            BIT();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case AND_ZP:    
+            AND();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case ROL_ZP:    
+            ROL();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case PLP_IMP:   
+            PLP();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case AND_IMM:   
+            AND();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ROL_ACC:   
+            ROL(); 
+            nes_cpu_registers.A = nes_cpu_bus.DB;
+             
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case BIT_ABS:   
+            BIT();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case AND_ABS:   
+            AND();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ROL_ABS:   
+            ROL();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BMI_REL:   
+            BMI();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case AND_INDY:  
+            AND();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case AND_ZPX:   
+            AND();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ROL_ZPX:   
+            ROL();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case SEC_IMP:   
+            SEC();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case AND_ABSY:  
+            AND();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case AND_ABSX:  
+            AND();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case ROL_ABSX:  
+            ROL();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        case RTI_IMP:   
+            RTI();
+            nes_cpu_registers.Cycles = 6;
+            break;
+        case EOR_INDX:  
+            EOR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case EOR_ZP:    
+            EOR();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case LSR_ZP:    
+            LSR();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case PHA_IMP:  
+            PHA();
+            nes_cpu_registers.Cycles = 3;
+            break;
+        case EOR_IMM:   
+            EOR();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LSR_ACC:   
+            LSR(); 
+            nes_cpu_registers.A = nes_cpu_bus.DB;
+             
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case JMP_ABS:   
+            JMP();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case EOR_ABS:   
+            EOR();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LSR_ABS:   
+            LSR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BVC_REL:   
+            BVC();
+            nes_cpu_registers.Cycles += 2; 
+            break;
+        case EOR_INDY:  
+            EOR();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case EOR_ZPX:   
+            EOR();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LSR_ZPX:   
+            LSR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case CLI_IMP:   
+            CLI();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case EOR_ABSY:  
+            EOR();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case EOR_ABSX:  
+            EOR();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case LSR_ABSX:  
+            LSR();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        case RTS_IMP:   
+            RTS();
+            nes_cpu_registers.Cycles = 6;
+            break;
+        case ADC_INDX:  
+            ADC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case ADC_ZP:    
+            ADC();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case ROR_ZP:    
+            ROR();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case PLA_IMP:   
+            PLA();
+            nes_cpu_registers.Cycles = 4;
+            break;
+        case ADC_IMM:   
+            ADC();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case ROR_ACC:   
+            ROR(); 
+            nes_cpu_registers.A = nes_cpu_bus.DB;
+             
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case JMP_IND: 
+            JMP();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case ADC_ABS:   
+            ADC();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ROR_ABS:   
+            ROR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BVS_REL:   
+            BVS();
+            nes_cpu_registers.Cycles += 2; 
+            break;
+        case ADC_INDY:  
+            ADC();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case ADC_ZPX:   
+            ADC();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case ROR_ZPX:   
+            ROR();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case SEI_IMP:   
+            SEI();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case ADC_ABSY:  
+            ADC();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case ADC_ABSX:  
+            ADC();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case ROR_ABSX:  
+            ROR();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        case STA_INDX:  
+            STA();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case STY_ZP:    
+            STY();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case STA_ZP:    
+            STA();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case STX_ZP:    
+            STX();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case DEY_IMP:   
+            DEY();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case TXA_IMP:   
+            TXA();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case STY_ABS:   
+            STY();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case STA_ABS:   
+            STA();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case STX_ABS:   
+            STX();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case BCC_REL:   
+            BCC();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case STA_INDY:  
+            STA();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case STY_ZPX:   
+            STY();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case STA_ZPX:   
+            STA();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case STX_ZPY:   
+            STX();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case TYA_IMP:   
+            TYA();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case STA_ABSY:  
+            STA();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case TXS_IMP:   
+            TXS();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case STA_ABSX:  
+            STA();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case LDY_IMM:   
+             
+            LDY();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LDA_INDX:  
+             
+            LDA();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case LDX_IMM:   
+             
+            LDX();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LDY_ZP:    
+             
+            LDY();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case LDA_ZP:    
+             
+            LDA();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case LDX_ZP:    
+             
+            LDX();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case TAY_IMP:   
             
-            pix_row.row = conv_to_pix_row(hi, lo);
-
-            pix_seq[0] = gray_scale_pix[pix_row.pix0];
-            pix_seq[1] = gray_scale_pix[pix_row.pix1];
-            pix_seq[2] = gray_scale_pix[pix_row.pix2];
-            pix_seq[3] = gray_scale_pix[pix_row.pix3];
-            pix_seq[4] = gray_scale_pix[pix_row.pix4];
-            pix_seq[5] = gray_scale_pix[pix_row.pix5];
-            pix_seq[6] = gray_scale_pix[pix_row.pix6];
-            pix_seq[7] = gray_scale_pix[pix_row.pix7];
-
-            write_ARGB8888_arr_to_display(disp, (j*8), i, pix_seq, 8, 1);
-        }
+            TAY();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case LDA_IMM:   
+             
+            LDA();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case TAX_IMP:   
+            
+            TAX();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LDY_ABS:   
+             
+            LDY();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LDA_ABS:   
+             
+            LDA();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LDX_ABS:   
+             
+            LDX();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case BCS_REL:   
+             
+            BCS();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LDA_INDY:  
+             
+            LDA();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case LDY_ZPX:   
+             
+            LDY();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LDA_ZPX:   
+             
+            LDA();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case LDX_ZPY:   
+             
+            LDX();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case CLV_IMP:   
+             
+            CLV();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case LDA_ABSY:  
+             
+            LDA();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case TSX_IMP:   
+            TSX();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case LDY_ABSX:  
+             
+            LDY();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case LDA_ABSX:  
+             
+            LDA();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case LDX_ABSY:  
+             
+            LDX();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case CPY_IMM:   
+             
+            CPY();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CMP_INDX:  
+            CMP();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case CPY_ZP:    
+             
+            CPY();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case CMP_ZP:    
+             
+            CMP();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case DEC_ZP:    
+             
+            DEC();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case INY_IMP:   
+             
+            INY();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CMP_IMM:   
+             
+            CMP();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case DEX_IMP:   
+             
+            DEX();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CPY_ABS:   
+             
+            CPY();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case CMP_ABS:   
+             
+            CMP();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case DEC_ABS:   
+            DEC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BNE_REL:   
+            BNE();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CMP_INDY:  
+            CMP();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case CMP_ZPX:   
+            CMP();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case DEC_ZPX:   
+            DEC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case CLD_IMP:   
+            CLD();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CMP_ABSY:  
+            CMP();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case CMP_ABSX:  
+            CMP();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case DEC_ABSX:  
+            DEC();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        case CPX_IMM:   
+            CPX();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case SBC_INDX:  
+            SBC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case CPX_ZP:    
+            CPX();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case SBC_ZP:    
+            SBC();
+            nes_cpu_registers.Cycles = 3; 
+            break;
+        case INC_ZP:    
+            INC();
+            nes_cpu_registers.Cycles = 5; 
+            break;
+        case INX_IMP:   
+            INX();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case SBC_IMM:   
+            SBC();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case NOP_IMP:   
+            NOP();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case CPX_ABS:   
+            CPX();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case SBC_ABS:   
+            SBC();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case INC_ABS:   
+            INC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case BEQ_REL:   
+            BEQ();
+            nes_cpu_registers.Cycles = 2; 
+            break;
+        case SBC_INDY:  
+            SBC();
+            nes_cpu_registers.Cycles += 5; 
+            break;
+        case SBC_ZPX:   
+            SBC();
+            nes_cpu_registers.Cycles = 4; 
+            break;
+        case INC_ZPX:   
+            INC();
+            nes_cpu_registers.Cycles = 6; 
+            break;
+        case SED_IMP:   
+            SED();
+            nes_cpu_registers.Cycles = 2;
+            break;
+        case SBC_ABSY:  
+            SBC();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case SBC_ABSX:  
+            SBC();
+            nes_cpu_registers.Cycles += 4; 
+            break;
+        case INC_ABSX:   
+            INC();
+            nes_cpu_registers.Cycles = 7; 
+            break;
+        default:
+            fprintf(stderr, "error: unknown opcode 0x%02X\n", opcode);
     }
-}
-
-/* PPU pallete table dump for debug purposes */
-
-void PPU_pallete_table_dump(Display * disp)
-{
-    uint32_t    bg_seq[128],
-                fg_seq[128];
+    
+    /* Increment the program counter accordingly */
+    nes_cpu_registers.PC += PC_offset;
+    
+    /* The clock of the emulator, for timing purposes */
+    CPU_wait();
 
-    /* Print background pallete */
-    for (size_t i = 0; i < 16; i++)
+    /* NMI is taken between instructions, so is IRQ (as long as something holds the line and it isn't masked) */
+    if (nes_cpu_bus.NMI)
     {
-        write_ARGB8888_pixel_to_display(disp, (i * 4),      247, NES_palette[nes_ppu.PPU_Pallete_Data[0][i]]);
-        write_ARGB8888_pixel_to_display(disp, (i * 4 + 1),  247, NES_palette[nes_ppu.PPU_Pallete_Data[0][i]]);
-        write_ARGB8888_pixel_to_display(disp, (i * 4 + 2),  247, NES_palette[nes_ppu.PPU_Pallete_Data[0][i]]);
-        write_ARGB8888_pixel_to_display(disp, (i * 4 + 3),  247, NES_palette[nes_ppu.PPU_Pallete_Data[0][i]]);   
+        nes_cpu_bus.NMI = false;
+        NMI();
+        CPU_wait();
     }
-
-    /* Print foreground pallete */
-    for (size_t i = 0; i < 16; i++)
+    else if (nes_cpu_bus.IRQ && !get_flag(I))
     {
-        write_ARGB8888_pixel_to_display(disp, 128 + (i * 4),      247, NES_palette[nes_ppu.PPU_Pallete_Data[1][i]]);
-        write_ARGB8888_pixel_to_display(disp, 128 + (i * 4 + 1),  247, NES_palette[nes_ppu.PPU_Pallete_Data[1][i]]);
-        write_ARGB8888_pixel_to_display(disp, 128 + (i * 4 + 2),  247, NES_palette[nes_ppu.PPU_Pallete_Data[1][i]]);
-        write_ARGB8888_pixel_to_display(disp, 128 + (i * 4 + 3),  247, NES_palette[nes_ppu.PPU_Pallete_Data[1][i]]);
-    }    
-}
-
-/* NES screen */
-/*
-void PPU_write(Display * disp)
-{
-    for (size_t i = 0; i < 241; i++)
-        write_ARGB8888_arr_to_display(disp, 0, i, &(nes_ppu.screen_buffer[]))
+        IRQ();
+        CPU_wait();
+    }
 }
-*/
 
-/* Finally, the "meat and potatoes" of the emulator, the interpreter! */
-void interpret(Display * disp, Display * PPU_debug)
+/* Runs the game until it ends, checking in with the frontend once a frame */
+void interpret()
 {
-    uint8_t opcode, no_of_breaks = 0; 
     int exit_code = 0;
     while( exit_code == 0 )
     {
-        /* Fetch opcode from memory */
-        opcode = PEEK(nes_cpu_registers.PC);
-        
-        get_operand_AM(nes_2A02_cpu_opcode_map[opcode].AM);
-        print_nes_cpu_trace(opcode);
+        CPU_step();
 
-        /* Decode and execute the opcode */
-        switch (opcode)
+        /* 
+        The frontend is checked once per frame, at the start of v-blank: the frame is done (if 
+        it was rendered) and the game hasn't read the controllers in its NMI yet.
+        */
+        if ( nes_ppu.frame_end )
         {
-            case BRK_IMP:   
-                BRK();
-                nes_cpu_registers.Cycles = 7;
-                break;
-            case ORA_INDX:  
-                ORA();
-                nes_cpu_registers.Cycles = 6;
-                break;
-            case ORA_ZP:    
-                ORA(); 
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case ASL_ZP:    
-                ASL(); 
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case PHP_IMP:   
-                PHP();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case ORA_IMM:   
-                ORA(); 
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ASL_ACC:   
-                ASL();
-                nes_cpu_registers.A = nes_cpu_bus.DB;
-                 
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ORA_ABS:   
-                ORA(); 
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ASL_ABS:   
-                ASL();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BPL_REL:   
-                BPL();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ORA_INDY:  
-                ORA();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case ORA_ZPX:   
-                ORA();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ASL_ZPX:   
-                ASL();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case CLC_IMP:   
-                CLC();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ORA_ABSY:  
-                ORA();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case ORA_ABSX:  
-                ORA();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case ASL_ABSX:  
-                ASL();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            case JSR_ABS:   
-                JSR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case AND_INDX:  
-                AND();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BIT_ZP:    
-                BIT();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case AND_ZP:    
-                AND();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case ROL_ZP:    
-                ROL();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case PLP_IMP:   
-                PLP();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case AND_IMM:   
-                AND();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ROL_ACC:   
-                ROL(); 
-                nes_cpu_registers.A = nes_cpu_bus.DB;
-                 
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case BIT_ABS:   
-                BIT();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case AND_ABS:   
-                AND();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ROL_ABS:   
-                ROL();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BMI_REL:   
-                BMI();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case AND_INDY:  
-                AND();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case AND_ZPX:   
-                AND();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ROL_ZPX:   
-                ROL();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case SEC_IMP:   
-                SEC();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case AND_ABSY:  
-                AND();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case AND_ABSX:  
-                AND();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case ROL_ABSX:  
-                ROL();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            case RTI_IMP:   
-                RTI();
-                nes_cpu_registers.Cycles = 6;
-                break;
-            case EOR_INDX:  
-                EOR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case EOR_ZP:    
-                EOR();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case LSR_ZP:    
-                LSR();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case PHA_IMP:  
-                PHA();
-                nes_cpu_registers.Cycles = 3;
-                break;
-            case EOR_IMM:   
-                EOR();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LSR_ACC:   
-                LSR(); 
-                nes_cpu_registers.A = nes_cpu_bus.DB;
-                 
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case JMP_ABS:   
-                JMP();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case EOR_ABS:   
-                EOR();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LSR_ABS:   
-                LSR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BVC_REL:   
-                BVC();
-                nes_cpu_registers.Cycles += 2; 
-                break;
-            case EOR_INDY:  
-                EOR();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case EOR_ZPX:   
-                EOR();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LSR_ZPX:   
-                LSR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case CLI_IMP:   
-                CLI();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case EOR_ABSY:  
-                EOR();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case EOR_ABSX:  
-                EOR();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case LSR_ABSX:  
-                LSR();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            case RTS_IMP:   
-                RTS();
-                nes_cpu_registers.Cycles = 6;
-                break;
-            case ADC_INDX:  
-                ADC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case ADC_ZP:    
-                ADC();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case ROR_ZP:    
-                ROR();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case PLA_IMP:   
-                PLA();
-                nes_cpu_registers.Cycles = 4;
-                break;
-            case ADC_IMM:   
-                ADC();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case ROR_ACC:   
-                ROR(); 
-                nes_cpu_registers.A = nes_cpu_bus.DB;
-                 
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case JMP_IND: 
-                JMP();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case ADC_ABS:   
-                ADC();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ROR_ABS:   
-                ROR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BVS_REL:   
-                BVS();
-                nes_cpu_registers.Cycles += 2; 
-                break;
-            case ADC_INDY:  
-                ADC();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case ADC_ZPX:   
-                ADC();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case ROR_ZPX:   
-                ROR();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case SEI_IMP:   
-                SEI();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case ADC_ABSY:  
-                ADC();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case ADC_ABSX:  
-                ADC();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case ROR_ABSX:  
-                ROR();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            case STA_INDX:  
-                STA();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case STY_ZP:    
-                STY();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case STA_ZP:    
-                STA();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case STX_ZP:    
-                STX();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case DEY_IMP:   
-                DEY();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case TXA_IMP:   
-                TXA();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case STY_ABS:   
-                STY();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case STA_ABS:   
-                STA();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case STX_ABS:   
-                STX();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case BCC_REL:   
-                BCC();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case STA_INDY:  
-                STA();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case STY_ZPX:   
-                STY();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case STA_ZPX:   
-                STA();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case STX_ZPY:   
-                STX();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case TYA_IMP:   
-                TYA();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case STA_ABSY:  
-                STA();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case TXS_IMP:   
-                TXS();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case STA_ABSX:  
-                STA();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case LDY_IMM:   
-                 
-                LDY();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LDA_INDX:  
-                 
-                LDA();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case LDX_IMM:   
-                 
-                LDX();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LDY_ZP:    
-                 
-                LDY();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case LDA_ZP:    
-                 
-                LDA();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case LDX_ZP:    
-                 
-                LDX();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case TAY_IMP:   
-                
-                TAY();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case LDA_IMM:   
-                 
-                LDA();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case TAX_IMP:   
-                
-                TAX();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LDY_ABS:   
-                 
-                LDY();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LDA_ABS:   
-                 
-                LDA();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LDX_ABS:   
-                 
-                LDX();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case BCS_REL:   
-                 
-                BCS();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LDA_INDY:  
-                 
-                LDA();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case LDY_ZPX:   
-                 
-                LDY();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LDA_ZPX:   
-                 
-                LDA();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case LDX_ZPY:   
-                 
-                LDX();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case CLV_IMP:   
-                 
-                CLV();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case LDA_ABSY:  
-                 
-                LDA();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case TSX_IMP:   
-                TSX();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case LDY_ABSX:  
-                 
-                LDY();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case LDA_ABSX:  
-                 
-                LDA();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case LDX_ABSY:  
-                 
-                LDX();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case CPY_IMM:   
-                 
-                CPY();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CMP_INDX:  
-                CMP();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case CPY_ZP:    
-                 
-                CPY();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case CMP_ZP:    
-                 
-                CMP();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case DEC_ZP:    
-                 
-                DEC();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case INY_IMP:   
-                 
-                INY();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CMP_IMM:   
-                 
-                CMP();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case DEX_IMP:   
-                 
-                DEX();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CPY_ABS:   
-                 
-                CPY();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case CMP_ABS:   
-                 
-                CMP();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case DEC_ABS:   
-                DEC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BNE_REL:   
-                BNE();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CMP_INDY:  
-                CMP();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case CMP_ZPX:   
-                CMP();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case DEC_ZPX:   
-                DEC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case CLD_IMP:   
-                CLD();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CMP_ABSY:  
-                CMP();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case CMP_ABSX:  
-                CMP();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case DEC_ABSX:  
-                DEC();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            case CPX_IMM:   
-                CPX();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case SBC_INDX:  
-                SBC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case CPX_ZP:    
-                CPX();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case SBC_ZP:    
-                SBC();
-                nes_cpu_registers.Cycles = 3; 
-                break;
-            case INC_ZP:    
-                INC();
-                nes_cpu_registers.Cycles = 5; 
-                break;
-            case INX_IMP:   
-                INX();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case SBC_IMM:   
-                SBC();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case NOP_IMP:   
-                NOP();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case CPX_ABS:   
-                CPX();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case SBC_ABS:   
-                SBC();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case INC_ABS:   
-                INC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case BEQ_REL:   
-                BEQ();
-                nes_cpu_registers.Cycles = 2; 
-                break;
-            case SBC_INDY:  
-                SBC();
-                nes_cpu_registers.Cycles += 5; 
-                break;
-            case SBC_ZPX:   
-                SBC();
-                nes_cpu_registers.Cycles = 4; 
-                break;
-            case INC_ZPX:   
-                INC();
-                nes_cpu_registers.Cycles = 6; 
-                break;
-            case SED_IMP:   
-                SED();
-                nes_cpu_registers.Cycles = 2;
-                break;
-            case SBC_ABSY:  
-                SBC();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case SBC_ABSX:  
-                SBC();
-                nes_cpu_registers.Cycles += 4; 
-                break;
-            case INC_ABSX:   
-                INC();
-                nes_cpu_registers.Cycles = 7; 
-                break;
-            default:
-                fprintf(stderr, "error: unknown opcode 0x%02X\n", opcode);
-        }
-        
-        /* Increment the program counter accordingly */
-        nes_cpu_registers.PC += PC_offset;
-        
-        /* The clock of the emulator, for timing purposes */
-        tick();
-    
-        
-        /* Check if time to update display */
-        if ( nes_ppu.s == 240 && nes_ppu.c == 0 )
-        {
-            for (size_t i = 0; i < 240; i++)
-                write_ARGB8888_arr_to_display(disp, 0, i, &nes_ppu.screen_buffer[(i * 360) + 1], 256, 1);
-            
-            push_to_display(disp);
-        }
+            nes_ppu.frame_end = false;
 
-        on_event(&exit_code);
+            if ( nes_ppu.frame_complete )
+            {
+                nes_ppu.frame_complete = false;
+
+                if (!nes_headless)
+                {
+                    uint32_t * frame = frame_mailbox_back(&nes_frames);
+                    for (size_t i = 0; i < 240; i++)
+                        memcpy(&frame[i * 256], &nes_ppu.screen_buffer[(i * 340) + 1], 256 * sizeof(uint32_t));
+                    frame_mailbox_post(&nes_frames);
+                }
+            }
 
-        //PPU_pattern_table_dump(PPU_debug, 0);   /* Debug functions to display pattern + pallete table data of PPU */
-        //PPU_pallete_table_dump(PPU_debug);
-        //push_to_display(PPU_debug);
+            /* Audio of the frame (the APU catches up here at the latest), made a bit faster or slower to keep the device's buffer steady */
+            uint32_t samples = APU_end_frame(nes_clock.cpu / NES_CPU_DIVIDER);
+            if (nes_audio_on)
+                APU_set_rate_correction(audio_push(&nes_audio, nes_apu.out, samples));
+            if (nes_capture_on)
+                capture_write(&nes_capture, nes_apu.channels_on ? APU_channel_out() : (const float * []){ nes_apu.out }, 1, samples);
 
-        update_display(disp);
-        //update_display(PPU_debug);
+            if (nes_pacing.stats && nes_apu.cost_frames == PACING_STATS_FRAMES)
+                APU_report();
+            if (nes_pacing.stats && nes_audio.pushes == PACING_STATS_FRAMES)
+                audio_report(&nes_audio);
+
+            /* Hold the frame until it is due in real time */
+            pacing_frame(nes_clock.cpu);
+
+            if (nes_frame_limit && ++nes_frame_count >= nes_frame_limit)
+                atomic_store(&nes_exit_code, 1);
+            exit_code = atomic_load(&nes_exit_code);
+        }
 
         if ( Break_and_die )  {  return;  }
     }
 }
 
+/* Emulation thread */
+static int emulation_main(void * data)
+{
+    (void) data;
+
+    interpret();
+
+    /* The program ended on its own, stop the presenter too */
+    int running = 0;
+    atomic_compare_exchange_strong(&nes_exit_code, &running, 1);
+    frame_mailbox_wake(&nes_frames);
+    return 0;
+}
+
+/* 
+Presenter, runs on the thread that owns the windows: shows the newest finished frame and 
+polls events. Waiting on the driver (or vsync) here never holds up the emulation.
+*/
+static void present(Display * disp, Display * debug_disp)
+{
+    Frame_stats stats = { .name = "presenter", .min = UINT64_MAX };
+    int exit_code;
+
+    while ((exit_code = atomic_load(&nes_exit_code)) == 0)
+    {
+        const uint32_t * frame = frame_mailbox_take(&nes_frames, 20);
+        if (frame != NULL)
+        {
+            push_frame_to_display(disp, frame, 256 * sizeof(uint32_t));
+            update_display(disp);
+
+            frame_stats_tick(&stats);
+            if (nes_pacing.stats && stats.frames == PACING_STATS_FRAMES)
+                frame_stats_report(&stats, "");
+        }
+
+        /* Debug views are made on their own thread, only a finished one is shown here */
+        if (debug_disp != NULL)
+            PPU_debug_present(debug_disp);
+
+        on_event(&exit_code);
+        if (exit_code != 0)
+            atomic_store(&nes_exit_code, exit_code);
+    }
+
+    if (nes_pacing.stats)
+        frame_stats_report(&stats, "");
+}
+
 /* Driver code */
 int main(int argc, char** argv)
 {
@@ -989,13 +1022,79 @@ int main(int argc, char** argv)
     /* Zero out registers, init CPU, init PPU */
     nes_init_cpu();
     nes_init_ppu();
+    nes_init_apu(0);
 
-    /* Check if only one argument after file name */    
-    if (argc != 2) 
+    /* Check if only one argument after file name (and maybe some options) */    
+    bool ppu_thread = false, deferred = false, vsync = false, unthrottled = false, debug_window = false, debug_dump = false, audio = true;
+    int debug_every = 1, audio_latency = 50, audio_rate = APU_SAMPLE_RATE;
+    const char * capture_path = NULL, * nsf_out_dir = ".";
+    bool capture_wav = true, capture_channels = false;
+    int nsf_track = 0, nsf_seconds = NSF_DEFAULT_SECONDS, nsf_jobs = SDL_GetCPUCount();
+    for (int i = 2; i < argc; i++)
     {
-        fprintf(stderr, "error: Invalid usage. USAGE:\n./nes_cpu [FILE]\n");
+        if (strcmp(argv[i], "--ppu-thread") == 0)
+            ppu_thread = true;
+        else if (strcmp(argv[i], "--deferred") == 0)
+            deferred = true;
+        else if (strcmp(argv[i], "--vsync") == 0)
+            vsync = true;
+        else if (strcmp(argv[i], "--trace") == 0)
+            nes_cpu_trace = true;
+        else if (strcmp(argv[i], "--unthrottled") == 0)
+            unthrottled = true;
+        else if (strcmp(argv[i], "--pacing-stats") == 0)
+            nes_pacing.stats = nes_apu.profile = true;
+        else if (strcmp(argv[i], "--ppu-debug") == 0)
+            debug_window = true;
+        else if (strcmp(argv[i], "--ppu-debug-dump") == 0)
+            debug_dump = true;
+        else if (strncmp(argv[i], "--ppu-debug-every=", 18) == 0 && (debug_every = atoi(&argv[i][18])) > 0 && debug_every < 256)
+            continue;
+        else if (strcmp(argv[i], "--no-audio") == 0)
+            audio = false;
+        else if (strncmp(argv[i], "--audio-latency=", 16) == 0 && (audio_latency = atoi(&argv[i][16])) > 0 && audio_latency <= 1000)
+            continue;
+        else if (strncmp(argv[i], "--audio-rate=", 13) == 0 && (audio_rate = atoi(&argv[i][13])) >= 8000 && audio_rate <= 96000)
+            continue;
+        else if (strcmp(argv[i], "--headless") == 0)
+            nes_headless = unthrottled = true;
+        else if (strncmp(argv[i], "--frames=", 9) == 0 && (nes_frame_limit = strtoull(&argv[i][9], NULL, 10)) > 0)
+            continue;
+        else if (strncmp(argv[i], "--wav=", 6) == 0 && argv[i][6])
+            capture_path = &argv[i][6], capture_wav = true;
+        else if (strncmp(argv[i], "--raw=", 6) == 0 && argv[i][6])
+            capture_path = &argv[i][6], capture_wav = false;
+        else if (strcmp(argv[i], "--capture-channels") == 0)
+            capture_channels = true;
+        else if (strncmp(argv[i], "--track=", 8) == 0 && (nsf_track = atoi(&argv[i][8])) > 0 && nsf_track < 256)
+            continue;
+        else if (strncmp(argv[i], "--seconds=", 10) == 0 && (nsf_seconds = atoi(&argv[i][10])) > 0)
+            continue;
+        else if (strncmp(argv[i], "--jobs=", 7) == 0 && (nsf_jobs = atoi(&argv[i][7])) > 0)
+            continue;
+        else if (strncmp(argv[i], "--out=", 6) == 0 && argv[i][6])
+            nsf_out_dir = &argv[i][6];
+        else
+            argc = 0;
+    }
+
+    if (argc < 2) 
+    {
+        fprintf(stderr, "error: Invalid usage. USAGE:\n./nes_cpu [FILE] [--ppu-thread] [--deferred] [--vsync] [--unthrottled] [--pacing-stats] [--trace] [--ppu-debug] [--ppu-debug-dump] [--ppu-debug-every=N] [--no-audio] [--audio-latency=MS] [--audio-rate=HZ] [--headless] [--frames=N] [--wav=FILE] [--raw=FILE] [--capture-channels]\n"
+                        "./nes_cpu [NSF or directory of NSFs] [--track=N] [--seconds=N] [--jobs=N] [--out=DIR] [--audio-rate=HZ] [--wav=FILE] [--raw=FILE] [--capture-channels]\n");
         return -1;
     }
+    else if (nsf_is_input(argv[1]))
+    {
+        /* NSFs are rendered to files without the PPU, as fast as they go (--wav/--raw only name the file of a single track) */
+        nes_2A02_init_map();
+        APU_set_sample_rate(audio_rate);
+        APU_set_channel_output(capture_channels);
+
+        int failed = nsf_batch(argv[1], nsf_track, nsf_out_dir, capture_path, capture_wav, nsf_seconds, nsf_jobs > 0 ? nsf_jobs : 1);
+        SDL_Quit();
+        return failed ? -1 : 0;
+    }
     else
     {
         /* Load the rom into NES memory */  
@@ -1005,20 +1104,84 @@ int main(int argc, char** argv)
         }
     }
 
-    /* Create a new display */
-    Display nes_window;
-    //Display PPU_debug;
-    init_display(&nes_window, argv[1], 256, 240);
-    //create_display(&PPU_debug, "PPU pattern table dump", 256, 256);
+    /* Create a new display, unless nothing is to be shown */
+    Display nes_window, debug_window_disp;
+    debug_window &= !nes_headless;
+    if (!nes_headless)
+        init_display(&nes_window, argv[1], 256, 240);
+    if (vsync && !nes_headless)
+        set_display_vsync(&nes_window, true);
+
+    /* Run in real time, at the rate of the display if it is synced to one that's close enough */
+    if (!unthrottled)
+    {
+        SDL_DisplayMode mode;
+        pacing_start(nes_clock.cpu);
+        if (vsync && SDL_GetCurrentDisplayMode(SDL_GetWindowDisplayIndex(nes_window.window), &mode) == 0)
+            pacing_set_display_rate(nes_clock.cpu, mode.refresh_rate);
+    }
+    if (debug_window)
+        create_display(&debug_window_disp, "PPU debug", PPU_DEBUG_WIDTH, PPU_DEBUG_HEIGHT);
+
+    /* Sound only makes sense in real time, the APU makes its samples at whatever rate the device runs at */
+    APU_set_sample_rate(audio_rate);
+    if (audio && !unthrottled && (nes_audio_on = init_audio(&nes_audio, audio_rate, audio_latency)))
+        APU_set_sample_rate(nes_audio.rate);
+
+    /* Capture to a file: mono, the mixed output, or one channel per APU channel (unfiltered) */
+    APU_set_channel_output(capture_path != NULL && capture_channels);
+    if (capture_path != NULL && !(nes_capture_on = init_capture(&nes_capture, capture_path, capture_wav, nes_apu.sample_rate, capture_channels ? APU_CHANNELS : 1)))
+        return -1;
 
     /* Init opcode table */
     nes_2A02_init_map();
 
-    /* Begin interpreter */
-    interpret(&nes_window, NULL);
+    /* Optionally pipeline the PPU on its own thread, and/or render frames in parallel once they're done */
+    if (ppu_thread)
+        PPU_thread_start();
+    if (deferred)
+        PPU_set_deferred(true, -1);
+
+    /* Pattern tables, nametables, OAM and palettes, snapshotted every Nth frame */
+    if ((debug_window || debug_dump) && !PPU_debug_start(debug_window, debug_dump, debug_every))
+        debug_window = false;
+
+    /* Begin interpreter on its own thread, this one presents its frames (headless, it just runs here) */
+    SDL_Thread * emulation = NULL;
+    if (nes_headless)
+        interpret();
+    else if (init_frame_mailbox(&nes_frames, 256, 240))
+        emulation = SDL_CreateThread(emulation_main, "emulation", NULL);
+
+    if (emulation != NULL)
+    {
+        present(&nes_window, debug_window ? &debug_window_disp : NULL);
+        SDL_WaitThread(emulation, NULL);
+    }
+    else if (!nes_headless)
+        fprintf(stderr, "error: Failed to start the emulation thread: %s. Exiting!\n", SDL_GetError());
+
+    PPU_thread_stop();
+    PPU_set_deferred(false, 0);
+    PPU_debug_stop();
+
+    if (nes_pacing.stats)
+    {
+        pacing_report();
+        APU_report();
+        if (nes_audio_on)
+            audio_report(&nes_audio);
+    }
+    if (nes_audio_on)
+        free_audio(&nes_audio);
+    if (nes_capture_on)
+        free_capture(&nes_capture);
 
-    free_display(&nes_window);
-    //free_display(&PPU_debug);
+    free_frame_mailbox(&nes_frames);
+    if (!nes_headless)
+        free_display(&nes_window);
+    if (debug_window)
+        free_display(&debug_window_disp);
     
     SDL_Quit();
 
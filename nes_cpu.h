@@ -14,7 +14,7 @@ typedef struct _6502_cpu_bus
 {
     uint16_t AB;
     uint8_t DB;
-    bool IRQ;
+    uint8_t IRQ;        /* Level triggered, one bit per device holding it (see nes_apu.h, nes_cartridge.h) */
     bool NMI;
     bool RES;
 }
@@ -281,6 +281,7 @@ typedef struct _2A02_cpu_opcode_map
 {
     uint8_t     AM;
     const char  * mnemonic;
+    bool        W;              /* Only writes its operand (stores) */
 }
 _2A02_cpu_opcode_map;
 _2A02_cpu_opcode_map nes_2A02_cpu_opcode_map[256];
@@ -375,24 +376,24 @@ static inline void nes_2A02_init_map()
     nes_2A02_cpu_opcode_map[ADC_ABSY] = (_2A02_cpu_opcode_map){.AM = ABSY,    .mnemonic = "ADC"};
     nes_2A02_cpu_opcode_map[ADC_ABSX] = (_2A02_cpu_opcode_map){.AM = ABSX,    .mnemonic = "ADC"};
     nes_2A02_cpu_opcode_map[ROR_ABSX] = (_2A02_cpu_opcode_map){.AM = ABSX,    .mnemonic = "ROR"};
-    nes_2A02_cpu_opcode_map[STA_INDX] = (_2A02_cpu_opcode_map){.AM = INDX,    .mnemonic = "STA"};
-    nes_2A02_cpu_opcode_map[STY_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STY"};
-    nes_2A02_cpu_opcode_map[STA_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STA"};
-    nes_2A02_cpu_opcode_map[STX_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STX"};
+    nes_2A02_cpu_opcode_map[STA_INDX] = (_2A02_cpu_opcode_map){.AM = INDX,    .mnemonic = "STA", .W = true};
+    nes_2A02_cpu_opcode_map[STY_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STY", .W = true};
+    nes_2A02_cpu_opcode_map[STA_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STA", .W = true};
+    nes_2A02_cpu_opcode_map[STX_ZP] =   (_2A02_cpu_opcode_map){.AM = ZP,      .mnemonic = "STX", .W = true};
     nes_2A02_cpu_opcode_map[DEY_IMP] =  (_2A02_cpu_opcode_map){.AM = IMP,     .mnemonic = "DEY"};
     nes_2A02_cpu_opcode_map[TXA_IMP] =  (_2A02_cpu_opcode_map){.AM = IMP,     .mnemonic = "TXA"};
-    nes_2A02_cpu_opcode_map[STY_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STY"};
-    nes_2A02_cpu_opcode_map[STA_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STA"};
-    nes_2A02_cpu_opcode_map[STX_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STX"};
+    nes_2A02_cpu_opcode_map[STY_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STY", .W = true};
+    nes_2A02_cpu_opcode_map[STA_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STA", .W = true};
+    nes_2A02_cpu_opcode_map[STX_ABS] =  (_2A02_cpu_opcode_map){.AM = ABS,     .mnemonic = "STX", .W = true};
     nes_2A02_cpu_opcode_map[BCC_REL] =  (_2A02_cpu_opcode_map){.AM = REL,     .mnemonic = "BCC"};
-    nes_2A02_cpu_opcode_map[STA_INDY] = (_2A02_cpu_opcode_map){.AM = INDY,    .mnemonic = "STA"};
-    nes_2A02_cpu_opcode_map[STY_ZPX] =  (_2A02_cpu_opcode_map){.AM = ZPX,     .mnemonic = "STY"};
-    nes_2A02_cpu_opcode_map[STA_ZPX] =  (_2A02_cpu_opcode_map){.AM = ZPX,     .mnemonic = "STA"};
-    nes_2A02_cpu_opcode_map[STX_ZPY] =  (_2A02_cpu_opcode_map){.AM = ZPY,     .mnemonic = "STX"};
+    nes_2A02_cpu_opcode_map[STA_INDY] = (_2A02_cpu_opcode_map){.AM = INDY,    .mnemonic = "STA", .W = true};
+    nes_2A02_cpu_opcode_map[STY_ZPX] =  (_2A02_cpu_opcode_map){.AM = ZPX,     .mnemonic = "STY", .W = true};
+    nes_2A02_cpu_opcode_map[STA_ZPX] =  (_2A02_cpu_opcode_map){.AM = ZPX,     .mnemonic = "STA", .W = true};
+    nes_2A02_cpu_opcode_map[STX_ZPY] =  (_2A02_cpu_opcode_map){.AM = ZPY,     .mnemonic = "STX", .W = true};
     nes_2A02_cpu_opcode_map[TYA_IMP] =  (_2A02_cpu_opcode_map){.AM = IMP,     .mnemonic = "TYA"};
-    nes_2A02_cpu_opcode_map[STA_ABSY] = (_2A02_cpu_opcode_map){.AM = ABSY,    .mnemonic = "STA"};
+    nes_2A02_cpu_opcode_map[STA_ABSY] = (_2A02_cpu_opcode_map){.AM = ABSY,    .mnemonic = "STA", .W = true};
     nes_2A02_cpu_opcode_map[TXS_IMP] =  (_2A02_cpu_opcode_map){.AM = IMP,     .mnemonic = "TXS"};
-    nes_2A02_cpu_opcode_map[STA_ABSX] = (_2A02_cpu_opcode_map){.AM = ABSX,    .mnemonic = "STA"};
+    nes_2A02_cpu_opcode_map[STA_ABSX] = (_2A02_cpu_opcode_map){.AM = ABSX,    .mnemonic = "STA", .W = true};
     nes_2A02_cpu_opcode_map[LDY_IMM] =  (_2A02_cpu_opcode_map){.AM = IMM,     .mnemonic = "LDY"};
     nes_2A02_cpu_opcode_map[LDA_INDX] = (_2A02_cpu_opcode_map){.AM = INDX,    .mnemonic = "LDA"};
     nes_2A02_cpu_opcode_map[LDX_IMM] =  (_2A02_cpu_opcode_map){.AM = IMM,     .mnemonic = "LDX"};
@@ -480,7 +481,7 @@ static inline void print_zp()
 /* Peek (read) byte from memory at address 'addr' */
 static inline uint8_t PEEK(uint16_t addr)
 {
-    PEEK_MAPPER(addr);
+    return PEEK_MAPPER(addr);
 }
 
 /* Peek (read) byte from memory at address 'addr' */
@@ -566,6 +567,9 @@ static inline bool get_flag(nes_cpu_flags flag)
 /* Current addressing mode */
 uint8_t current_addr_mode = NONE;
 
+/* Set for stores, which must not read their operand first (reads of PPU registers have side effects) */
+bool operand_write_only = false;
+
 /* String used in disassembly of rom to display operand */
 char operand[9];
 
@@ -582,7 +586,8 @@ static inline void get_operand_AM(nes_cpu_addr_modes mode)
             uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
 
             nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB);
+            if (!operand_write_only)
+                nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB);
             PC_offset = 3;
 
             /* Set Operand string (TO-DO: fix this) */
@@ -616,7 +621,8 @@ static inline void get_operand_AM(nes_cpu_addr_modes mode)
             uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
 
             nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.X);
+            if (!operand_write_only)
+                nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.X);
             PC_offset = 3;
 
             /* Set Operand string (TO-DO: fix this) */
@@ -629,7 +635,8 @@ static inline void get_operand_AM(nes_cpu_addr_modes mode)
             uint8_t lo = PEEK(nes_cpu_registers.PC + 1);
 
             nes_cpu_bus.AB = (uint16_t) hi << 8 | lo;
-            nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.Y);
+            if (!operand_write_only)
+                nes_cpu_bus.DB = PEEK(nes_cpu_bus.AB + nes_cpu_registers.Y);
             PC_offset = 3;
 
             /* Set Operand string (TO-DO: fix this) */
@@ -697,7 +704,8 @@ static inline void get_operand_AM(nes_cpu_addr_modes mode)
 
             uint16_t index_addr = (uint16_t) (hi << 8) | lo;
             
-            nes_cpu_bus.DB = PEEK(index_addr);
+            if (!operand_write_only)
+                nes_cpu_bus.DB = PEEK(index_addr);
             PC_offset = 2;
 
             /* Set Operand string (TO-DO: fix this) */
@@ -717,7 +725,8 @@ static inline void get_operand_AM(nes_cpu_addr_modes mode)
                 nes_cpu_registers.Cycles += 1;
             }
             
-            nes_cpu_bus.DB = PEEK(indir_addr);
+            if (!operand_write_only)
+                nes_cpu_bus.DB = PEEK(indir_addr);
             PC_offset = 2;
 
             /* Set Operand string (TO-DO: fix this) */
@@ -758,48 +767,47 @@ static inline void print_opcode(nes_cpu_opcodes opcode)
 
 /* 6502 interrupts */
 
-/* IRQ */
+/* IRQ, taken between instructions (if not masked) so PC is the return address */
 static inline void IRQ()
 {
     if (!get_flag(I))
     {
-        uint8_t PC_hi = ((nes_cpu_registers.PC + 2) >> 8 & 0x00FF);
-        uint8_t PC_lo = ((nes_cpu_registers.PC + 2) & 0x00FF); 
+        uint8_t PC_hi = (nes_cpu_registers.PC >> 8) & 0x00FF;
+        uint8_t PC_lo = nes_cpu_registers.PC & 0x00FF; 
         PUSH(PC_hi);
         PUSH(PC_lo);
-        PUSH(nes_cpu_registers.S);
+        PUSH((nes_cpu_registers.S & ~B) | U);
 
         nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFF) << 8 | PEEK(0xFFFE);
-        test_flag(B, 1);
         test_flag(I, 1);
 
         nes_cpu_registers.Cycles = 7;
     }
 }
 
-/* Decrement # of cycles and wait for a period of time */
+/* Spend the cycles of the last instruction, and of the OAM DMA it started */
 void CPU_wait()
 {
-    while (nes_cpu_registers.Cycles != 0)
-    {
-        nes_cpu_registers.Cycles -= 1;
-        tick();
-    }
+    if (nes_oamdma_pending)
+        nes_cpu_registers.Cycles += OAMDMA_stall(nes_clock.cpu / NES_CPU_DIVIDER + nes_cpu_registers.Cycles);
+
+    tick(nes_cpu_registers.Cycles);
+    nes_cpu_registers.Cycles = 0;
 }
 
-/* Non-maskable interrupt */
+/* Non-maskable interrupt, taken between instructions so PC is the return address */
 static inline void NMI()
 {
-    uint8_t PC_hi = ((nes_cpu_registers.PC + 2) >> 8 & 0x00FF);
-    uint8_t PC_lo = ((nes_cpu_registers.PC + 2) & 0x00FF); 
+    uint8_t PC_hi = (nes_cpu_registers.PC >> 8) & 0x00FF;
+    uint8_t PC_lo = nes_cpu_registers.PC & 0x00FF; 
     PUSH(PC_hi);
     PUSH(PC_lo);
-    PUSH(nes_cpu_registers.S);
+    PUSH((nes_cpu_registers.S & ~B) | U);
     
     nes_cpu_registers.PC = (uint16_t)PEEK(0xFFFB) << 8 | PEEK(0xFFFA);
-    test_flag(B, 1);
+    test_flag(I, 1);
 
-    nes_cpu_registers.Cycles = 8;
+    nes_cpu_registers.Cycles = 7;
 }
 
 /* Reset registers */
@@ -1113,7 +1121,10 @@ static inline void LSR()
     nes_cpu_bus.DB >>= 1;
 
     test_flag(Z, (nes_cpu_bus.DB == 0x00));
-    POKE(nes_cpu_bus.AB, nes_cpu_bus.DB);
+
+    /* LSR A has no memory operand, AB is left over from the last instruction (on a mapper register that's a real write) */
+    if (current_addr_mode != ACC)
+        POKE(nes_cpu_bus.AB, nes_cpu_bus.DB);
 }
 
 /* No operation */
@@ -1188,7 +1199,9 @@ static inline void RTI()
     uint8_t lo = POP();
     uint8_t hi = POP();
     
+    /* Unlike RTS, the pulled address is the next instruction */
     nes_cpu_registers.PC = (uint16_t)(hi << 8) | lo;
+    PC_offset = 0;
 }
 
 /* Return from subroutine */
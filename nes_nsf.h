@@ -0,0 +1,522 @@
+#pragma once
+
+/*
+    nes_nsf.h: NSF music files, rendered to audio without the PPU
+
+    An NSF is the music code and data of a game with a small header in front (format from
+    https://wiki.nesdev.com/w/index.php/NSF). A track is played by calling INIT once with
+    the track number in A, then PLAY at a fixed rate (usually 60 Hz). Here both are run on
+    the CPU interpreter with only RAM, the APU and the NSF's ROM banks on the bus. The PPU
+    is never run (its sync point is pushed out to forever), so there is no picture and no
+    PPU work at all, and nothing is paced: a track renders as fast as the host can go.
+
+    The CPU sits idle between PLAY calls, that time is skipped in one tick. Audio comes out
+    in chunks of at most a frame's length (APU_end_frame() works on frames) and goes to a
+    Capture file.
+
+    A directory of NSFs is rendered one track per job, jobs are handed out to worker
+    processes (the emulator's state is global, a process of its own gives each track a
+    clean copy of it).
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <SDL2/SDL.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#include "interface.h"
+#include "nes_cpu.h"
+
+#define NSF_HEADER_SIZE     0x80
+#define NSF_BANK_SIZE       0x1000          /* Bankswitching is in 4 KiB banks, $5FF8-$5FFF pick those at $8000-$FFFF */
+#define NSF_RETURN          0x4100          /* INIT and PLAY "return" here, where no code can run (open bus) */
+#define NSF_CALL_LIMIT      1789773         /* CPU cycles INIT or PLAY can take before the track is given up on (1 second) */
+#define NSF_CHUNK_CYCLES    29780           /* Most CPU cycles of audio made at once (a frame, fits APU_FRAME_SAMPLES_MAX) */
+#define NSF_DEFAULT_SECONDS 180
+
+/* NSF file and the player's state */
+typedef struct _nes_nsf
+{
+    const char  * path;
+    uint8_t     version,
+                songs,                      /* Tracks in the file */
+                start,                      /* Track to play first (1 based) */
+                chips;                      /* Expansion sound chips, not emulated */
+    uint16_t    load,                       /* Where the data goes */
+                init,                       /* INIT routine */
+                play;                       /* PLAY routine */
+    uint32_t    speed;                      /* Microseconds between PLAY calls (NTSC) */
+    char        name[33], artist[33], copyright[33];
+
+    bool        bankswitched;
+    uint8_t     bank_init[8];               /* Banks at $8000-$FFFF when a track starts */
+    uint8_t     * rom;                      /* The data, in 4 KiB banks (starting at 'load' & $FFF when bankswitched) */
+    uint32_t    banks;
+    uint8_t     * bank[8];                  /* Host memory behind $8000-$FFFF */
+
+    Capture     * out;                      /* Where the audio goes */
+    uint64_t    chunk_cycle;                /* CPU cycle the audio was last taken up to */
+}
+_nes_nsf;
+_nes_nsf nes_nsf;
+
+/* The interpreter, one instruction at a time (nes_cpu.c) */
+static inline void CPU_step();
+
+static inline uint16_t nsf_get16(const uint8_t * p)
+{
+    return (uint16_t) p[1] << 8 | p[0];
+}
+
+/* Read the header of 'path' into 'nsf' only (to count tracks), false if it isn't an NSF */
+static inline bool nsf_probe(const char * path, _nes_nsf * nsf)
+{
+    uint8_t h[NSF_HEADER_SIZE];
+    FILE    * f = fopen(path, "rb");
+
+    if (f == NULL)
+        return false;
+
+    bool ok = fread(h, 1, sizeof(h), f) == sizeof(h) && memcmp(h, "NESM\x1A", 5) == 0;
+    fclose(f);
+    if (!ok)
+        return false;
+
+    memset(nsf, 0, sizeof(*nsf));
+    nsf->path       = path;
+    nsf->version    = h[0x05];
+    nsf->songs      = h[0x06];
+    nsf->start      = h[0x07];
+    nsf->load       = nsf_get16(&h[0x08]);
+    nsf->init       = nsf_get16(&h[0x0A]);
+    nsf->play       = nsf_get16(&h[0x0C]);
+    nsf->speed      = nsf_get16(&h[0x6E]);
+    nsf->chips      = h[0x7B];
+    memcpy(nsf->name,       &h[0x0E], 32);
+    memcpy(nsf->artist,     &h[0x2E], 32);
+    memcpy(nsf->copyright,  &h[0x4E], 32);
+    memcpy(nsf->bank_init,  &h[0x70], 8);
+
+    /* Any bank set up front means the file is bankswitched */
+    for (int i = 0; i < 8; i++)
+        nsf->bankswitched |= nsf->bank_init[i] != 0;
+
+    /* A speed of 0 is a broken header, players take it as 60 Hz */
+    if (nsf->speed == 0)
+        nsf->speed = 16639;
+
+    return nsf->songs > 0;
+}
+
+/* Check if 'path' is something to render: an NSF or a directory */
+static inline bool nsf_is_input(const char * path)
+{
+    _nes_nsf nsf;
+    DIR      * dir = opendir(path);
+
+    if (dir != NULL)
+        closedir(dir);
+    return dir != NULL || nsf_probe(path, &nsf);
+}
+
+/* Load the NSF at 'path' into nes_nsf */
+static inline bool nsf_load(const char * path)
+{
+    if (!nsf_probe(path, &nes_nsf))
+    {
+        fprintf(stderr, "error: %s is not an NSF file.\n", path);
+        return false;
+    }
+
+    if (nes_nsf.load < 0x8000 && !nes_nsf.bankswitched)
+    {
+        fprintf(stderr, "error: %s loads at $%04X, only $8000-$FFFF is supported.\n", path, nes_nsf.load);
+        return false;
+    }
+    if (nes_nsf.chips)
+        fprintf(stderr, "warning: %s uses expansion sound chips ($%02X), only the APU's channels are played.\n", path, nes_nsf.chips);
+
+    FILE * f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f) - NSF_HEADER_SIZE;
+    fseek(f, NSF_HEADER_SIZE, SEEK_SET);
+
+    /* Not bankswitched, the data is laid out in 32 KiB as it is on the bus */
+    uint32_t pad = nes_nsf.bankswitched ? (nes_nsf.load & (NSF_BANK_SIZE - 1)) : nes_nsf.load - 0x8000;
+    if (!nes_nsf.bankswitched && size > 0x10000 - nes_nsf.load)
+        size = 0x10000 - nes_nsf.load;
+
+    nes_nsf.banks   = nes_nsf.bankswitched ? (pad + size + NSF_BANK_SIZE - 1) / NSF_BANK_SIZE : 8;
+    nes_nsf.rom     = calloc(nes_nsf.banks, NSF_BANK_SIZE);
+
+    bool ok = nes_nsf.rom != NULL && size > 0 && fread(&nes_nsf.rom[pad], 1, size, f) == (size_t) size;
+    fclose(f);
+    if (!ok)
+    {
+        fprintf(stderr, "error: Failed to read the data of %s.\n", path);
+        free(nes_nsf.rom);
+        nes_nsf.rom = NULL;
+    }
+
+    return ok;
+}
+
+/* Switch bank 'b' in at $8000 + 'i' * 4 KiB */
+static inline void nsf_bank(uint8_t i, uint8_t b)
+{
+    nes_nsf.bank[i] = &nes_nsf.rom[(b % nes_nsf.banks) * NSF_BANK_SIZE];
+
+    CPU_map_page(16 + 2 * i, nes_nsf.bank[i]);
+    CPU_map_page(17 + 2 * i, nes_nsf.bank[i] + 0x800);
+}
+
+/* NSF PEEK: RAM, APU status, WRAM and ROM banks, the rest is open bus */
+uint8_t PEEK_NSF(uint16_t addr)
+{
+    if (addr < 0x2000)
+        return nes_cartridge.nes_mem[addr & 0x07FF];
+    if (addr >= 0x8000)
+        return nes_nsf.bank[(addr >> 12) & 0x7][addr & (NSF_BANK_SIZE - 1)];
+    if (addr >= 0x6000)
+        return nes_cartridge.nes_mem[addr];
+    if (addr == 0x4015)
+        return APU_read_status(nes_clock.cpu / NES_CPU_DIVIDER);
+
+    return addr >> 8;
+}
+
+/* NSF POKE: RAM, APU registers, bank registers and WRAM, ROM can't be written */
+void POKE_NSF(uint16_t addr, uint8_t data)
+{
+    if (addr < 0x2000)
+        nes_cartridge.nes_mem[addr & 0x07FF] = data;
+    else if (addr >= 0x6000 && addr < 0x8000)
+        nes_cartridge.nes_mem[addr] = data;
+    else if (addr >= 0x4000 && addr <= 0x4017 && addr != 0x4014 && addr != 0x4016)
+        APU_write(nes_clock.cpu / NES_CPU_DIVIDER, addr, data);
+    else if (addr >= 0x5FF8 && addr < 0x6000 && nes_nsf.bankswitched)
+        nsf_bank(addr - 0x5FF8, data);
+}
+
+/* The NSF "mapper": the bus as an NSF player sets it up */
+static inline void mapper_NSF()
+{
+    PEEK_MAPPER     = PEEK_NSF;
+    POKE_MAPPER     = POKE_NSF;
+    APU_dmc_read    = PEEK_NSF;
+
+    nes_cartridge.nes_mem = nes_cpu_mem.mem;
+    for (uint8_t i = 0; i < 32; i++)
+        CPU_map_page(i, NULL);
+    for (uint8_t i = 0; i < 4; i++)
+        CPU_map_page(i, nes_cartridge.nes_mem);
+    for (uint8_t i = 12; i < 16; i++)
+        CPU_map_page(i, &nes_cartridge.nes_mem[i << NES_CPU_PAGE_SHIFT]);
+    for (uint8_t i = 0; i < 8; i++)
+        nsf_bank(i, nes_nsf.bankswitched ? nes_nsf.bank_init[i] : i);
+}
+
+/* Hand the audio up to the CPU's cycle to the output */
+static inline void nsf_output()
+{
+    uint64_t cycle      = nes_clock.cpu / NES_CPU_DIVIDER;
+    uint32_t samples    = APU_end_frame(cycle);
+
+    capture_write(nes_nsf.out, nes_apu.channels_on ? APU_channel_out() : (const float * []){ nes_apu.out }, 1, samples);
+    nes_nsf.chunk_cycle = cycle;
+}
+
+/* Let the CPU sit idle up to CPU cycle 'cycle' */
+static inline void nsf_idle(uint64_t cycle)
+{
+    for (uint64_t now; (now = nes_clock.cpu / NES_CPU_DIVIDER) < cycle; )
+    {
+        uint64_t to = nes_nsf.chunk_cycle + NSF_CHUNK_CYCLES;
+
+        if (now >= to)
+            nsf_output();
+        else
+            tick((uint16_t)((to < cycle ? to : cycle) - now));
+    }
+}
+
+/* Call the routine at 'addr' and run it until it returns, false if it doesn't */
+static inline bool nsf_call(uint16_t addr)
+{
+    uint64_t limit = nes_clock.cpu + (uint64_t) NSF_CALL_LIMIT * NES_CPU_DIVIDER;
+
+    /* RTS adds one to what it pulls */
+    PUSH((NSF_RETURN - 1) >> 8);
+    PUSH((NSF_RETURN - 1) & 0xFF);
+    nes_cpu_registers.PC = addr;
+
+    while (nes_cpu_registers.PC != NSF_RETURN)
+    {
+        if (nes_clock.cpu >= limit || Break_and_die)
+            return false;
+
+        CPU_step();
+        if (nes_clock.cpu / NES_CPU_DIVIDER >= nes_nsf.chunk_cycle + NSF_CHUNK_CYCLES)
+            nsf_output();
+    }
+
+    return true;
+}
+
+/* Set up for track 'track' (1 based) and call INIT */
+static inline bool nsf_start(uint8_t track)
+{
+    memset(nes_cpu_mem.ram, 0, sizeof(nes_cpu_mem.ram));
+    memset(&nes_cpu_mem.mem[0x6000], 0, 0x2000);
+    mapper_NSF();
+
+    /* Nothing runs the PPU, it never gets to a sync point */
+    nes_clock.cpu   = nes_clock.ppu = 0;
+    nes_clock.sync  = UINT64_MAX;
+
+    uint32_t rate       = nes_apu.sample_rate;
+    bool     channels   = nes_apu.channels_on;
+    nes_init_apu(0);
+    APU_set_sample_rate(rate);
+    APU_set_channel_output(channels);
+    nes_nsf.chunk_cycle = 0;
+
+    /* Registers as the NSF spec has them at INIT: silent APU, all channels enabled, frame IRQ off */
+    for (uint16_t addr = 0x4000; addr < 0x4014; addr++)
+        APU_write(0, addr, 0x00);
+    APU_write(0, 0x4015, 0x0F);
+    APU_write(0, 0x4017, 0x40);
+
+    /* Interrupts stay masked, A is the track (0 based) and X is 0 for NTSC */
+    nes_cpu_registers.A     = track - 1;
+    nes_cpu_registers.X     = nes_cpu_registers.Y = 0;
+    nes_cpu_registers.S     = U | I;
+    nes_cpu_registers.SP    = 0xFD;
+    nes_cpu_bus.IRQ         = 0;
+    nes_cpu_bus.NMI         = false;
+    Break_and_die           = false;
+
+    return nsf_call(nes_nsf.init);
+}
+
+/* Render 'seconds' of track 'track' of the loaded NSF to 'out' */
+static inline bool nsf_render(uint8_t track, uint32_t seconds, Capture * out)
+{
+    nes_nsf.out = out;
+
+    if (!nsf_start(track))
+    {
+        fprintf(stderr, "error: %s track %u: INIT didn't return.\n", nes_nsf.path, track);
+        return false;
+    }
+
+    /* PLAY is due every 'speed' us from the end of INIT, in whole CPU cycles that don't drift */
+    uint64_t base   = nes_clock.cpu / NES_CPU_DIVIDER,
+             end    = base + (uint64_t) seconds * APU_CPU_CLOCK_NUM / APU_CPU_CLOCK_DEN;
+
+    for (uint64_t k = 0; ; k++)
+    {
+        uint64_t due = base + k * nes_nsf.speed * APU_CPU_CLOCK_NUM / (APU_CPU_CLOCK_DEN * 1000000ull);
+        if (due >= end)
+            break;
+
+        nsf_idle(due);
+        if (!nsf_call(nes_nsf.play))
+        {
+            fprintf(stderr, "error: %s track %u: PLAY didn't return.\n", nes_nsf.path, track);
+            return false;
+        }
+    }
+
+    nsf_idle(end);
+    nsf_output();
+    return true;
+}
+
+/* One track to render */
+typedef struct _nsf_job
+{
+    char        path[1024];
+    uint8_t     track;
+}
+_nsf_job;
+
+/* Render a job to 'out_dir'/<name>-<track>.wav, or to 'out_path' if set */
+static inline bool nsf_run_job(const _nsf_job * job, const char * out_dir, const char * out_path, bool wav, uint32_t seconds)
+{
+    if (nes_nsf.path == NULL || strcmp(nes_nsf.path, job->path) != 0)
+    {
+        free(nes_nsf.rom);
+        nes_nsf.rom = NULL;
+        if (!nsf_load(job->path))
+            return false;
+        nes_nsf.path = job->path;
+    }
+
+    /* File name of the NSF, without its extension */
+    char name[1024], path[2048];
+    const char * base = strrchr(job->path, '/');
+    snprintf(name, sizeof(name), "%s", base ? base + 1 : job->path);
+    char * dot = strrchr(name, '.');
+    if (dot != NULL)
+        *dot = '\0';
+
+    if (out_path == NULL)
+        snprintf(path, sizeof(path), "%s/%s-%02u.wav", out_dir, name, job->track);
+    else
+        snprintf(path, sizeof(path), "%s", out_path);
+
+    Capture cap;
+    if (!init_capture(&cap, path, wav, nes_apu.sample_rate, nes_apu.channels_on ? APU_CHANNELS : 1))
+        return false;
+
+    uint64_t start  = SDL_GetPerformanceCounter();
+    bool     ok     = nsf_render(job->track, seconds, &cap);
+    uint64_t ms     = (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+
+    free_capture(&cap);
+    if (ok)
+        printf("%s: track %u/%u of \"%s\" in %llu ms (%llux real time)\n", path, job->track, nes_nsf.songs, nes_nsf.name,
+               (unsigned long long) ms, (unsigned long long)(seconds * 1000ull / (ms ? ms : 1)));
+    return ok;
+}
+
+/* Add the tracks of the NSF at 'path' (all of them, or just 'track') to 'jobs' */
+static inline bool nsf_add_jobs(const char * path, uint8_t track, _nsf_job ** jobs, size_t * count)
+{
+    _nes_nsf nsf;
+    if (!nsf_probe(path, &nsf))
+        return false;
+
+    for (uint8_t t = 1; t <= nsf.songs; t++)
+    {
+        if (track && t != track)
+            continue;
+
+        _nsf_job * more = realloc(*jobs, (*count + 1) * sizeof(_nsf_job));
+        if (more == NULL)
+            return false;
+
+        *jobs = more;
+        snprintf((*jobs)[*count].path, sizeof((*jobs)[*count].path), "%s", path);
+        (*jobs)[(*count)++].track = t;
+    }
+
+    return true;
+}
+
+/* Worker: takes jobs off the shared counter until there are none left, returns the number that failed */
+static inline int nsf_worker(const _nsf_job * jobs, size_t count, atomic_size_t * next, const char * out_dir, const char * out_path, bool wav, uint32_t seconds)
+{
+    int failed = 0;
+
+    for (size_t i; (i = atomic_fetch_add(next, 1)) < count; )
+        failed += !nsf_run_job(&jobs[i], out_dir, out_path, wav, seconds);
+
+    return failed;
+}
+
+/*
+Render 'path' (an NSF, or a directory of them) with 'workers' processes: every track, or
+just 'track' if it isn't 0. 'out_path' is only used for a single track, otherwise the files
+go to 'out_dir'. Returns the number of tracks that failed.
+*/
+static inline int nsf_batch(const char * path, uint8_t track, const char * out_dir, const char * out_path, bool wav, uint32_t seconds, int workers)
+{
+    _nsf_job * jobs = NULL;
+    size_t   count  = 0;
+    DIR      * dir  = opendir(path);
+
+    if (dir == NULL)
+        nsf_add_jobs(path, track, &jobs, &count);
+    else
+    {
+        char file[1024];
+        for (struct dirent * e; (e = readdir(dir)) != NULL; )
+        {
+            size_t n = strlen(e->d_name);
+            if (n > 4 && SDL_strcasecmp(&e->d_name[n - 4], ".nsf") == 0)
+            {
+                snprintf(file, sizeof(file), "%s/%s", path, e->d_name);
+                nsf_add_jobs(file, track, &jobs, &count);
+            }
+        }
+        closedir(dir);
+    }
+
+    if (count == 0)
+    {
+        fprintf(stderr, "error: No NSF tracks to render in %s.\n", path);
+        return -1;
+    }
+    if (count > 1)
+        out_path = NULL, wav = true;
+    if (workers > (int) count)
+        workers = (int) count;
+
+    printf("Rendering %zu tracks, %d seconds each, on %d workers\n", count, seconds, workers);
+    uint64_t start = SDL_GetPerformanceCounter();
+    int      failed = 0;
+
+#if !defined(_WIN32)
+    /* The job counter is shared between the worker processes */
+    atomic_size_t * next = workers > 1 ? mmap(NULL, sizeof(atomic_size_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0) : MAP_FAILED;
+
+    if (next != MAP_FAILED)
+    {
+        atomic_init(next, 0);
+        fflush(stdout);
+
+        int started = 0;
+        for (; started < workers; started++)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                int f = nsf_worker(jobs, count, next, out_dir, out_path, wav, seconds);
+                fflush(stdout);
+                _exit(f > 255 ? 255 : f);
+            }
+            if (pid < 0)
+                break;
+        }
+
+        /* Nothing could be started, do it all here */
+        if (started == 0)
+            failed = nsf_worker(jobs, count, next, out_dir, out_path, wav, seconds);
+
+        for (int status; started > 0 && wait(&status) > 0; started--)
+            failed += WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+
+        munmap(next, sizeof(atomic_size_t));
+    }
+    else
+#endif
+    {
+        atomic_size_t next;
+        atomic_init(&next, 0);
+        failed = nsf_worker(jobs, count, &next, out_dir, out_path, wav, seconds);
+    }
+
+    uint64_t ms = (SDL_GetPerformanceCounter() - start) * 1000 / SDL_GetPerformanceFrequency();
+    printf("Rendered %zu tracks in %llu ms%s\n", count, (unsigned long long) ms, failed ? ", some failed" : "");
+
+    free(jobs);
+    return failed;
+}
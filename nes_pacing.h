@@ -0,0 +1,148 @@
+#pragma once
+
+/*
+    nes_pacing.h: Runs the emulator at the speed of the real thing
+
+    Deadlines come straight from the master clock: master cycle M is due at
+    M * 11 / 236.25 MHz after the start, so frames (341 * 262 PPU cycles, every frame
+    is that long here) come out at ~60.0985 Hz and no error builds up. The
+    timebase is rebased every 236,250,000 master cycles (exactly 11 seconds) to keep
+    the integer math from overflowing.
+
+    The speed can be nudged to follow the display (so a 60 Hz screen with vsync shows
+    every frame once), in parts per million. The audio device isn't followed here, the
+    APU's sample rate is corrected to it instead (see audio_push() in interface.h).
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <SDL2/SDL.h>
+
+#include "interface.h"
+
+/* NTSC master clock: 236.25 MHz / 11 (~21.477 MHz) */
+#define NES_MASTER_CLOCK_NUM    236250000
+#define NES_MASTER_CLOCK_DEN    11
+
+/* Master cycles per NTSC frame (341 * 262 PPU cycles, the PPU doesn't skip a cycle on odd frames) */
+#define NES_MASTER_FRAME        357368
+
+#define PACING_MAX_LAG_MS       100         /* Further behind than this, the lost time is dropped */
+#define PACING_LATE_US          1000        /* A frame that starts this late counts as late */
+#define PACING_STATS_FRAMES     600         /* Frames per jitter report (~10 sec) */
+#define PACING_DISPLAY_MAX_PPM  10000       /* Only follow displays within 1% of the NES */
+
+typedef struct _nes_pacing
+{
+    bool        enabled;
+    bool        stats;                      /* Print frame time statistics every PACING_STATS_FRAMES frames */
+
+    uint64_t    freq;                       /* Performance counter ticks per second */
+    uint64_t    base_master,                /* Master cycle 'base_counter' belongs to */
+                base_counter;
+    int32_t     display_ppm;                /* Speed correction, in parts per million */
+
+    /* Frame time statistics of the emulation thread */
+    Frame_stats frame_times;
+    uint32_t    late, resyncs;
+}
+_nes_pacing;
+_nes_pacing nes_pacing = { .frame_times = { .name = "emulation", .min = UINT64_MAX } };
+
+/* Performance counter ticks from the base to master cycle 'master' */
+static inline uint64_t pacing_ticks(uint64_t master)
+{
+    uint64_t t = (master - nes_pacing.base_master) * nes_pacing.freq * NES_MASTER_CLOCK_DEN / NES_MASTER_CLOCK_NUM;
+    int32_t  ppm = nes_pacing.display_ppm;
+
+    return ppm ? t * 1000000 / (uint64_t)(1000000 + ppm) : t;
+}
+
+/* Start pacing from master cycle 'master', which is due now */
+static inline void pacing_start(uint64_t master)
+{
+    nes_pacing.freq         = SDL_GetPerformanceFrequency();
+    nes_pacing.base_master  = master;
+    nes_pacing.base_counter = SDL_GetPerformanceCounter();
+    nes_pacing.enabled      = true;
+}
+
+/* Change the speed, from master cycle 'master' on */
+static inline void pacing_set_speed(uint64_t master, int32_t display_ppm)
+{
+    if (nes_pacing.enabled)
+    {
+        nes_pacing.base_counter += pacing_ticks(master);
+        nes_pacing.base_master   = master;
+    }
+
+    nes_pacing.display_ppm  = display_ppm;
+}
+
+/* Run at the refresh rate of a display (vsync), if it is close enough to the NES's */
+static inline void pacing_set_display_rate(uint64_t master, int refresh_hz)
+{
+    /* NES frame rate is NES_MASTER_CLOCK_NUM / NES_MASTER_CLOCK_DEN / NES_MASTER_FRAME */
+    int64_t nes_mhz = (int64_t) NES_MASTER_CLOCK_NUM * 1000 / ((int64_t) NES_MASTER_CLOCK_DEN * NES_MASTER_FRAME),
+            ppm     = ((int64_t) refresh_hz * 1000 - nes_mhz) * 1000000 / nes_mhz;
+
+    if (refresh_hz <= 0 || ppm > PACING_DISPLAY_MAX_PPM || ppm < -PACING_DISPLAY_MAX_PPM)
+        ppm = 0;
+
+    pacing_set_speed(master, (int32_t) ppm);
+}
+
+/* Print and reset the frame time statistics */
+static inline void pacing_report()
+{
+    char extra[64];
+    snprintf(extra, sizeof(extra), ", %u late, %u resyncs", nes_pacing.late, nes_pacing.resyncs);
+
+    frame_stats_report(&nes_pacing.frame_times, extra);
+    nes_pacing.late = nes_pacing.resyncs = 0;
+}
+
+/* Count a frame that was let through */
+static inline void pacing_frame_done()
+{
+    frame_stats_tick(&nes_pacing.frame_times);
+
+    if (nes_pacing.stats && nes_pacing.frame_times.frames == PACING_STATS_FRAMES)
+        pacing_report();
+}
+
+/* Wait until master cycle 'master' is due, called once per frame */
+static inline void pacing_frame(uint64_t master)
+{
+    if (!nes_pacing.enabled)
+    {
+        pacing_frame_done();
+        return;
+    }
+
+    /* Move the base along in whole 11 second steps */
+    while (master - nes_pacing.base_master >= 2ull * NES_MASTER_CLOCK_NUM)
+    {
+        uint64_t next = nes_pacing.base_master + NES_MASTER_CLOCK_NUM;
+        nes_pacing.base_counter += pacing_ticks(next);
+        nes_pacing.base_master   = next;
+    }
+
+    uint64_t deadline   = nes_pacing.base_counter + pacing_ticks(master),
+             now        = SDL_GetPerformanceCounter();
+
+    if (now > deadline + nes_pacing.freq * PACING_MAX_LAG_MS / 1000)
+    {
+        /* Too far behind (slow host, debugger), start over from here instead of rushing to catch up */
+        nes_pacing.base_master  = master;
+        nes_pacing.base_counter = deadline = now;
+        nes_pacing.resyncs++;
+    }
+    else if (now > deadline + nes_pacing.freq * PACING_LATE_US / 1000000)
+        nes_pacing.late++;
+    else
+        sleep_until(deadline);
+
+    pacing_frame_done();
+}
@@ -9,6 +9,13 @@
     https://wiki.nesdev.com/w/index.php/PPU_programmer_reference
 */
 
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /* 
     Standard color pallete of the NES, encoded as ARGB8888 32-bit hex values 0x00RRGGBB
 
@@ -118,6 +125,41 @@ typedef enum PPU_REGS
 }
 PPU_REGS;
 
+/* 
+Everything a scanline is composited from besides the nametables and pattern tables, 
+captured at cycle 257 (see PPU_render_deferred())
+*/
+typedef struct _PPU_line_state
+{
+    uint16_t    vram_addr;                      /* v where the scanline's fetches start */
+    uint8_t     fine_x, ctrl, mask;
+    uint8_t     palette[32];                    /* Palette RAM */
+
+    uint8_t     fg_count;                       /* Sprite shift registers and latches */
+    uint8_t     fg_s[2][8], fg_attrib[8], fg_hpos[8];
+
+    bool        bg_fetched;                     /* The background was fetched as the scanline ran (see PPU_bg_line_split()) */
+    uint8_t     bg[256];                        /* and these are its pixels */
+}
+_PPU_line_state;
+
+/* A change to the nametables or pattern tables while a deferred frame is running */
+#define PPU_VRAM_LOG_SIZE   8192
+#define PPU_VRAM_LOG_REMAP  0xFFFF              /* Offset of a page table change */
+
+typedef struct _PPU_vram_change
+{
+    uint8_t     line;                           /* First scanline that sees the change */
+    uint8_t     page;                           /* Page table entry */
+    uint16_t    offset;                         /* Byte in the page, or PPU_VRAM_LOG_REMAP */
+    union
+    {
+        struct { uint8_t before, after; };      /* Byte write */
+        struct { uint8_t * from, * to; };       /* Page table change */
+    };
+}
+_PPU_vram_change;
+
 /* 
 PPU implementation 
 
@@ -129,24 +171,16 @@ typedef struct _nes_ppu
 {
     /* Internal memory */
 
-    uint8_t * PPU_Nametable[4];             /* Pointers to the 4 nametables */
-    uint8_t * PPU_Attribtable[4];           /* Pointers to the 4 attribute tables ($40 in size) */    
+    /* Nametables and pattern tables are reached through the page table of the PPU bus */
     uint8_t * PPU_Pallete_Data[2];             /* Pointer to PPU pallete data (0 -> BG, 1-> FG) */
-    
-    union 
-    {
-        uint8_t     * PPU_Pattern_bytes[2]; /* Access via row data (2*8 = 16 bits) or byte stream */
-        uint16_t    * PPU_Pattern_row[2];
-    };
 
     uint32_t    screen_buffer[340 * 260];   /* All of the on-screen buffer, only visible portion is drawn in SDL */
     uint16_t    s, c, v, h;                 /* Scanlines and cycles, Vertical/Horizontal Indices for the screen */
 
     uint8_t PPU_registers[9];               /* Registers of the PPU */
     uint8_t PPU_Status;                     /* Status register of the PPU */
-    bool    clear_vblank,                   /* Flag to set/clear vblank bit on next tick */
-            set_scroll_addr_latch,          /* Flags to set address latch for PPUSCROLL and PPUADDR */
-            set_PPU_addr_latch;
+    bool    clear_vblank;                   /* Flag to set/clear vblank bit on next tick */
+    uint8_t PPU_data_buffer;                /* PPUDATA read buffer */
 
     /* Background */
 
@@ -154,6 +188,8 @@ typedef struct _nes_ppu
                 PPU_temp_vram_addr;         /* Temporary VRAM address (15-bits) */
     uint8_t     PPU_fine_x;                 /* Fine x scroll (3 bits) */
     bool        PPU_first_sec_w;            /* First or second write toggle (1-bit) */
+    uint16_t    PPU_line_vram_addr;         /* VRAM address the current scanline starts at (v at cycle 321 of the scanline before) */
+    uint8_t     PPU_line_fine_x;            /* Fine x scroll of the current scanline */
 
     union 
     {
@@ -187,14 +223,60 @@ typedef struct _nes_ppu
             uint32_t    PPU_SecOAM_Pixel[8];    /* OAM data (access as 32-bit pixel or byte stream like a normal person) */
             uint8_t     PPU_SecOAM_Bytes[32];
         };
+
+        uint8_t PPU_SecOAM_count;               /* Number of sprites found for the next scanline */
+        bool    PPU_SecOAM_sprite0;             /* Sprite 0 is the first entry of secondary OAM */
+
+        uint8_t PPU_OAM_sorted[64];             /* OAM indices sorted by Y position, rebuilt only when a Y byte changes */
+        uint8_t PPU_OAM_cursor;                 /* First sorted entry that can still be in range this frame */
+        bool    PPU_OAM_dirty;                  /* Set when a Y byte in OAM was written */
     };
 
-    uint8_t PPU_fg_s[8];                        /* 8 pairs of 8-bit shift regs to hold sprite data from the pattern table, 
-                                                to be rendered on the current scanline*/
+    uint8_t PPU_fg_s[2][8];                     /* 8 pairs of 8-bit shift regs to hold sprite data from the pattern table 
+                                                (lo/hi bitplanes, already flipped), to be rendered on the next scanline */
     uint8_t PPU_fg_attrib_l[8];                 /* Latches to hold attribute bytes for up to 8 sprites */
     uint8_t PPU_fg_hpos_c[8];                   /* Horizontal positions for up to 8 sprites */
+    uint8_t PPU_fg_count;                       /* Number of sprites in the shift registers */
+    bool    PPU_fg_sprite0;                     /* Sprite 0 is in the first shift register */
+
+    /* PPUSTATUS changes scheduled on the current scanline (cycle, 0 = none) */
+    uint16_t    PPU_sprite0_hit_c,
+                PPU_overflow_c;
 
-    bool    pre_render_scanline_set;
+    /* Scanline buffers, palette RAM indices (0 = transparent) */
+    uint8_t PPU_bg_line[256 + 16];              /* Background, starts at the first prefetched tile */
+
+    /* 
+    Background cache, the four nametables pre-rendered as palette RAM indices in their 2x2 
+    arrangement. Tiles are re-rendered at the start of a frame only if something they are 
+    made of was written, palette writes never invalidate it since colors are looked up later.
+    */
+    uint8_t     PPU_bg_cache[480][512];
+    uint32_t    PPU_bg_dirty[4][30];            /* Tiles to re-render, one bit per tile column */
+    uint64_t    PPU_chr_dirty[2][4];            /* Pattern table tiles written since the last update */
+    bool        PPU_chr_dirty_any;
+    uint8_t     PPU_bg_cache_pt;                /* Background pattern table the cache was rendered with */
+    bool        PPU_bg_cache_on,                /* Cleared for the rest of the frame by raster effects */
+                PPU_bg_line_cached,             /* Current scanline is blitted from the cache */
+                PPU_bg_line_fetched,            /* Current scanline is fetched a tile at a time into PPU_bg_line */
+                PPU_bg_next_fetched;            /* Next scanline has to be fetched a tile at a time */
+
+    uint32_t    frame;                          /* Frame counter */
+    bool        frame_complete;                 /* Set when the last visible scanline of a rendered frame is done, cleared by the frontend */
+    bool        frame_end;                      /* Set at the start of every v-blank (rendered or not), cleared by the frontend */
+
+    /* Frame skip, see PPU_set_frame_skip() */
+    uint8_t     render_every;                   /* Render every Nth frame (1 = all of them, 0 = only on request) */
+    bool        render_requested,               /* Render the next frame regardless */
+                frame_render;                   /* Pixels are generated for the current frame */
+
+    /* Deferred rendering, see PPU_set_deferred() */
+    bool                deferred,               /* Render frames after their last scanline */
+                        frame_deferred;         /* The current frame is */
+    _PPU_line_state     PPU_line_state[240];    /* Captured state of each scanline */
+    _PPU_vram_change    PPU_vram_log[PPU_VRAM_LOG_SIZE];
+    uint16_t            PPU_vram_log_count;
+    bool                PPU_vram_log_full;      /* Too many changes, the frame is rendered as it ended */
 }
 _nes_ppu;
 _nes_ppu nes_ppu;
@@ -218,6 +300,15 @@ $3F20-$3FFF 	$00E0 	Mirrors of $3F00-$3F1F
 typedef struct _nes_ppu_bus
 {
     uint8_t mem[0x4000];
+    /*
+    Every access goes through a table of 1KB pages, so mirroring and CHR bank switches only 
+    repoint entries:
+
+    0-7     Pattern tables, 64 tiles per page
+    8-11    Nametable slots ($2000, $2400, $2800, $2C00)
+    12-15   Mirrors of the nametable slots, palette RAM ($3F00-$3FFF) is looked up on its own
+    */
+    uint8_t * page[16];
     /* 
     To save on pins, the lower 8 pins of AB were multiplexed with the DB, not so with this emulator.
     The lower 8 bits of the Address bus are stored somewhere before the data bus is written to, so
@@ -226,10 +317,23 @@ typedef struct _nes_ppu_bus
     uint16_t    AB;         /* Address, data bus */ 
     uint8_t     DB;
     bool        RW;         /* Flags to indicate read or write */
+
+    bool        chr_rom;    /* Pattern tables are ROM, writes to them go nowhere */
 }
 _nes_ppu_bus;
 _nes_ppu_bus nes_ppu_bus;
 
+/* Nametable mirroring, which nametable RAM each of the 4 slots shows */
+typedef enum _PPU_mirroring
+{
+    PPU_MIRROR_HORIZONTAL,      /* $2000 = $2400, $2800 = $2C00 (vertical scrolling games) */
+    PPU_MIRROR_VERTICAL,        /* $2000 = $2800, $2400 = $2C00 (horizontal scrolling games) */
+    PPU_MIRROR_SINGLE_LO,       /* All slots show the first nametable */
+    PPU_MIRROR_SINGLE_HI,       /* All slots show the second nametable */
+    PPU_MIRROR_FOUR_SCREEN      /* Extra nametable RAM on the cartridge */
+}
+PPU_mirroring;
+
 /* An easier way of accessing pixel data (Optional) */
 
 /* Stores current tile information */
@@ -256,29 +360,187 @@ typedef struct _ppu_tile
 _ppu_tile;
 _ppu_tile current_tile;
 
+/* Bitplane byte -> 8 pixel bytes (0 or 1), used to decode 8 pixels at a time */
+uint64_t PPU_bitplane_lut[256];
+
+/* 
+Background cache write tracking
+
+Writes only mark what they touch, the cache catches up at the start of the next frame. 
+A write during the visible scanlines is a raster effect the cache can't follow (even with 
+rendering turned off for a while, the scanlines after it see the write), so the rest of 
+that frame is fetched tile by tile instead.
+*/
+static inline void PPU_bg_cache_raster_check()
+{
+    if (nes_ppu.s < 240)
+        nes_ppu.PPU_bg_cache_on = false;
+}
+
+/* Called before anything the background fetches see changes, the scanline it happens on sees it from there on */
+static inline void PPU_bg_line_split(void);
+
+/* Every tile of every nametable has to be re-rendered */
+static inline void PPU_bg_cache_invalidate()
+{
+    memset(nes_ppu.PPU_bg_dirty, 0xFF, sizeof(nes_ppu.PPU_bg_dirty));
+}
+
+/* Nametable write at offset 'o' of the 1KB page 'page', marks the tile (or the 4x4 tiles of an attribute byte) */
+static inline void PPU_bg_cache_nt_write(const uint8_t * page, uint16_t o)
+{
+    /* The same page can be shown by more than one nametable because of mirroring */
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        if (nes_ppu_bus.page[8 | i] != page)
+            continue;
+
+        if (o < 0x3C0)
+        {
+            nes_ppu.PPU_bg_dirty[i][o >> 5] |= 1u << (o & 0x1F);
+            continue;
+        }
+
+        uint8_t row = ((o >> 3) & 0x7) << 2,
+                col = (o & 0x7) << 2;
+        for (uint8_t r = row; r < row + 4 && r < 30; r++)
+            nes_ppu.PPU_bg_dirty[i][r] |= 0xFu << col;
+    }
+
+    PPU_bg_cache_raster_check();
+}
+
+/* Pattern table write, marks the tile, the nametable tiles using it are found on the next update */
+static inline void PPU_bg_cache_chr_write(uint16_t addr)
+{
+    uint8_t tile = (addr >> 4) & 0xFF;
+
+    nes_ppu.PPU_chr_dirty[addr >> 12][tile >> 6] |= 1ull << (tile & 0x3F);
+    nes_ppu.PPU_chr_dirty_any = true;
+
+    PPU_bg_cache_raster_check();
+}
+
+/* 
+Log a nametable/pattern table change made while a deferred frame is on the visible 
+scanlines, scanlines that were already composited (cycle 257) don't see it
+*/
+static inline _PPU_vram_change * PPU_vram_log(uint8_t page, uint16_t offset)
+{
+    if (!nes_ppu.frame_deferred || nes_ppu.s >= 240 || nes_ppu.PPU_vram_log_full)
+        return NULL;
+
+    if (nes_ppu.PPU_vram_log_count == PPU_VRAM_LOG_SIZE)
+    {
+        nes_ppu.PPU_vram_log_full = true;
+        return NULL;
+    }
+
+    _PPU_vram_change * e = &nes_ppu.PPU_vram_log[nes_ppu.PPU_vram_log_count++];
+    e->line     = nes_ppu.s + (nes_ppu.c > 257);
+    e->page     = page;
+    e->offset   = offset;
+    return e;
+}
+
+/* Point page 'i' of the PPU bus at 'mem', whatever was rendered from the old page is stale */
+static inline void PPU_map_page(uint8_t i, uint8_t * mem)
+{
+    if (nes_ppu_bus.page[i] == mem)
+        return;
+
+    PPU_bg_line_split();
+
+    _PPU_vram_change * e = PPU_vram_log(i, PPU_VRAM_LOG_REMAP);
+    if (e != NULL)
+    {
+        e->from = nes_ppu_bus.page[i];
+        e->to   = mem;
+    }
+
+    nes_ppu_bus.page[i] = mem;
+
+    if (i < 8)
+    {
+        nes_ppu.PPU_chr_dirty[i >> 2][i & 0x3] = ~0ull;
+        nes_ppu.PPU_chr_dirty_any = true;
+    }
+    else if (i < 12)
+        memset(nes_ppu.PPU_bg_dirty[i & 0x3], 0xFF, sizeof(nes_ppu.PPU_bg_dirty[0]));
+
+    PPU_bg_cache_raster_check();
+}
+
+/* Set nametable mirroring, $3000-$3EFF mirrors the slots as well */
+static inline void PPU_set_mirroring(PPU_mirroring mode)
+{
+    static const uint8_t ciram[5][4] = {
+        {0, 0, 1, 1},
+        {0, 1, 0, 1},
+        {0, 0, 0, 0},
+        {1, 1, 1, 1},
+        {0, 1, 2, 3}
+    };
+
+    for (uint8_t i = 0; i < 4; i++)
+    {
+        PPU_map_page(8  | i, &nes_ppu_bus.mem[0x2000 + ciram[mode][i] * 0x400]);
+        PPU_map_page(12 | i, &nes_ppu_bus.mem[0x2000 + ciram[mode][i] * 0x400]);
+    }
+}
+
+/* Pattern bytes of 'tile' in pattern table 'pt_i' (a tile never crosses a page) */
+static inline const uint8_t * PPU_pattern_tile(uint8_t pt_i, uint8_t tile)
+{
+    return &nes_ppu_bus.page[(pt_i << 2) | (tile >> 6)][(uint16_t)(tile & 0x3F) << 4];
+}
+
+/* Palette RAM offset, $3F10/$3F14/$3F18/$3F1C are mirrors of $3F00/$3F04/$3F08/$3F0C */
+static inline uint8_t PPU_palette_index(uint16_t addr)
+{
+    uint8_t i = addr & 0x1F;
+    return ((i & 0x13) == 0x10) ? (i & 0x0F) : i;
+}
+
 /* Read from PPU memory */
 static inline uint8_t PPU_PEEK(uint16_t addr)
 {
-    /* Name table mirrors */
-    if (addr >= 0x2000 && addr < 0x3F00)
-        return nes_ppu_bus.mem[(addr & 0x0EFF) + 0x2000];
-    /* Pallete mirrors */
-    if (addr >= 0x3F00 && addr < 0x4000)
-        return nes_ppu_bus.mem[(addr & 0x1F) + 0x3F00];
-    return nes_ppu_bus.mem[addr];    
+    addr &= 0x3FFF;
+
+    if (addr >= 0x3F00)
+        return nes_ppu_bus.mem[0x3F00 | PPU_palette_index(addr)];
+    return nes_ppu_bus.page[addr >> 10][addr & 0x3FF];
 }
 
-/* Write to PPU memory */
+/* Write to PPU memory, writes that don't change anything don't invalidate the background cache */
 static inline void PPU_POKE(uint16_t addr, uint8_t data)
 {
-    /* Name table mirrors */
-    if (addr >= 0x2000 && addr < 0x3F00)
-        nes_ppu_bus.mem[(addr & 0x0EFF) + 0x2000] = data;
-    /* Pallete mirrors */
-    else if (addr >= 0x3F00 && addr < 0x4000)
-        nes_ppu_bus.mem[(addr & 0x1F) + 0x3F00] = data;
+    addr &= 0x3FFF;
+
+    if (addr >= 0x3F00)
+    {
+        nes_ppu_bus.mem[0x3F00 | PPU_palette_index(addr)] = data;
+        return;
+    }
+
+    uint8_t * page = nes_ppu_bus.page[addr >> 10];
+    if (page[addr & 0x3FF] == data || (addr < 0x2000 && nes_ppu_bus.chr_rom))
+        return;
+
+    PPU_bg_line_split();
+
+    _PPU_vram_change * e = PPU_vram_log(addr >> 10, addr & 0x3FF);
+    if (e != NULL)
+    {
+        e->before   = page[addr & 0x3FF];
+        e->after    = data;
+    }
+
+    page[addr & 0x3FF] = data;
+    if (addr < 0x2000)
+        PPU_bg_cache_chr_write(addr);
     else
-        nes_ppu_bus.mem[addr] = data;
+        PPU_bg_cache_nt_write(page, addr & 0x3FF);
 }
 
 /* All PPU reg operations */
@@ -318,7 +580,8 @@ void (*REG_EXEC[8])(void) = {
 */
 static inline void USE_REGS(PPU_REGS reg, bool RW, uint8_t data)
 {
-    nes_ppu_bus.DB == data;
+    nes_ppu_bus.DB = data;
+    nes_ppu_bus.RW = RW;
     const char * function_list = (RW == 0) ? "__x_x__x" : "xx_xxxxx";
 
     if(function_list[reg] == 'x') 
@@ -328,21 +591,10 @@ static inline void USE_REGS(PPU_REGS reg, bool RW, uint8_t data)
 /* Init the PPU */
 static inline void nes_init_ppu()
 {
-    /* Set pointers to each nametable */
-    nes_ppu.PPU_Nametable[0] = &nes_ppu_bus.mem[0x2000];
-    nes_ppu.PPU_Nametable[1] = &nes_ppu_bus.mem[0x2400];
-    nes_ppu.PPU_Nametable[2] = &nes_ppu_bus.mem[0x2800];
-    nes_ppu.PPU_Nametable[3] = &nes_ppu_bus.mem[0x2C00];
-
-    /* Set pointers to each attribute tables */
-    nes_ppu.PPU_Attribtable[0] = &nes_ppu_bus.mem[0x23C0];
-    nes_ppu.PPU_Attribtable[1] = &nes_ppu_bus.mem[0x27C0];
-    nes_ppu.PPU_Attribtable[2] = &nes_ppu_bus.mem[0x2BC0];
-    nes_ppu.PPU_Attribtable[3] = &nes_ppu_bus.mem[0x2FC0];
-
-    /* Set pointers to pattern tables */
-    nes_ppu.PPU_Pattern_bytes[0] = &nes_ppu_bus.mem[0x0000];
-    nes_ppu.PPU_Pattern_bytes[1] = &nes_ppu_bus.mem[0x1000];
+    /* Pattern tables (8KB of CHR), nametables until the cartridge tells us its mirroring */
+    for (uint8_t i = 0; i < 8; i++)
+        PPU_map_page(i, &nes_ppu_bus.mem[i * 0x400]);
+    PPU_set_mirroring(PPU_MIRROR_HORIZONTAL);
 
     /* Set pointers to BG/FG pallete indexes */
     nes_ppu.PPU_Pallete_Data[0] = &nes_ppu_bus.mem[0x3F00];
@@ -351,16 +603,51 @@ static inline void nes_init_ppu()
     /* Set status register */
     nes_ppu.PPU_Status = 0xA0;
 
-    /* Set pre-render scanline flag to true*/
-    nes_ppu.pre_render_scanline_set = true;
+    /* Expand each bitplane byte into 8 pixel bytes (leftmost pixel first) */
+    for (size_t i = 0; i < 256; i++)
+    {
+        PPU_bitplane_lut[i] = 0;
+        for (size_t j = 0; j < 8; j++)
+            PPU_bitplane_lut[i] |= (uint64_t)((i >> (7 - j)) & 0x1) << (j * 8);
+    }
+
+    /* Sprite index has to be built before the first scanline, and so does the background cache */
+    nes_ppu.PPU_OAM_dirty = true;
+    PPU_bg_cache_invalidate();
 
-    /* Finally, set indices accordingly */
+    /* Render every frame until told otherwise */
+    nes_ppu.render_every = 1;
+    nes_ppu.frame_render = true;
+
+    /* Finally, set indices accordingly (start on the pre-render scanline) */
     nes_ppu.v = 0;
     nes_ppu.h = 0;
-    nes_ppu.s = -1;
+    nes_ppu.s = 261;
     nes_ppu.c = 0;
 }
 
+/* 
+Frame skip
+
+Skipped frames keep the exact PPUSTATUS timing (v-blank, sprite 0 hit and overflow are 
+still evaluated, sprite 0 hit from its own fetches), but no background tiles are decoded, 
+the background cache isn't updated, and nothing is composited or plotted. A frame is 
+decided at the start of the pre-render scanline, and only rendered frames set 
+frame_complete.
+*/
+
+/* Render every 'n'th frame, 0 only renders frames asked for with PPU_render_next_frame() */
+static inline void PPU_set_frame_skip(uint8_t n)
+{
+    nes_ppu.render_every = n;
+}
+
+/* Render the next frame even if it would be skipped */
+static inline void PPU_render_next_frame()
+{
+    nes_ppu.render_requested = true;
+}
+
 /*
 PPUCTRL: PPU Control Register (write)
 
@@ -384,7 +671,21 @@ VPHB SINN
 */
 static inline void EXEC_PPUCTRL()
 {
+    /* Sprites skipped by the sprite index cursor may be back in range if the sprite size changes */
+    if ((nes_ppu.PPU_registers[PPUCTRL] ^ nes_ppu_bus.DB) & 0x20)
+        nes_ppu.PPU_OAM_cursor = 0;
+
+    if ((nes_ppu.PPU_registers[PPUCTRL] ^ nes_ppu_bus.DB) & 0x10)
+        PPU_bg_line_split();
+
+    /* Enabling NMI during v-blank triggers one right away */
+    if (!(nes_ppu.PPU_registers[PPUCTRL] & 0x80) && (nes_ppu_bus.DB & 0x80) && (nes_ppu.PPU_registers[PPUSTATUS] & 0x80))
+        nes_cpu_bus.NMI = true;
+
     nes_ppu.PPU_registers[PPUCTRL] = nes_ppu_bus.DB;
+
+    /* Base nametable goes to t: ...GH.. ........ <- d: ......GH */
+    nes_ppu.PPU_temp_vram_addr = (nes_ppu.PPU_temp_vram_addr & 0x73FF) | ((uint16_t)(nes_ppu_bus.DB & 0x03) << 10);
 }
 
 /*
@@ -405,6 +706,10 @@ BGRs bMmG
 */
 static inline void EXEC_PPUMASK()
 {
+    /* Turning rendering on or off starts or stops the fetches */
+    if (((nes_ppu.PPU_registers[PPUMASK] & 0x18) != 0) != ((nes_ppu_bus.DB & 0x18) != 0))
+        PPU_bg_line_split();
+
     nes_ppu.PPU_registers[PPUMASK] = nes_ppu_bus.DB;
 }
 
@@ -412,10 +717,8 @@ static inline void EXEC_PPUMASK()
 static inline void EXEC_PPUSTATUS()
 {
     nes_ppu.clear_vblank        = 1;   /* Clear vblank bit on next tick */
-    nes_ppu.PPU_fine_x          = 0x0; /* Clear address latches and flags */
-    nes_ppu_bus.AB              = 0x0;
-    //nes_ppu.set_addr_latch      = false;
-    nes_ppu.set_PPU_addr_latch  = false;
+    nes_ppu.PPU_first_sec_w     = false;
+    nes_ppu_bus.DB              = nes_ppu.PPU_registers[PPUSTATUS];
 }
 
 static inline void EXEC_OAMADDR()
@@ -427,8 +730,11 @@ static inline void EXEC_OAMDATA()
 {
     if (nes_ppu_bus.RW == 1)
     {
-        nes_ppu.PPU_OAM_Bytes[nes_ppu.OAM_addr] = nes_ppu_bus.DB;
-        
+        /* Only Y bytes affect the sorted sprite index */
+        if ((nes_ppu.OAM_addr & 0x3) == 0 && nes_ppu.PPU_OAM_Bytes[nes_ppu.OAM_addr] != nes_ppu_bus.DB)
+            nes_ppu.PPU_OAM_dirty = true;
+
+        nes_ppu.PPU_OAM_Bytes[nes_ppu.OAM_addr++] = nes_ppu_bus.DB;
     }
     else
     {
@@ -436,40 +742,96 @@ static inline void EXEC_OAMDATA()
     }
 }
 
+/*
+Scrolling, from https://wiki.nesdev.com/w/index.php/PPU_scrolling
+
+v and t are laid out like this:
+
+    yyy NN YYYYY XXXXX
+    ||| || ||||| +++++-- coarse X scroll
+    ||| || +++++-------- coarse Y scroll
+    ||| ++-------------- nametable select
+    +++----------------- fine Y scroll
+
+PPUSCROLL and PPUADDR share the write toggle (w), reading PPUSTATUS resets it
+*/
 static inline void EXEC_PPUSCROLL()
 {
-    if (nes_ppu.set_scroll_addr_latch == false)
+    if (nes_ppu.PPU_first_sec_w == false)
     {
-        nes_ppu.PPU_current_vram_addr   = (uint16_t) nes_ppu_bus.DB << 8;
-        nes_ppu.set_scroll_addr_latch   = true;
+        /* t: ....... ...HGFED <- d: HGFED..., x: CBA <- d: .....CBA */
+        nes_ppu.PPU_temp_vram_addr  = (nes_ppu.PPU_temp_vram_addr & 0x7FE0) | (nes_ppu_bus.DB >> 3);
+        nes_ppu.PPU_fine_x          = nes_ppu_bus.DB & 0x7;
     }
     else
     {
-        nes_ppu.PPU_fine_x |= nes_ppu_bus.DB;
+        /* t: CBA..HG FED..... <- d: HGFEDCBA */
+        nes_ppu.PPU_temp_vram_addr  = (nes_ppu.PPU_temp_vram_addr & 0x0C1F) 
+                                    | ((uint16_t)(nes_ppu_bus.DB & 0x07) << 12) 
+                                    | ((uint16_t)(nes_ppu_bus.DB & 0xF8) << 2);
     }
-    //nes_ppu.PPU_registers[PPUSCROLL] = nes_ppu_bus.DB;
+    nes_ppu.PPU_first_sec_w = !nes_ppu.PPU_first_sec_w;
 }
 
 static inline void EXEC_PPUADDR()
 {
-    if (nes_ppu.set_PPU_addr_latch == false)
+    if (nes_ppu.PPU_first_sec_w == false)
     {
-        nes_ppu_bus.AB                  = (uint16_t) nes_ppu_bus.DB << 8;
-        nes_ppu.set_PPU_addr_latch      = true;
+        /* t: .FEDCBA ........ <- d: ..FEDCBA, bit 14 of t is cleared */
+        nes_ppu.PPU_temp_vram_addr  = (nes_ppu.PPU_temp_vram_addr & 0x00FF) | ((uint16_t)(nes_ppu_bus.DB & 0x3F) << 8);
     }
     else
     {
-        nes_ppu_bus.AB |= nes_ppu_bus.DB;
+        /* t: ....... HGFEDCBA <- d: HGFEDCBA, then v = t */
+        nes_ppu.PPU_temp_vram_addr      = (nes_ppu.PPU_temp_vram_addr & 0x7F00) | nes_ppu_bus.DB;
+        PPU_bg_line_split();
+        nes_ppu.PPU_current_vram_addr   = nes_ppu.PPU_temp_vram_addr;
+
+        /* Moving v mid-frame changes where the next scanlines come from */
+        PPU_bg_cache_raster_check();
     }
-    nes_ppu.PPU_registers[PPUSCROLL] = nes_ppu_bus.DB;
+    nes_ppu.PPU_first_sec_w = !nes_ppu.PPU_first_sec_w;
 }
 
+/* 
+Access VRAM at v, then increment it by 1 (across) or 32 (down). Reads below the palette 
+return the read buffer and refill it, palette reads are immediate (the buffer gets the 
+nametable byte "under" the palette)
+*/
 static inline void EXEC_PPUDATA()
 {
+    PPU_bg_line_split();
+
+    nes_ppu_bus.AB = nes_ppu.PPU_current_vram_addr & 0x3FFF;
+
     if (nes_ppu_bus.RW == 1)
         PPU_POKE(nes_ppu_bus.AB, nes_ppu_bus.DB);
+    else if (nes_ppu_bus.AB < 0x3F00)
+    {
+        nes_ppu_bus.DB          = nes_ppu.PPU_data_buffer;
+        nes_ppu.PPU_data_buffer = PPU_PEEK(nes_ppu_bus.AB);
+    }
     else
-        nes_ppu_bus.DB = PPU_PEEK(nes_ppu_bus.AB);
+    {
+        nes_ppu_bus.DB          = PPU_PEEK(nes_ppu_bus.AB);
+        nes_ppu.PPU_data_buffer = PPU_PEEK(nes_ppu_bus.AB - 0x1000);
+    }
+
+    nes_ppu.PPU_current_vram_addr = (nes_ppu.PPU_current_vram_addr + ((nes_ppu.PPU_registers[PPUCTRL] & 0x04) ? 32 : 1)) & 0x7FFF;
+}
+
+/* 'n' PPUDATA writes in a row, done like EXEC_PPUDATA would do them one at a time */
+static inline void PPU_data_write_block(const uint8_t * data, uint16_t n)
+{
+    uint16_t inc    = (nes_ppu.PPU_registers[PPUCTRL] & 0x04) ? 32 : 1,
+             v      = nes_ppu.PPU_current_vram_addr;
+
+    PPU_bg_line_split();
+
+    for (uint16_t i = 0; i < n; i++, v = (v + inc) & 0x7FFF)
+        PPU_POKE(v, data[i]);
+
+    nes_ppu.PPU_current_vram_addr = v;
 }
 
 /* 
@@ -501,27 +863,35 @@ Each cycle on the 2A02 (NES CPU) is about 3 PPU cycles
 
 static inline void PPU_plot_row(uint16_t x, uint16_t y, uint32_t * data); /* Plot pixel row */
 
-/* Return nametable byte */
-static inline uint8_t get_nametable_byte(uint8_t i)
+/* Return nametable byte of the tile at v */
+static inline uint8_t get_nametable_byte()
+{
+    uint16_t v = nes_ppu.PPU_current_vram_addr;
+
+    return nes_ppu_bus.page[8 | ((v >> 10) & 0x3)][v & 0x3FF];
+}
+
+/* Return attribute table byte of the tile at v (one byte for each 4x4 tile group) */
+static inline uint8_t get_attrib_table_byte()
 {
-    uint8_t nt_x = nes_ppu.h >> 3,
-            nt_y = nes_ppu.v >> 3;
+    uint16_t v = nes_ppu.PPU_current_vram_addr;
 
-    return nes_ppu.PPU_Nametable[(i & 0x3)][(nt_y * 0x1E + nt_x) & 0x3FF];
+    return nes_ppu_bus.page[8 | ((v >> 10) & 0x3)][0x3C0 | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)];
 }
 
-/* Return attribute table byte */
-static inline uint8_t get_attrib_table_byte(uint8_t i)
+/* 8 palette RAM indices for a pattern row, transparent pixels stay 0 so they show the backdrop */
+static inline uint64_t PPU_tile_row(uint8_t pt_lo, uint8_t pt_hi, uint8_t pat_index)
 {
-    uint8_t at_x = nes_ppu.h >> 4,
-            at_y = nes_ppu.v >> 4;
+    uint64_t pix    = PPU_bitplane_lut[pt_lo] | (PPU_bitplane_lut[pt_hi] << 1);
+    uint64_t opaque = ((pix | (pix >> 1)) & 0x0101010101010101ull) * 0xFF;
 
-    return nes_ppu.PPU_Attribtable[(i & 0x3)][(at_y * 0x8 + at_x) & 0x3F];
+    return (pix | ((uint64_t)(pat_index << 2) * 0x0101010101010101ull)) & opaque;
 }
 
 /* 
     Decode the pixel row by mapping the attribute byte with its corresponding entry
-    in the pallete table and the pixel value (0-3) to its corresponding color
+    in the pallete table and the pixel value (0-3) to its palette RAM index, the 
+    actual color lookup happens once per scanline in PPU_render_scanline()
 
     Attribute entry:
 
@@ -537,42 +907,19 @@ static inline uint8_t get_attrib_table_byte(uint8_t i)
 */
 static inline void decode_pixel_row(uint8_t attr_byte)
 {
-    /* Get pallete table entry for top left/right and bottom left/right quadrants */
-    uint8_t TL = (attr_byte & 0x03),
-            TR = (attr_byte & 0x0C) >> 2,
-            BL = (attr_byte & 0x30) >> 4,
-            BR = (attr_byte & 0xC0) >> 6;
-    
     /* 
-    See which tile quadrant we're in, set the pallete table index to the corresponding value in the quadrant.
+    See which tile quadrant we're in (bit 1 of coarse X and coarse Y), the shift selects 
+    the pallete table index in the quadrant.
     ( 0 , 0 ) or (0x0) -> Top-left
-    ( 0 , 1 ) or (0x1) -> Bottom-left
+    ( 0 , 1 ) or (0x4) -> Bottom-left
     ( 1 , 0 ) or (0x2) -> Top-right
-    ( 1 , 1 ) or (0x3) -> Bottom-right
+    ( 1 , 1 ) or (0x6) -> Bottom-right
     */
-    uint8_t q_xy = ((nes_ppu.h - 1) & 0x08) >> 2 | ((nes_ppu.v - 1) & 0x08) >> 3;
-    uint32_t decoded_pixels[8];
-
-    uint8_t pat_index = 0x00;
-    switch (q_xy)
-    {
-        case 0x0: pat_index = TL; break;
-        case 0x1: pat_index = BL; break;
-        case 0x2: pat_index = TR; break;
-        case 0x3: pat_index = BR; break;
-    }
-
-    /* Begin mapping of pixel colors */
-    decoded_pixels[0] = NES_palette[(pat_index * 4) + current_tile.pix0];
-    decoded_pixels[1] = NES_palette[(pat_index * 4) + current_tile.pix1];
-    decoded_pixels[2] = NES_palette[(pat_index * 4) + current_tile.pix2];
-    decoded_pixels[3] = NES_palette[(pat_index * 4) + current_tile.pix3];
-    decoded_pixels[4] = NES_palette[(pat_index * 4) + current_tile.pix4];
-    decoded_pixels[5] = NES_palette[(pat_index * 4) + current_tile.pix5];
-    decoded_pixels[6] = NES_palette[(pat_index * 4) + current_tile.pix6];
-    decoded_pixels[7] = NES_palette[(pat_index * 4) + current_tile.pix7];
-    
-    PPU_plot_row(nes_ppu.h, nes_ppu.v, (uint32_t *)decoded_pixels);
+    uint16_t v          = nes_ppu.PPU_current_vram_addr;
+    uint8_t q_xy        = ((v >> 4) & 0x4) | (v & 0x2);
+    uint64_t row        = PPU_tile_row(current_tile.pt_lo, current_tile.pt_hi, (attr_byte >> q_xy) & 0x3);
+
+    memcpy(&nes_ppu.PPU_bg_line[nes_ppu.h], &row, sizeof(row));
 }
 
 /* Convert the high and lo byte of the pixel row to the corresponding pixel value (0-3) */
@@ -596,132 +943,1057 @@ static inline uint16_t conv_to_pix_row(uint8_t h, uint8_t l)
                         ((l & 0x01))));
 }
 
+/* v of the next tile to the right, wrapping into the horizontally adjacent nametable */
+static inline uint16_t PPU_next_tile_x(uint16_t v)
+{
+    return ((v & 0x001F) == 31) ? (v & ~0x001F) ^ 0x0400 : v + 1;
+}
+
+/* Increment coarse X */
+static inline void PPU_increment_x()
+{
+    nes_ppu.PPU_current_vram_addr = PPU_next_tile_x(nes_ppu.PPU_current_vram_addr);
+}
+
+/* Increment fine Y, then coarse Y, row 29 wraps into the vertically adjacent nametable (31 doesn't) */
+static inline void PPU_increment_y()
+{
+    uint16_t v = nes_ppu.PPU_current_vram_addr;
+
+    if ((v & 0x7000) != 0x7000)
+    {
+        nes_ppu.PPU_current_vram_addr = v + 0x1000;
+        return;
+    }
+
+    uint8_t y = (v >> 5) & 0x1F;
+    v &= ~0x7000;
+    if (y == 29)
+    {
+        y = 0;
+        v ^= 0x0800;
+    }
+    else
+        y = (y + 1) & 0x1F;
+
+    nes_ppu.PPU_current_vram_addr = (v & ~0x03E0) | ((uint16_t)y << 5);
+}
+
+/* Background fetch, one memory access every 2 cycles, the tile is decoded on the last one */
+static inline void PPU_bg_fetch()
+{
+    /* Background pattern table address    (0: $0000; 1: $1000) */
+    uint8_t pt_i = (nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4;
+
+    switch ((nes_ppu.c - 1) & 0x7)
+    {
+        case 1: current_tile.nt_byte = get_nametable_byte();    break;      /* Fetch */
+        case 3: current_tile.at_byte = get_attrib_table_byte(); break;      /* Fetch */
+        case 5: current_tile.t_row = (nes_ppu.PPU_current_vram_addr >> 12);
+                current_tile.pt_lo = PPU_pattern_tile(pt_i, current_tile.nt_byte)[current_tile.t_row];
+                break;                                                      /* Get row index and lo byte for the tile */
+        case 7: current_tile.pt_hi = PPU_pattern_tile(pt_i, current_tile.nt_byte)[8 + current_tile.t_row];
+                decode_pixel_row(current_tile.at_byte);
+                PPU_increment_x();
+                break;                                                      /* Get hi byte for the tile, decode it and move on */
+    }
+}
+
 /* 
-Each tick of the PPU (1 cycle's worth of data here) 
+Background cache
 
-Relevant sources:
-https://wiki.nesdev.com/w/index.php/PPU_rendering#Frame_timing_diagram
-https://wiki.nesdev.com/w/images/d/d1/Ntsc_timing.png
+The cache holds the four nametables side by side like the PPU sees them:
 
+    +-----+-----+
+    | $20 | $24 |   512 x 480 palette RAM indices, a scanline is a (wrapping) 256 byte 
+    +-----+-----+   copy from the row and column v points to. Only dirty tiles are
+    | $28 | $2C |   re-rendered, once per frame before the first scanline.
+    +-----+-----+
+
+Scanlines fall back to the fetches when the cache can't show them: after a raster effect 
+(see PPU_bg_cache_raster_check()), when the background pattern table changed mid-frame, 
+or when coarse Y points into the attribute table (rows 30 and 31).
 */
-static inline void PPU_tick()
+
+/* Render tile (col, row) of nametable 'nt' into the background cache */
+static inline void PPU_bg_cache_tile(uint8_t nt, uint8_t row, uint8_t col, uint8_t pt_i)
 {
-    /* Properly reset cycle counter if > 341 */
-    nes_ppu.c %= 340; 
+    const uint8_t * nametable = nes_ppu_bus.page[8 | nt];
 
-    /* Clear v-blank flag */
-    if (nes_ppu.clear_vblank == true)
-        nes_ppu.PPU_registers[PPUSTATUS] &= 0x7F;
+    uint8_t tile = nametable[(row << 5) | col],
+            attr = nametable[0x3C0 | ((row << 1) & 0x38) | (col >> 2)],
+            pal  = (attr >> (((row << 1) & 0x4) | (col & 0x2))) & 0x3;
 
-    /* Actual rendering stuff */
-    if (nes_ppu.s == -1 || nes_ppu.s == 261)        /* Pre-render scanline, fetch 2x tile data for the next scanline here */
-        nes_ppu.pre_render_scanline_set = true;
-    else if (nes_ppu.s == 240)                      /* Post-render idle scanline */
-    {}    // idling
-    else if (nes_ppu.s > 240)                       /* V-Blank line */
+    const uint8_t * pattern = PPU_pattern_tile(pt_i, tile);
+    uint8_t * dst = &nes_ppu.PPU_bg_cache[(nt >> 1) * 240 + (row << 3)][((nt & 0x1) << 8) | (col << 3)];
+
+    for (uint8_t y = 0; y < 8; y++, dst += 512)
     {
-        nes_ppu.PPU_registers[PPUSTATUS] |= 0x80; 
-        nes_ppu.v = 0;
+        uint64_t px = PPU_tile_row(pattern[y], pattern[y + 8], pal);
+        memcpy(dst, &px, sizeof(px));
+    }
+}
+
+/* Bring the background cache up to date for background pattern table 'pt_i' */
+static inline void PPU_bg_cache_update(uint8_t pt_i)
+{
+    if (pt_i != nes_ppu.PPU_bg_cache_pt)
+    {
+        PPU_bg_cache_invalidate();
+        nes_ppu.PPU_bg_cache_pt = pt_i;
     }
-    if (nes_ppu.c == 0)                             /* Idle cycle */
-        nes_ppu.c++;
-    else if (nes_ppu.c >= 1 && nes_ppu.c <= 17)     /* 2x tile data for the scanline are retrieved from the shift regs */
+
+    /* Find the tiles that use a pattern written since the last update */
+    if (nes_ppu.PPU_chr_dirty_any)
     {
-        /* Check if we're in the first or second tile fetch */
-        uint8_t i = ((nes_ppu.c - 1) & 0xF) >> 3; 
+        const uint64_t * chr = nes_ppu.PPU_chr_dirty[pt_i];
+
+        for (uint8_t nt = 0; nt < 4; nt++)
+            for (uint8_t row = 0; row < 30; row++)
+                for (uint8_t col = 0; col < 32; col++)
+                {
+                    uint8_t t = nes_ppu_bus.page[8 | nt][(row << 5) | col];
+                    if ((chr[t >> 6] >> (t & 0x3F)) & 0x1)
+                        nes_ppu.PPU_bg_dirty[nt][row] |= 1u << col;
+                }
+
+        memset(nes_ppu.PPU_chr_dirty, 0x00, sizeof(nes_ppu.PPU_chr_dirty));
+        nes_ppu.PPU_chr_dirty_any = false;
+    }
 
-        if (nes_ppu.pre_render_scanline_set == false && nes_ppu.s < 240)
+    for (uint8_t nt = 0; nt < 4; nt++)
+        for (uint8_t row = 0; row < 30; row++)
         {
-            switch ((nes_ppu.c - 1) & 0x7)
-            {
-                /* NOTE: i need to fix this union to only give the lower 8 bits when accessing PPU_bg_u8_s, this line of code doesn't make much sense otherwise */
-                case 1: current_tile.nt_byte = (uint8_t)nes_ppu.PPU_bg_u16_s[(i * 3) + 0]; break;   /* Fetch */
-                case 3: current_tile.at_byte = (uint8_t)nes_ppu.PPU_bg_u16_s[(i * 3) + 1]; break;   /* Fetch */
-                case 5: current_tile.t_row = (nes_ppu.v & 0x7);                     
-                        current_tile.pt_lo = (nes_ppu.PPU_bg_u16_s[(i * 3) + 2] & 0xFF00) >> 4;
-                        break;                                                                      /* Get row index and lo byte for the tile */
-                case 7: current_tile.pt_hi = (nes_ppu.PPU_bg_u16_s[(i * 3) + 2] & 0x00FF);
-                        current_tile.row = conv_to_pix_row(current_tile.pt_lo, current_tile.pt_hi);
-                        decode_pixel_row(current_tile.at_byte);
-                        nes_ppu.h += 8;
-                        break;                                                                      /* Get hi byte for the tile and render to screen */
-            }
+            for (uint32_t bits = nes_ppu.PPU_bg_dirty[nt][row]; bits != 0; bits &= bits - 1)
+                PPU_bg_cache_tile(nt, row, __builtin_ctz(bits), pt_i);
+            nes_ppu.PPU_bg_dirty[nt][row] = 0;
         }
+}
+
+/* Copy 'n' background pixels starting at pixel 'x' of a scanline that starts at v, fine x from the cache */
+static inline void PPU_bg_cache_pixels(uint8_t * dst, uint16_t v, uint8_t fine_x, uint16_t x, uint16_t n)
+{
+    uint16_t cy     = ((v >> 11) & 0x1) * 240 + ((v >> 2) & 0xF8) + (v >> 12),
+             cx     = ((((v >> 10) & 0x1) << 8 | (v & 0x1F) << 3) + fine_x + x) & 0x1FF,
+             run    = (512 - cx < n) ? 512 - cx : n;
+
+    /* Wrap around to the left nametable */
+    memcpy(dst, &nes_ppu.PPU_bg_cache[cy][cx], run);
+    memcpy(dst + run, &nes_ppu.PPU_bg_cache[cy][0], n - run);
+}
+
+/* Pixel row of the tile at v, fetched like the PPU would (no PPU state is touched) */
+static inline uint64_t PPU_bg_fetch_row(uint16_t v, uint8_t pt_i)
+{
+    const uint8_t * nametable = nes_ppu_bus.page[8 | ((v >> 10) & 0x3)];
+
+    uint8_t tile = nametable[v & 0x3FF],
+            attr = nametable[0x3C0 | ((v >> 4) & 0x38) | ((v >> 2) & 0x07)],
+            pal  = (attr >> (((v >> 4) & 0x4) | (v & 0x2))) & 0x3;
+
+    const uint8_t * pattern = PPU_pattern_tile(pt_i, tile) + (v >> 12);
+    return PPU_tile_row(pattern[0], pattern[8], pal);
+}
+
+/* The 256 background pixels of a scanline that starts at v, fine x, fetched like the PPU would */
+static inline void PPU_bg_fetch_pixels(uint8_t * dst, uint16_t v, uint8_t fine_x, uint8_t pt_i)
+{
+    uint8_t line[33 * 8];
+
+    for (uint8_t i = 0; i < 33; i++, v = PPU_next_tile_x(v))
+    {
+        uint64_t row = PPU_bg_fetch_row(v, pt_i);
+        memcpy(&line[i << 3], &row, sizeof(row));
     }
-    else if (nes_ppu.c >= 257 && nes_ppu.c <= 320)  /* Where the first two tiles for the next sprite scanline are stored */
+
+    memcpy(dst, &line[fine_x], 256);
+}
+
+/* 
+Mid-scanline changes
+
+Scanlines shown from the cache (or deferred) skip their fetches, so they would show a write 
+to v, VRAM, a CHR bank, the background pattern table or rendering on/off as if it had 
+happened before the scanline started. Before such a change, the tiles fetched up to then 
+are fetched into PPU_bg_line and the rest of the scanline is fetched as it runs, just like 
+a scanline that was never cached. A change while the first two tiles of the next scanline 
+are prefetched (or after) has the next scanline fetched a tile at a time from the start.
+*/
+static inline void PPU_bg_line_split()
+{
+    if (!nes_ppu.frame_render && !nes_ppu.frame_deferred)
+        return;
+
+    if (nes_ppu.c == 0 || nes_ppu.c > 320)
     {
-        
+        nes_ppu.PPU_bg_next_fetched = true;
+        return;
     }
-    else if (nes_ppu.c >= 321 && nes_ppu.c <= 336)  /* Where the first two tiles for the next scanline are stored */
+
+    if (nes_ppu.s >= 240 || nes_ppu.c > 257 || nes_ppu.PPU_bg_line_fetched)
+        return;
+
+    /* Tiles 2.. decoded by cycles 1 to c - 1, with rendering off nothing was (v didn't move either) */
+    uint8_t pt_i    = (nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4,
+            tiles   = (nes_ppu.c - 1) >> 3,
+            next    = (nes_ppu.c - 1) & 0x7;
+
+    if (nes_ppu.PPU_registers[PPUMASK] & 0x18)
     {
-        /* Check if we're in the first or second tile fetch */
-        uint8_t i = ((nes_ppu.c - 1) & 0xF) >> 3; 
-        
-        /* 
-        Fetch nametable address                 (0 = $2000; 1 = $2400; 2 = $2800; 3 = $2C00), 
-        and background pattern table address    (0: $0000; 1: $1000)
-        */
-        uint8_t nt_i = (nes_ppu.PPU_registers[PPUCTRL] & 0x03),
-                pt_i = (nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4;
+        uint16_t v = PPU_next_tile_x(PPU_next_tile_x(nes_ppu.PPU_line_vram_addr));
+        for (uint8_t i = 0; i < tiles; i++, v = PPU_next_tile_x(v))
+        {
+            uint64_t row = PPU_bg_fetch_row(v, pt_i);
+            memcpy(&nes_ppu.PPU_bg_line[16 + (i << 3)], &row, sizeof(row));
+        }
 
-        switch ((nes_ppu.c - 1) & 0x7)
+        /* The fetches of the tile under way that already happened */
+        if (next > 1)
+            current_tile.nt_byte = get_nametable_byte();
+        if (next > 3)
+            current_tile.at_byte = get_attrib_table_byte();
+        if (next > 5)
         {
-            case 1: nes_ppu.PPU_bg_u16_s[(i * 3) + 0] = get_nametable_byte(nt_i);    break; /* Fetch */
-            case 3: nes_ppu.PPU_bg_u16_s[(i * 3) + 1] = get_attrib_table_byte(0);    break; /* Fetch */
-            case 5: current_tile.t_row = (nes_ppu.v & 0x7);                     
-                    nes_ppu.PPU_bg_u16_s[(i * 3) + 2] = nes_ppu.PPU_Pattern_row[pt_i][(uint16_t)(((current_tile.nt_byte << 4) + current_tile.t_row) >> 1) & 0x1FF];
-                    break;                                                                  /* Get row index and lo byte for the tile */
-            case 7: nes_ppu.h += 8;
-                    break;                                                                  /* Get hi byte for the tile and render to screen */
+            current_tile.t_row = (nes_ppu.PPU_current_vram_addr >> 12);
+            current_tile.pt_lo = PPU_pattern_tile(pt_i, current_tile.nt_byte)[current_tile.t_row];
         }
     }
-    else if (nes_ppu.c >= 337 && nes_ppu.c <= 340)  /* Useless */
+    else
+        memset(&nes_ppu.PPU_bg_line[16], 0x00, tiles << 3);
+
+    nes_ppu.PPU_bg_line_fetched = true;
+    nes_ppu.PPU_bg_line_cached  = false;
+}
+
+/* Copy 'n' background pixels of the current scanline starting at pixel 'x', from the cache or the fetched tiles */
+static inline void PPU_bg_pixels(uint8_t * dst, uint16_t x, uint16_t n)
+{
+    if (!nes_ppu.PPU_bg_line_cached)
+        memcpy(dst, &nes_ppu.PPU_bg_line[nes_ppu.PPU_line_fine_x + x], n);
+    else
+        PPU_bg_cache_pixels(dst, nes_ppu.PPU_line_vram_addr, nes_ppu.PPU_line_fine_x, x, n);
+}
+
+/* 
+Sprite evaluation
+
+Instead of scanning all 64 OAM entries on each scanline, OAM indices are kept sorted 
+by Y. Since scanlines only move down, entries that ended above the current scanline 
+are skipped for the rest of the frame with a cursor, and the walk stops at the first 
+entry that starts below it. The sorted index is only rebuilt when a Y byte changes.
+*/
+
+/* Rebuild the Y-sorted OAM index (stable, so OAM order is kept within equal Y) */
+static inline void PPU_OAM_sort()
+{
+    for (uint8_t i = 0; i < 64; i++)
     {
-        if (nes_ppu.c == 340 && nes_ppu.pre_render_scanline_set)
+        uint8_t y = nes_ppu.PPU_OAM_Bytes[i << 2], j = i;
+        for (; j > 0 && nes_ppu.PPU_OAM_Bytes[nes_ppu.PPU_OAM_sorted[j - 1] << 2] > y; j--)
+            nes_ppu.PPU_OAM_sorted[j] = nes_ppu.PPU_OAM_sorted[j - 1];
+        nes_ppu.PPU_OAM_sorted[j] = i;
+    }
+
+    nes_ppu.PPU_OAM_cursor  = 0;
+    nes_ppu.PPU_OAM_dirty   = false;
+}
+
+/* Returns a bitmask (one bit per OAM entry) of every sprite that is in range of scanline 'line' */
+static inline uint64_t PPU_sprites_in_range(uint16_t line, uint8_t height)
+{
+    if (nes_ppu.PPU_OAM_dirty)
+        PPU_OAM_sort();
+
+    uint64_t in_range = 0;
+    for (uint8_t i = nes_ppu.PPU_OAM_cursor; i < 64; i++)
+    {
+        uint8_t idx = nes_ppu.PPU_OAM_sorted[i],
+                y   = nes_ppu.PPU_OAM_Bytes[idx << 2];
+
+        if (y > line)
+            break;
+        if (line - y < height)
+            in_range |= 1ull << idx;
+        else if (i == nes_ppu.PPU_OAM_cursor)
+            nes_ppu.PPU_OAM_cursor++;
+    }
+
+    return in_range;
+}
+
+/* 
+Fill secondary OAM with the first 8 sprites (in OAM order) that are on this scanline 
+
+Sprite overflow is only possible when the in-range mask has 8 or more bits. In that case
+the hardware keeps evaluating with its infamous bug: after each sprite that is out of
+range, both the sprite index (n) and the byte index (m) are incremented, so tile,
+attribute and X bytes end up being compared as Y coordinates. That walk is reproduced
+exactly, and the cycle it would set the flag on is scheduled (evaluation runs from cycle
+65, 2 cycles per entry read and 6 more for each sprite copied).
+*/
+static inline void PPU_sprite_eval()
+{
+    uint8_t height = (nes_ppu.PPU_registers[PPUCTRL] & 0x20) ? 16 : 8;
+    uint64_t in_range = PPU_sprites_in_range(nes_ppu.s, height);
+    uint8_t n = 0;
+
+    memset(nes_ppu.PPU_SecOAM_Bytes, 0xFF, sizeof(nes_ppu.PPU_SecOAM_Bytes));
+    nes_ppu.PPU_SecOAM_sprite0 = in_range & 0x1;
+
+    for (nes_ppu.PPU_SecOAM_count = 0; in_range != 0 && nes_ppu.PPU_SecOAM_count < 8; in_range &= in_range - 1)
+    {
+        n = __builtin_ctzll(in_range);
+        nes_ppu.PPU_SecOAM_Pixel[nes_ppu.PPU_SecOAM_count++] = nes_ppu.PPU_OAM_Pixel[n];
+    }
+
+    if (nes_ppu.PPU_SecOAM_count < 8)
+        return;
+
+    uint16_t cycle = 65 + (n + 1) * 2 + 8 * 6;
+    for (uint8_t m = 0, i = n + 1; i < 64 && cycle <= 256; i++, m = (m + 1) & 0x3, cycle += 2)
+    {
+        uint8_t y = nes_ppu.PPU_OAM_Bytes[(i << 2) + m];
+        if (y <= nes_ppu.s && nes_ppu.s - y < height)
         {
-            nes_ppu.s = 0;
-            nes_ppu.pre_render_scanline_set = false;
+            nes_ppu.PPU_overflow_c = cycle;
+            return;
         }
-        else
+    }
+}
+
+/* Reverse the bits of a pattern byte (horizontal flip) */
+static inline uint8_t PPU_flip_byte(uint8_t b)
+{
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+}
+
+/* Fetch the pattern row of sprite 'i' in secondary OAM into the sprite shift registers */
+static inline void PPU_sprite_fetch(uint8_t i)
+{
+    if (i >= nes_ppu.PPU_fg_count)
+    {
+        nes_ppu.PPU_fg_s[0][i] = nes_ppu.PPU_fg_s[1][i] = 0x00;
+        return;
+    }
+
+    uint8_t height  = (nes_ppu.PPU_registers[PPUCTRL] & 0x20) ? 16 : 8,
+            y       = nes_ppu.PPU_SecOAM_Bytes[(i << 2) + 0],
+            tile    = nes_ppu.PPU_SecOAM_Bytes[(i << 2) + 1],
+            attrib  = nes_ppu.PPU_SecOAM_Bytes[(i << 2) + 2],
+            row     = nes_ppu.s - y,
+            pt_i    = (nes_ppu.PPU_registers[PPUCTRL] & 0x08) >> 3;
+
+    /* Vertical flip */
+    if (attrib & 0x80)
+        row = height - 1 - row;
+
+    /* 8x16 sprites take the pattern table from bit 0 of the tile number */
+    if (height == 16)
+    {
+        pt_i    = tile & 0x1;
+        tile    = (tile & 0xFE) + (row >> 3);
+        row    &= 0x7;
+    }
+
+    uint8_t lo = PPU_pattern_tile(pt_i, tile)[row],
+            hi = PPU_pattern_tile(pt_i, tile)[8 + row];
+
+    /* Horizontal flip */
+    if (attrib & 0x40)
+    {
+        lo = PPU_flip_byte(lo);
+        hi = PPU_flip_byte(hi);
+    }
+
+    nes_ppu.PPU_fg_s[0][i]      = lo;
+    nes_ppu.PPU_fg_s[1][i]      = hi;
+    nes_ppu.PPU_fg_attrib_l[i]  = attrib;
+    nes_ppu.PPU_fg_hpos_c[i]    = nes_ppu.PPU_SecOAM_Bytes[(i << 2) + 3];
+}
+
+/* Opaque bits (bit 7 = leftmost) of the 8 background pixels starting at pixel 'x' of the current scanline */
+static inline uint8_t PPU_bg_opaque_bits(uint8_t x)
+{
+    uint8_t bits = 0;
+
+    if (nes_ppu.PPU_bg_line_cached)
+    {
+        uint8_t px[8];
+        PPU_bg_pixels(px, x, 8);
+        for (uint8_t i = 0; i < 8; i++)
+            bits |= (uint8_t)((px[i] & 0x3) != 0) << (7 - i);
+        return bits;
+    }
+
+    /* The scanline isn't fetched yet, get the 2 tiles under the sprite from where v will be */
+    uint16_t v      = nes_ppu.PPU_line_vram_addr,
+             pos    = nes_ppu.PPU_line_fine_x + x,
+             row    = 0;
+    uint8_t  pt_i   = (nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4;
+
+    for (uint8_t i = 0; i < 2; i++)
+    {
+        uint16_t col    = (v & 0x1F) + (pos >> 3) + i;
+        uint8_t  nt     = ((v >> 10) & 0x3) ^ ((col >> 5) & 0x1),
+                 tile   = nes_ppu_bus.page[8 | nt][(v & 0x3E0) | (col & 0x1F)];
+
+        const uint8_t * pattern = PPU_pattern_tile(pt_i, tile) + (v >> 12);
+        row |= (uint16_t)(pattern[0] | pattern[8]) << (8 - (i << 3));
+    }
+
+    return (uint8_t)((row << (pos & 0x7)) >> 8);
+}
+
+/* 
+Sprite 0 hit for the current scanline, the 8 pixel opaque masks of sprite 0 and the 
+background under it are ANDed, the leftmost common bit is the exact pixel of the hit. 
+The flag is then set when the PPU gets to that cycle.
+*/
+static inline void PPU_sprite0_hit_schedule()
+{
+    uint8_t mask = nes_ppu.PPU_registers[PPUMASK];
+
+    if (!nes_ppu.PPU_fg_sprite0 || (mask & 0x18) != 0x18 || (nes_ppu.PPU_registers[PPUSTATUS] & 0x40))
+        return;
+
+    uint8_t x    = nes_ppu.PPU_fg_hpos_c[0],
+            hit  = (nes_ppu.PPU_fg_s[0][0] | nes_ppu.PPU_fg_s[1][0]) & PPU_bg_opaque_bits(x);
+
+    /* Hidden left column never hits, and neither does pixel 255 */
+    if ((mask & 0x06) != 0x06 && x < 8)
+        hit &= (1 << x) - 1;
+    if (x >= 248)
+        hit &= ~(1 << (x - 248));
+
+    if (hit)
+        nes_ppu.PPU_sprite0_hit_c = x + (__builtin_clz(hit) - 24) + 1;
+}
+
+/* 
+Merge up to 8 sprite rows into the sprite line. Sprites are drawn from the last to the 
+first, so the opaque pixel of the sprite with the lowest OAM index wins (including its 
+priority bit, like the real thing). Each row is 8 pixels handled as one 64-bit mask op.
+
+The sprite line and its priority mask are 256 + 8 bytes, the extra bytes catch sprites at X > 248.
+*/
+static inline void PPU_merge_sprites(const _PPU_line_state * st, uint8_t * fg_line, uint8_t * fg_prio_line)
+{
+    memset(fg_line,      0x00, 256 + 8);
+    memset(fg_prio_line, 0x00, 256 + 8);
+
+    for (int8_t i = st->fg_count - 1; i >= 0; i--)
+    {
+        uint8_t  attrib = st->fg_attrib[i],
+                 x      = st->fg_hpos[i];
+        uint64_t pix    = PPU_bitplane_lut[st->fg_s[0][i]] | (PPU_bitplane_lut[st->fg_s[1][i]] << 1),
+                 opaque = ((pix | (pix >> 1)) & 0x0101010101010101ull) * 0xFF,
+                 color  = pix | ((uint64_t)(0x10 | ((attrib & 0x3) << 2)) * 0x0101010101010101ull),
+                 prio   = (attrib & 0x20) ? opaque : 0,
+                 fg, fg_prio;
+
+        memcpy(&fg,      &fg_line[x],      sizeof(fg));
+        memcpy(&fg_prio, &fg_prio_line[x], sizeof(fg_prio));
+
+        fg      = (fg & ~opaque) | (color & opaque);
+        fg_prio = (fg_prio & ~opaque) | prio;
+
+        memcpy(&fg_line[x],      &fg,      sizeof(fg));
+        memcpy(&fg_prio_line[x], &fg_prio, sizeof(fg_prio));
+    }
+}
+
+/* 
+Composite background and sprite lines into palette RAM indices:
+
+    sprite pixel wins if it is opaque and (it is in front, or the background pixel is transparent)
+
+Done with SSE2 masks, 16 pixels at a time
+*/
+static inline void PPU_composite_line(const uint8_t * bg, const uint8_t * fg, const uint8_t * prio, uint8_t * out)
+{
+#if defined(__SSE2__)
+    const __m128i zero  = _mm_setzero_si128(),
+                  three = _mm_set1_epi8(0x3);
+
+    for (size_t x = 0; x < 256; x += 16)
+    {
+        __m128i b = _mm_loadu_si128((const __m128i *)&bg[x]),
+                f = _mm_loadu_si128((const __m128i *)&fg[x]),
+                p = _mm_loadu_si128((const __m128i *)&prio[x]);
+
+        __m128i bg_clear = _mm_cmpeq_epi8(_mm_and_si128(b, three), zero),   /* Transparent background */
+                fg_clear = _mm_cmpeq_epi8(f, zero),                         /* Transparent sprite */
+                use_fg   = _mm_andnot_si128(fg_clear, _mm_or_si128(_mm_andnot_si128(p, _mm_set1_epi8(-1)), bg_clear));
+
+        _mm_storeu_si128((__m128i *)&out[x], _mm_or_si128(_mm_and_si128(use_fg, f), _mm_andnot_si128(use_fg, b)));
+    }
+#else
+    for (size_t x = 0; x < 256; x++)
+    {
+        uint8_t use_fg = (fg[x] != 0) & (!prio[x] | !(bg[x] & 0x3));
+        out[x] = use_fg ? fg[x] : bg[x];
+    }
+#endif
+}
+
+/* Capture what the current scanline is composited from */
+static inline void PPU_line_capture(_PPU_line_state * st)
+{
+    st->vram_addr   = nes_ppu.PPU_line_vram_addr;
+    st->fine_x      = nes_ppu.PPU_line_fine_x;
+    st->ctrl        = nes_ppu.PPU_registers[PPUCTRL];
+    st->mask        = nes_ppu.PPU_registers[PPUMASK];
+    memcpy(st->palette, nes_ppu.PPU_Pallete_Data[0], sizeof(st->palette));
+
+    st->fg_count    = nes_ppu.PPU_fg_count;
+    memcpy(st->fg_s,      nes_ppu.PPU_fg_s,        sizeof(st->fg_s));
+    memcpy(st->fg_attrib, nes_ppu.PPU_fg_attrib_l, sizeof(st->fg_attrib));
+    memcpy(st->fg_hpos,   nes_ppu.PPU_fg_hpos_c,   sizeof(st->fg_hpos));
+}
+
+/* 
+Composite scanline 'y' from its state and background pixels, and plot it. Only touches 
+its own row of the screen buffer, so scanlines can be rendered from any thread.
+*/
+static inline void PPU_render_line(const _PPU_line_state * st, uint8_t * bg, uint16_t y)
+{
+    uint8_t mask = st->mask;
+    uint8_t fg[256 + 8], fg_prio[256 + 8], line[256];
+    uint32_t decoded_pixels[256];
+
+    /* Background, optionally hidden in the leftmost 8 pixels */
+    if (!(mask & 0x08))
+        memset(bg, 0x00, 256);
+    if (!(mask & 0x02))
+        memset(bg, 0x00, 8);
+
+    /* Sprites, same deal */
+    if (mask & 0x10)
+    {
+        PPU_merge_sprites(st, fg, fg_prio);
+        if (!(mask & 0x04))
+            memset(fg, 0x00, 8);
+    }
+    else
+    {
+        memset(fg, 0x00, 256);
+        memset(fg_prio, 0x00, 256);
+    }
+
+    PPU_composite_line(bg, fg, fg_prio, line);
+
+    /* Palette lookup, greyscale only keeps the column of grays */
+    uint8_t grey = (mask & 0x01) ? 0x30 : 0x3F;
+    for (size_t x = 0; x < 256; x++)
+        decoded_pixels[x] = NES_palette[st->palette[line[x]] & grey];
+
+    for (size_t x = 0; x < 256; x += 8)
+        PPU_plot_row(x + 1, y, &decoded_pixels[x]);
+}
+
+/* Composite the current scanline and plot it */
+static inline void PPU_render_scanline()
+{
+    _PPU_line_state st;
+    uint8_t bg[256];
+
+    PPU_line_capture(&st);
+    if (st.mask & 0x08)
+        PPU_bg_pixels(bg, 0, 256);
+
+    PPU_render_line(&st, bg, nes_ppu.s);
+}
+
+/* 
+Deferred rendering (optional, see PPU_set_deferred())
+
+The frame runs without generating any pixels: at cycle 257 of each visible scanline 
+the state it is composited from is captured (v, fine x, PPUCTRL, PPUMASK, palette RAM 
+and the sprite rows fetched from OAM), and every nametable/pattern table write or 
+CHR bank switch is logged with the first scanline that sees it. Once the last visible 
+scanline is done, the log is undone, then replayed in between stretches of scanlines 
+that all see the same VRAM. Each stretch is rendered in parallel by a pool of threads, 
+a scanline at a time, from the background cache or its own fetches. A scanline with a 
+mid-scanline change (see PPU_bg_line_split()) is fetched as it runs instead, and keeps 
+its background pixels with its state.
+
+The background comes out the same as rendering as the frame runs. Like it, everything 
+else (palette, PPUMASK, sprites) is taken as it was at cycle 257 of the scanline, not at 
+the pixel they show up on.
+*/
+#define PPU_RENDER_THREADS_MAX  15
+
+typedef struct _PPU_render_pool
+{
+    int             threads;
+    SDL_Thread      * thread[PPU_RENDER_THREADS_MAX];
+    SDL_sem         * start,                    /* Posted once for each thread that should help */
+                    * done;                     /* Posted by a thread when it ran out of scanlines */
+
+    atomic_int      next;                       /* Next scanline to render */
+    int             end;                        /* Last scanline + 1 */
+    atomic_bool     stop;
+}
+_PPU_render_pool;
+_PPU_render_pool PPU_render_pool;
+
+/* Background pixels of a deferred scanline, as fetched while it ran or from VRAM as it was at its cycle 257 */
+static inline void PPU_deferred_bg(const _PPU_line_state * st, uint8_t * bg)
+{
+    uint8_t pt_i = (st->ctrl & 0x10) >> 4;
+
+    if (st->bg_fetched)
+        memcpy(bg, st->bg, 256);
+    else if (pt_i == nes_ppu.PPU_bg_cache_pt && ((st->vram_addr >> 5) & 0x1F) < 30)
+        PPU_bg_cache_pixels(bg, st->vram_addr, st->fine_x, 0, 256);
+    else
+        PPU_bg_fetch_pixels(bg, st->vram_addr, st->fine_x, pt_i);
+}
+
+/* Render deferred scanlines until there are none left */
+static inline void PPU_render_lines()
+{
+    for (int y; (y = atomic_fetch_add(&PPU_render_pool.next, 1)) < PPU_render_pool.end; )
+    {
+        const _PPU_line_state * st = &nes_ppu.PPU_line_state[y];
+        uint8_t bg[256];
+
+        if (st->mask & 0x08)
+            PPU_deferred_bg(st, bg);
+        PPU_render_line(st, bg, y);
+    }
+}
+
+static int PPU_render_worker(void * arg)
+{
+    for (;;)
+    {
+        SDL_SemWait(PPU_render_pool.start);
+        if (atomic_load(&PPU_render_pool.stop))
+            return 0;
+
+        PPU_render_lines();
+        SDL_SemPost(PPU_render_pool.done);
+    }
+}
+
+/* Render deferred scanlines 'first' to 'last' - 1 on every thread of the pool, this one included */
+static inline void PPU_render_stretch(int first, int last)
+{
+    int helpers = (last - first - 1 < PPU_render_pool.threads) ? last - first - 1 : PPU_render_pool.threads;
+
+    atomic_store(&PPU_render_pool.next, first);
+    PPU_render_pool.end = last;
+
+    for (int i = 0; i < helpers; i++)
+        SDL_SemPost(PPU_render_pool.start);
+
+    PPU_render_lines();
+
+    for (int i = 0; i < helpers; i++)
+        SDL_SemWait(PPU_render_pool.done);
+}
+
+/* Undo or redo a logged VRAM change, marking what it touched in the background cache */
+static inline void PPU_vram_log_apply(const _PPU_vram_change * e, bool redo)
+{
+    if (e->offset == PPU_VRAM_LOG_REMAP)
+    {
+        PPU_map_page(e->page, redo ? e->to : e->from);
+        return;
+    }
+
+    uint8_t * page = nes_ppu_bus.page[e->page];
+    page[e->offset] = redo ? e->after : e->before;
+
+    if (e->page < 8)
+        PPU_bg_cache_chr_write(((uint16_t)e->page << 10) | e->offset);
+    else
+        PPU_bg_cache_nt_write(page, e->offset);
+}
+
+/* Render the deferred frame, called once the last visible scanline is done (nothing is logged from here on) */
+static inline void PPU_render_deferred()
+{
+    const _PPU_vram_change * log = nes_ppu.PPU_vram_log;
+    size_t n = nes_ppu.PPU_vram_log_full ? 0 : nes_ppu.PPU_vram_log_count, i = 0;
+
+    /* Back to VRAM as it was when the frame started */
+    for (size_t j = n; j-- > 0; )
+        PPU_vram_log_apply(&log[j], false);
+
+    for (int first = 0; first < 240; )
+    {
+        for (; i < n && log[i].line <= first; i++)
+            PPU_vram_log_apply(&log[i], true);
+
+        int last = (i < n && log[i].line < 240) ? log[i].line : 240;
+
+        PPU_bg_cache_update((nes_ppu.PPU_line_state[first].ctrl & 0x10) >> 4);
+        PPU_render_stretch(first, last);
+        first = last;
+    }
+
+    for (; i < n; i++)
+        PPU_vram_log_apply(&log[i], true);
+
+    nes_ppu.PPU_vram_log_count  = 0;
+    nes_ppu.PPU_vram_log_full   = false;
+}
+
+/* Stop the render threads */
+static inline void PPU_render_pool_stop()
+{
+    atomic_store(&PPU_render_pool.stop, true);
+    for (int i = 0; i < PPU_render_pool.threads; i++)
+        SDL_SemPost(PPU_render_pool.start);
+    for (int i = 0; i < PPU_render_pool.threads; i++)
+        SDL_WaitThread(PPU_render_pool.thread[i], NULL);
+
+    if (PPU_render_pool.start != NULL)
+        SDL_DestroySemaphore(PPU_render_pool.start);
+    if (PPU_render_pool.done != NULL)
+        SDL_DestroySemaphore(PPU_render_pool.done);
+
+    PPU_render_pool = (_PPU_render_pool){0};
+}
+
+/* 
+Render frames after their last visible scanline, on 'threads' threads besides the one 
+running the PPU (-1 = one less than there are cores). Takes effect on the next frame.
+*/
+static inline void PPU_set_deferred(bool on, int threads)
+{
+    PPU_render_pool_stop();
+    nes_ppu.deferred = on;
+
+    if (!on)
+        return;
+
+    if (threads < 0)
+        threads = SDL_GetCPUCount() - 1;
+    if (threads > PPU_RENDER_THREADS_MAX)
+        threads = PPU_RENDER_THREADS_MAX;
+    if (threads <= 0)
+        return;
+
+    PPU_render_pool.start   = SDL_CreateSemaphore(0);
+    PPU_render_pool.done    = SDL_CreateSemaphore(0);
+    if (PPU_render_pool.start == NULL || PPU_render_pool.done == NULL)
+    {
+        fprintf(stderr, "error: Failed to create the render threads: %s. Rendering on one thread.\n", SDL_GetError());
+        PPU_render_pool_stop();
+        return;
+    }
+
+    for (; PPU_render_pool.threads < threads; PPU_render_pool.threads++)
+    {
+        SDL_Thread * t = SDL_CreateThread(PPU_render_worker, "PPU render", NULL);
+        if (t == NULL)
         {
-            nes_ppu.s += (nes_ppu.c == 340) ? 1 : 0;
+            fprintf(stderr, "error: Failed to start a render thread: %s.\n", SDL_GetError());
+            break;
         }
-    } 
-    else
+        PPU_render_pool.thread[PPU_render_pool.threads] = t;
+    }
+}
+
+/* Called at the start of every v-blank, by whichever thread runs the PPU (see nes_ppu_debug.h) */
+void (*PPU_frame_end_hook)(void);
+
+/* 
+Each tick of the PPU (1 cycle's worth of data here) 
+
+Relevant sources:
+https://wiki.nesdev.com/w/index.php/PPU_rendering#Frame_timing_diagram
+https://wiki.nesdev.com/w/images/d/d1/Ntsc_timing.png
+
+Background tiles are decoded into PPU_bg_line as they are fetched, the first two tiles 
+of a scanline come from the prefetch at the end of the previous one. Scanlines the 
+background cache can show skip the fetches, only the prefetch is kept so a scanline 
+after a raster effect (or changed halfway, see PPU_bg_line_split()) can still be fetched. 
+v is updated like the real thing either way, even on frames that aren't rendered 
+(see PPU_set_frame_skip()).
+At cycle 257 the finished scanline is composited with the sprites fetched during the 
+previous scanline (deferred frames only capture its state, see PPU_render_deferred()), 
+then sprites for the next one are evaluated and fetched.
+*/
+static inline void PPU_tick()
+{
+    bool rendering = (nes_ppu.PPU_registers[PPUMASK] & 0x18) != 0;
+
+    /* Clear v-blank flag */
+    if (nes_ppu.clear_vblank == true)
     {
-        // Every 8th cycle, the horizontal index is updated
-        if (nes_ppu.pre_render_scanline_set == false && nes_ppu.s < 240)
+        nes_ppu.PPU_registers[PPUSTATUS] &= 0x7F;
+        nes_ppu.clear_vblank = false;
+    }
+
+    if (nes_ppu.s < 240 || nes_ppu.s == 261)        /* Visible and pre-render scanlines */
+    {
+        /* Pre-render scanline clears v-blank, sprite 0 hit and overflow */
+        if (nes_ppu.s == 261 && nes_ppu.c == 1)
+            nes_ppu.PPU_registers[PPUSTATUS] &= 0x1F;
+
+        if (nes_ppu.c == 0)                             /* Idle cycle, schedule this scanline's status changes */
+        {
+            /* Decide if the upcoming frame gets rendered (frame is incremented on the first scanline) */
+            if (nes_ppu.s == 261)
+            {
+                bool render                 = nes_ppu.render_requested 
+                                            || (nes_ppu.render_every && (nes_ppu.frame + 1) % nes_ppu.render_every == 0);
+
+                nes_ppu.frame_render        = render && !nes_ppu.deferred;
+                nes_ppu.frame_deferred      = render && nes_ppu.deferred;
+                nes_ppu.render_requested    = false;
+                nes_ppu.PPU_vram_log_count  = 0;
+                nes_ppu.PPU_vram_log_full   = false;
+            }
+
+            /* Everything written since the last rendered frame goes into the background cache */
+            if (nes_ppu.s == 0 && nes_ppu.frame_render)
+            {
+                PPU_bg_cache_update((nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4);
+                nes_ppu.PPU_bg_cache_on = true;
+            }
+
+            if (nes_ppu.s != 261)
+            {
+                nes_ppu.PPU_line_fine_x     = nes_ppu.PPU_fine_x;
+                nes_ppu.PPU_bg_line_cached  = nes_ppu.frame_render
+                                            && nes_ppu.PPU_bg_cache_on
+                                            && ((nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4) == nes_ppu.PPU_bg_cache_pt
+                                            && ((nes_ppu.PPU_line_vram_addr >> 5) & 0x1F) < 30
+                                            && !nes_ppu.PPU_bg_next_fetched;
+                nes_ppu.PPU_bg_line_fetched = (nes_ppu.frame_render && !nes_ppu.PPU_bg_line_cached)
+                                            || (nes_ppu.frame_deferred && nes_ppu.PPU_bg_next_fetched);
+            }
+            nes_ppu.PPU_bg_next_fetched = false;
+
+            if (rendering && nes_ppu.s != 261)
+            {
+                PPU_sprite0_hit_schedule();
+                PPU_sprite_eval();
+            }
+            else
+            {
+                /* Evaluation doesn't happen on the pre-render scanline, so no sprites on the first one */
+                nes_ppu.PPU_SecOAM_count    = 0;
+                nes_ppu.PPU_SecOAM_sprite0  = false;
+            }
+        }
+        else if (nes_ppu.c <= 256)                      /* Tiles 2..33 of the scanline are fetched here */
+        {
+            /* Scheduled PPUSTATUS changes */
+            if (nes_ppu.c == nes_ppu.PPU_sprite0_hit_c)
+                nes_ppu.PPU_registers[PPUSTATUS] |= 0x40;
+            if (nes_ppu.c == nes_ppu.PPU_overflow_c)
+                nes_ppu.PPU_registers[PPUSTATUS] |= 0x20;
+
+            if (rendering)
+            {
+                if (nes_ppu.PPU_bg_line_fetched && nes_ppu.s != 261)
+                {
+                    nes_ppu.h = ((nes_ppu.c - 1) & 0xF8) + 16;
+                    PPU_bg_fetch();
+                }
+                else if (((nes_ppu.c - 1) & 0x7) == 7)
+                    PPU_increment_x();
+
+                if (nes_ppu.c == 256)
+                    PPU_increment_y();
+            }
+            else if (nes_ppu.PPU_bg_line_fetched && nes_ppu.s != 261 && ((nes_ppu.c - 1) & 0x7) == 7)
+                memset(&nes_ppu.PPU_bg_line[((nes_ppu.c - 1) & 0xF8) + 16], 0x00, 8);     /* Nothing fetched */
+        }
+        else if (nes_ppu.c <= 320)                      /* Sprites for the next scanline are evaluated and fetched */
+        {
+            if (nes_ppu.c == 257)
+            {
+                if (nes_ppu.s != 261 && nes_ppu.frame_render)
+                    PPU_render_scanline();
+                else if (nes_ppu.s != 261 && nes_ppu.frame_deferred)
+                {
+                    _PPU_line_state * st = &nes_ppu.PPU_line_state[nes_ppu.s];
+
+                    PPU_line_capture(st);
+                    st->bg_fetched = nes_ppu.PPU_bg_line_fetched;
+                    if (st->bg_fetched)
+                        memcpy(st->bg, &nes_ppu.PPU_bg_line[nes_ppu.PPU_line_fine_x], 256);
+                }
+
+                /* Horizontal position goes back to the left edge */
+                if (rendering)
+                    nes_ppu.PPU_current_vram_addr = (nes_ppu.PPU_current_vram_addr & ~0x041F) | (nes_ppu.PPU_temp_vram_addr & 0x041F);
+
+                nes_ppu.PPU_fg_count    = rendering ? nes_ppu.PPU_SecOAM_count : 0;
+                nes_ppu.PPU_fg_sprite0  = rendering && nes_ppu.PPU_SecOAM_sprite0;
+            }
+
+            /* Vertical position is reloaded for the first scanline */
+            if (rendering && nes_ppu.s == 261 && nes_ppu.c >= 280 && nes_ppu.c <= 304)
+                nes_ppu.PPU_current_vram_addr = (nes_ppu.PPU_current_vram_addr & ~0x7BE0) | (nes_ppu.PPU_temp_vram_addr & 0x7BE0);
+
+            if (rendering && ((nes_ppu.c - 257) & 0x7) == 7)
+                PPU_sprite_fetch((nes_ppu.c - 257) >> 3);
+        }
+        else if (nes_ppu.c <= 336)                      /* Where the first two tiles for the next scanline are stored */
         {
-            /* Fetch nametable address (0 = $2000; 1 = $2400; 2 = $2800; 3 = $2C00) */
-            uint8_t nt_i = (nes_ppu.PPU_registers[PPUCTRL] & 0x3),
-                    pt_i = (nes_ppu.PPU_registers[PPUCTRL] & 0x10) >> 4;
+            /* This is where the next scanline starts, even if v was written after the copy at cycle 257 */
+            if (rendering && nes_ppu.c == 321)
+                nes_ppu.PPU_line_vram_addr = nes_ppu.PPU_current_vram_addr;
+
+            /* Deferred frames prefetch too, in case the next scanline has to be fetched */
+            bool fetch = nes_ppu.frame_render || nes_ppu.frame_deferred;
 
-            switch ((nes_ppu.c - 1) & 0x7)
+            if (rendering && fetch)
             {
-                case 1: current_tile.nt_byte = get_nametable_byte(nt_i);    break;  /* Fetch */
-                case 3: current_tile.at_byte = get_attrib_table_byte(0);    break;  /* Fetch */
-                case 5: current_tile.t_row = (nes_ppu.v & 0x7);                     
-                        current_tile.pt_lo = nes_ppu.PPU_Pattern_bytes[pt_i][(uint16_t)((current_tile.nt_byte << 4) + current_tile.t_row)];
-                        break;                                                      /* Get row index and lo byte for the tile */
-                case 7: current_tile.pt_hi = nes_ppu.PPU_Pattern_bytes[pt_i][(uint16_t)((current_tile.nt_byte << 4) + 8 + current_tile.t_row)];
-                        current_tile.row = conv_to_pix_row(current_tile.pt_lo, current_tile.pt_hi);
-                        decode_pixel_row(current_tile.at_byte);
-                        nes_ppu.h += 8;
-                        break;                                                      /* Get hi byte for the tile and render to screen */
+                nes_ppu.h = (nes_ppu.c - 321) & 0xF8;
+                PPU_bg_fetch();
             }
+            else if (rendering && ((nes_ppu.c - 1) & 0x7) == 7)
+                PPU_increment_x();
+            else if (fetch && ((nes_ppu.c - 1) & 0x7) == 7)
+                memset(&nes_ppu.PPU_bg_line[(nes_ppu.c - 321) & 0xF8], 0x00, 8);
         }
     }
-    nes_ppu.c++;
+    else if (nes_ppu.s == 241 && nes_ppu.c == 1)    /* V-Blank starts */
+    {
+        nes_ppu.PPU_registers[PPUSTATUS] |= 0x80; 
 
-    /* 
-    This line of code is weird but basically converting the PPU clock (~5.3693181825 MHz) to msec 
-    reveals that, at the 537'th cycle, the number of elapsed msec is approximately 1 (~1.000126984 
-    msec to be precise). Check if we are at that precious waiting period, then wait.
-    */
-    if ((nes_ppu.s * nes_ppu.c) == 537)
+        if (nes_ppu.PPU_registers[PPUCTRL] & 0x80)
+            nes_cpu_bus.NMI = true;
+    }
+
+    /* Next cycle, 341 cycles per scanline and 262 scanlines per frame */
+    if (++nes_ppu.c > 340)
+    {
+        nes_ppu.c = 0;
+        nes_ppu.PPU_sprite0_hit_c = nes_ppu.PPU_overflow_c = 0;
+
+        if (++nes_ppu.s > 261)
+        {
+            nes_ppu.s = 0;
+            nes_ppu.frame++;
+
+            /* Sprite index cursor starts over every frame */
+            nes_ppu.PPU_OAM_cursor = 0;
+        }
+        else if (nes_ppu.s == 240)
+        {
+            if (nes_ppu.frame_deferred)
+                PPU_render_deferred();
+
+            if (PPU_frame_end_hook != NULL)
+                PPU_frame_end_hook();
+
+            nes_ppu.frame_complete |= nes_ppu.frame_render || nes_ppu.frame_deferred;
+            nes_ppu.frame_end       = true;
+        }
+    }
+}
+
+/* 
+PPU cycles until a change to the PPUSTATUS 'bits' becomes visible:
+
+    v-blank             set at the start of v-blank, cleared on the pre-render scanline
+    sprite 0 hit        scheduled on this scanline, or on the next scanline sprite 0 is on
+    sprite overflow     scheduled on this scanline, or on the next scanline (could be any)
+*/
+static inline uint32_t PPU_cycles_to_status_change(uint8_t bits)
+{
+    const uint32_t frame_len = 262 * 341;
+    uint32_t now  = nes_ppu.s * 341 + nes_ppu.c,
+             next = frame_len;
+
+    bool     rendering  = (nes_ppu.PPU_registers[PPUMASK] & 0x18) != 0;
+    uint16_t s0_line    = nes_ppu.PPU_OAM_Bytes[0] + 1,
+             next_line  = (nes_ppu.s + 1) % 262;
+
+    /* Sprite 0 can only be scheduled on a scanline it is on */
+    if (next_line < s0_line)
+        next_line = s0_line;
+    if (next_line >= s0_line + ((nes_ppu.PPU_registers[PPUCTRL] & 0x20) ? 16 : 8) || next_line >= 240)
+        next_line = 261;
+
+    uint32_t events[6] = {
+        (bits & 0xE0) ? 261 * 341 + 1 : now,
+        (bits & 0x80) ? 241 * 341 + 1 : now,
+        (bits & 0x40) && nes_ppu.PPU_sprite0_hit_c ? nes_ppu.s * 341 + nes_ppu.PPU_sprite0_hit_c : now,
+        (bits & 0x40) && rendering && next_line != 261 ? next_line * 341 : now,
+        (bits & 0x20) && nes_ppu.PPU_overflow_c ? nes_ppu.s * 341 + nes_ppu.PPU_overflow_c : now,
+        (bits & 0x20) && rendering && (nes_ppu.s < 239 || nes_ppu.s == 261) ? ((nes_ppu.s + 1) % 262) * 341 : now
+    };
+
+    for (size_t i = 0; i < 6; i++)
     {
-        //wait(1);
+        uint32_t d = (events[i] + frame_len - now) % frame_len;
+        if (d != 0 && d < next)
+            next = d;
     }
+
+    /* The change is made during the tick at that cycle, so one more */
+    return next + 1;
+}
+
+/* PPU cycles until the PPU has to catch up by itself: the last visible scanline is done, or the v-blank NMI */
+static inline uint32_t PPU_cycles_to_sync()
+{
+    const uint32_t frame_len = 262 * 341;
+    uint32_t now        = nes_ppu.s * 341 + nes_ppu.c,
+             frame_end  = (240 * 341 + frame_len - now) % frame_len,
+             vblank     = (241 * 341 + 2 + frame_len - now) % frame_len;
+
+    if (frame_end == 0)
+        frame_end = frame_len;
+    if (vblank == 0)
+        vblank = frame_len;
+
+    return (frame_end < vblank) ? frame_end : vblank;
+}
+
+/*
+PPU A12 on a rendering scanline (what the MMC3 counts scanlines with)
+
+Fetches come in 8 dot slots starting at dot 1: background tiles at 1-249, sprites at 257-313
+and the next scanline's first two tiles at 321 and 329. Only pattern fetches can put A12 up,
+it is up from the 4th dot of the slot to its end if the pattern table is the one at $1000.
+Cartridges only count a rise after A12 was down for PPU_A12_FILTER dots, which leaves out
+the short gaps between fetches from the same pattern table.
+*/
+#define PPU_A12_FILTER          9
+#define PPU_A12_EDGES_MAX       21              /* Every other slot, at most */
+#define PPU_A12_LOW_LONG        PPU_A12_FILTER  /* A12 has been down long enough for the next rise to count */
+
+/*
+Dots of the rising edges of A12 between dots 'from' and 'to' of a rendering scanline, with the
+background from pattern table 'bg' and sprite slot i from the table at bit i of 'spr'. 'low'
+is how many dots A12 has been down for at 'from' (up to PPU_A12_LOW_LONG), it is updated for
+'to'. Returns the number of edges.
+*/
+static inline uint8_t PPU_a12_edges(uint8_t bg, uint8_t spr, uint16_t from, uint16_t to, uint16_t * low, uint16_t * dots)
+{
+    int32_t last = (int32_t)from - 1 - *low;    /* Last dot A12 was up */
+    uint8_t n    = 0;
+
+    for (uint16_t slot = 1; slot <= 329; slot += 8)
+    {
+        bool     up     = (slot >= 257 && slot < 321) ? (spr >> ((slot - 257) >> 3)) & 0x1 : bg;
+        uint16_t rise   = (slot + 3 < from) ? from : slot + 3;      /* Settings can change halfway through a fetch */
+
+        if (!up || slot + 7 < from || rise >= to)
+            continue;
+
+        if (rise - last - 1 >= PPU_A12_FILTER)
+            dots[n++] = rise;
+        last = slot + 7;
+    }
+
+    int32_t down = (int32_t)to - 1 - last;
+    *low = (down < 0) ? 0 : (down < PPU_A12_LOW_LONG) ? down : PPU_A12_LOW_LONG;
+    return n;
 }
 
 /* Plot pixel (unused) */
@@ -737,7 +2009,7 @@ static inline void PPU_plot_row(uint16_t x, uint16_t y, uint32_t * data)
 {
     x %= 340;
     y %= 260;
-    memcpy((void *)&nes_ppu.screen_buffer[(y * 360) + x], (void *)data, 8*sizeof(uint32_t));
+    memcpy((void *)&nes_ppu.screen_buffer[(y * 340) + x], (void *)data, 8*sizeof(uint32_t));
 }
 
 /* Horizontal (row) fill (unused)  */
@@ -0,0 +1,285 @@
+#pragma once
+
+/*
+    nes_ppu_debug.h: Debug viewers for the PPU (pattern tables, nametables, OAM, palettes)
+
+    The PPU only copies its memory into a snapshot at the end of a frame (every Nth frame,
+    and only if the viewer is done with the last one), everything else happens on the
+    viewer's own thread. The result goes to a second window and/or BMP files.
+*/
+
+#include <stdatomic.h>
+#include <SDL2/SDL.h>
+
+#include "interface.h"
+#include "nes_ppu.h"
+
+/* Layout of the debug view */
+#define PPU_DEBUG_WIDTH     768
+#define PPU_DEBUG_HEIGHT    480
+
+#define PPU_DEBUG_NT_X      0               /* Nametables, in their 2x2 arrangement (512x480) */
+#define PPU_DEBUG_NT_Y      0
+#define PPU_DEBUG_PT_X      512             /* Pattern tables side by side, greyscale (256x128) */
+#define PPU_DEBUG_PT_Y      0
+#define PPU_DEBUG_OAM_X     512             /* The 64 sprites, 8 to a row in 32x16 cells (256x128) */
+#define PPU_DEBUG_OAM_Y     128
+#define PPU_DEBUG_PAL_X     512             /* Palette RAM, BG then FG, in 16x16 swatches (256x32) */
+#define PPU_DEBUG_PAL_Y     264
+
+/* PPU memory as it was at the end of a frame */
+typedef struct _PPU_debug_snapshot
+{
+    uint8_t     chr[8][0x400];              /* Pattern tables, page by page */
+    uint8_t     nametable[4][0x400];        /* Nametables after mirroring */
+    uint8_t     oam[256];
+    uint8_t     palette[32];
+    uint8_t     ctrl;
+    uint32_t    frame;
+}
+_PPU_debug_snapshot;
+
+typedef struct _PPU_debug
+{
+    bool                enabled;
+    bool                window,             /* Show the view in a window, see PPU_debug_present() */
+                        dump;               /* Save the view of every snapshot to a BMP file */
+    uint8_t             every;              /* Take a snapshot every Nth frame */
+
+    _PPU_debug_snapshot snapshot;
+    atomic_bool         busy,               /* The snapshot (or the view made from it) is still in use */
+                        ready;              /* A new view is waiting for the window */
+    uint32_t            view[PPU_DEBUG_WIDTH * PPU_DEBUG_HEIGHT];
+
+    SDL_Thread          * thread;
+    SDL_sem             * taken;            /* Posted for every snapshot */
+    atomic_bool         stop;
+}
+_PPU_debug;
+_PPU_debug PPU_debug;
+
+/* Snapshot the PPU at the end of a frame, runs on the thread that runs the PPU */
+static void PPU_debug_frame_end()
+{
+    if (nes_ppu.frame % PPU_debug.every != 0 || atomic_load_explicit(&PPU_debug.busy, memory_order_acquire))
+        return;
+
+    _PPU_debug_snapshot * snap = &PPU_debug.snapshot;
+
+    for (size_t i = 0; i < 8; i++)
+        memcpy(snap->chr[i], nes_ppu_bus.page[i], 0x400);
+    for (size_t i = 0; i < 4; i++)
+        memcpy(snap->nametable[i], nes_ppu_bus.page[8 | i], 0x400);
+    memcpy(snap->oam, nes_ppu.PPU_OAM_Bytes, 256);
+    memcpy(snap->palette, nes_ppu.PPU_Pallete_Data[0], 32);
+    snap->ctrl  = nes_ppu.PPU_registers[PPUCTRL];
+    snap->frame = nes_ppu.frame;
+
+    atomic_store_explicit(&PPU_debug.busy, true, memory_order_relaxed);
+    SDL_SemPost(PPU_debug.taken);
+}
+
+/* Color index (0-3) of pixel 'x' of row 'row' of tile 'tile' in pattern table 'pt_i' */
+static inline uint8_t PPU_debug_tile_pixel(const _PPU_debug_snapshot * snap, uint8_t pt_i, uint8_t tile, uint8_t row, uint8_t x)
+{
+    const uint8_t * t = &snap->chr[(pt_i << 2) | (tile >> 6)][(uint16_t)(tile & 0x3F) << 4];
+    return ((t[row] >> (7 - x)) & 0x1) | (((t[8 + row] >> (7 - x)) & 0x1) << 1);
+}
+
+/* Color of palette RAM entry 'i', entry 0 of every palette is the backdrop */
+static inline uint32_t PPU_debug_color(const _PPU_debug_snapshot * snap, uint8_t i)
+{
+    return 0xFF000000 | NES_palette[snap->palette[(i & 0x3) ? i : 0] & 0x3F];
+}
+
+static inline void PPU_debug_fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint32_t color)
+{
+    for (uint16_t j = 0; j < h; j++)
+        for (uint16_t i = 0; i < w; i++)
+            PPU_debug.view[(y + j) * PPU_DEBUG_WIDTH + x + i] = color;
+}
+
+/* Draw the four nametables with the background pattern table and the palettes */
+static inline void PPU_debug_draw_nametables(const _PPU_debug_snapshot * snap)
+{
+    uint8_t pt_i = (snap->ctrl & 0x10) >> 4;
+
+    for (uint8_t nt = 0; nt < 4; nt++)
+    {
+        const uint8_t * nametable = snap->nametable[nt];
+        uint16_t nt_x = PPU_DEBUG_NT_X + (nt & 0x1) * 256,
+                 nt_y = PPU_DEBUG_NT_Y + (nt >> 1) * 240;
+
+        for (uint8_t row = 0; row < 30; row++)
+            for (uint8_t col = 0; col < 32; col++)
+            {
+                uint8_t tile    = nametable[(row << 5) | col],
+                        attrib  = nametable[0x3C0 | ((row >> 2) << 3) | (col >> 2)],
+                        pal     = ((attrib >> (((row & 0x2) << 1) | (col & 0x2))) & 0x3) << 2;
+
+                for (uint8_t y = 0; y < 8; y++)
+                {
+                    uint32_t * out = &PPU_debug.view[(nt_y + (row << 3) + y) * PPU_DEBUG_WIDTH + nt_x + (col << 3)];
+                    for (uint8_t x = 0; x < 8; x++)
+                        out[x] = PPU_debug_color(snap, pal | PPU_debug_tile_pixel(snap, pt_i, tile, y, x));
+                }
+            }
+    }
+}
+
+/* Draw both pattern tables, 16x16 tiles each */
+static inline void PPU_debug_draw_pattern_tables(const _PPU_debug_snapshot * snap)
+{
+    const uint32_t gray_scale_pix[] = {
+        0xFF000000,
+        0xFF444444,
+        0xFFCCCCCC,
+        0xFFFFFFFF
+    };
+
+    for (uint8_t pt_i = 0; pt_i < 2; pt_i++)
+        for (uint16_t y = 0; y < 128; y++)
+        {
+            uint32_t * out = &PPU_debug.view[(PPU_DEBUG_PT_Y + y) * PPU_DEBUG_WIDTH + PPU_DEBUG_PT_X + pt_i * 128];
+            for (uint16_t x = 0; x < 128; x++)
+                out[x] = gray_scale_pix[PPU_debug_tile_pixel(snap, pt_i, ((y >> 3) << 4) | (x >> 3), y & 0x7, x & 0x7)];
+        }
+}
+
+/* Draw the 64 sprites of OAM in their own cells, flipped and colored like on screen */
+static inline void PPU_debug_draw_oam(const _PPU_debug_snapshot * snap)
+{
+    uint8_t height = (snap->ctrl & 0x20) ? 16 : 8;
+
+    PPU_debug_fill(PPU_DEBUG_OAM_X, PPU_DEBUG_OAM_Y, 256, 128, PPU_debug_color(snap, 0));
+
+    for (uint8_t i = 0; i < 64; i++)
+    {
+        uint8_t tile    = snap->oam[(i << 2) + 1],
+                attrib  = snap->oam[(i << 2) + 2],
+                pt_i    = (snap->ctrl & 0x08) >> 3;
+        uint16_t cell_x = PPU_DEBUG_OAM_X + (i & 0x7) * 32 + 12,
+                 cell_y = PPU_DEBUG_OAM_Y + (i >> 3) * 16;
+
+        /* 8x16 sprites take the pattern table from bit 0 of the tile number */
+        if (height == 16)
+        {
+            pt_i = tile & 0x1;
+            tile &= 0xFE;
+        }
+
+        for (uint8_t y = 0; y < height; y++)
+        {
+            uint8_t row = (attrib & 0x80) ? height - 1 - y : y;
+            uint32_t * out = &PPU_debug.view[(cell_y + y) * PPU_DEBUG_WIDTH + cell_x];
+
+            for (uint8_t x = 0; x < 8; x++)
+            {
+                uint8_t pix = PPU_debug_tile_pixel(snap, pt_i, tile + (row >> 3), row & 0x7, (attrib & 0x40) ? 7 - x : x);
+                if (pix)
+                    out[x] = PPU_debug_color(snap, 0x10 | ((attrib & 0x3) << 2) | pix);
+            }
+        }
+    }
+}
+
+/* Draw palette RAM as it is stored (the backdrop mirrors show what was written to them) */
+static inline void PPU_debug_draw_palettes(const _PPU_debug_snapshot * snap)
+{
+    for (uint8_t i = 0; i < 32; i++)
+        PPU_debug_fill(PPU_DEBUG_PAL_X + (i & 0xF) * 16, PPU_DEBUG_PAL_Y + (i >> 4) * 16, 16, 16,
+                       0xFF000000 | NES_palette[snap->palette[i] & 0x3F]);
+}
+
+/* Save the view to "ppu_debug_<frame>.bmp" */
+static inline void PPU_debug_save(uint32_t frame)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "ppu_debug_%06u.bmp", frame);
+
+    SDL_Surface * surface = SDL_CreateRGBSurfaceWithFormatFrom(PPU_debug.view, PPU_DEBUG_WIDTH, PPU_DEBUG_HEIGHT, 32,
+                                                               PPU_DEBUG_WIDTH * sizeof(uint32_t), SDL_PIXELFORMAT_ARGB8888);
+    if (surface == NULL || SDL_SaveBMP(surface, name) != 0)
+        fprintf(stderr, "error: Failed to save %s: %s.\n", name, SDL_GetError());
+    SDL_FreeSurface(surface);
+}
+
+/* Viewer thread, turns every snapshot into a view */
+static int PPU_debug_main(void * data)
+{
+    (void) data;
+
+    while (SDL_SemWait(PPU_debug.taken) == 0 && !atomic_load(&PPU_debug.stop))
+    {
+        const _PPU_debug_snapshot * snap = &PPU_debug.snapshot;
+
+        PPU_debug_draw_nametables(snap);
+        PPU_debug_draw_pattern_tables(snap);
+        PPU_debug_draw_oam(snap);
+        PPU_debug_draw_palettes(snap);
+
+        if (PPU_debug.dump)
+            PPU_debug_save(snap->frame);
+
+        /* The window still has to pick the view up, the next snapshot waits for it */
+        if (PPU_debug.window)
+            atomic_store_explicit(&PPU_debug.ready, true, memory_order_release);
+        else
+            atomic_store_explicit(&PPU_debug.busy, false, memory_order_release);
+    }
+    return 0;
+}
+
+/* Copy a new view (if there is one) to the debug window, from the thread that owns the window */
+static inline void PPU_debug_present(Display * disp)
+{
+    if (!PPU_debug.enabled || !PPU_debug.window || !atomic_load_explicit(&PPU_debug.ready, memory_order_acquire))
+        return;
+
+    push_frame_to_display(disp, PPU_debug.view, PPU_DEBUG_WIDTH * sizeof(uint32_t));
+    update_display(disp);
+
+    atomic_store_explicit(&PPU_debug.ready, false, memory_order_relaxed);
+    atomic_store_explicit(&PPU_debug.busy, false, memory_order_release);
+}
+
+/*
+Start the debug viewers, snapshots are taken every 'every' frames and shown in a window
+(which the caller creates, PPU_DEBUG_WIDTH x PPU_DEBUG_HEIGHT) and/or saved as BMP files
+*/
+static inline bool PPU_debug_start(bool window, bool dump, uint8_t every)
+{
+    PPU_debug.window    = window;
+    PPU_debug.dump      = dump;
+    PPU_debug.every     = every ? every : 1;
+    atomic_store(&PPU_debug.busy, false);
+    atomic_store(&PPU_debug.ready, false);
+    atomic_store(&PPU_debug.stop, false);
+
+    PPU_debug.taken     = SDL_CreateSemaphore(0);
+    PPU_debug.thread    = PPU_debug.taken ? SDL_CreateThread(PPU_debug_main, "PPU debug", NULL) : NULL;
+    if (PPU_debug.thread == NULL)
+    {
+        fprintf(stderr, "error: Failed to start the PPU debug viewer: %s.\n", SDL_GetError());
+        SDL_DestroySemaphore(PPU_debug.taken);
+        return false;
+    }
+
+    PPU_debug.enabled   = true;
+    PPU_frame_end_hook  = PPU_debug_frame_end;
+    return true;
+}
+
+/* Stop the debug viewers (the PPU must not be running on another thread) */
+static inline void PPU_debug_stop()
+{
+    if (!PPU_debug.enabled)
+        return;
+
+    PPU_frame_end_hook = NULL;
+    atomic_store(&PPU_debug.stop, true);
+    SDL_SemPost(PPU_debug.taken);
+    SDL_WaitThread(PPU_debug.thread, NULL);
+    SDL_DestroySemaphore(PPU_debug.taken);
+    PPU_debug.enabled = false;
+}
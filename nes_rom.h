@@ -0,0 +1,92 @@
+#pragma once
+
+/*
+    nes_rom.h: ROM images, mapped straight from their files
+
+    A ROM file is mapped read-only and the cartridge's PRG-ROM and CHR-ROM point into the
+    mapping, nothing is copied (writes to ROM never reach it: $8000-$FFFF goes to the
+    mapper, CHR-ROM writes are dropped). Nothing is read up front, pages come in as the
+    CPU and PPU get to them (where there's no mmap the file is read in whole), and
+    processes running the same ROM share them through the page cache.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#define NES_ROM_HEADER_SIZE     16
+
+typedef struct _nes_rom_image
+{
+    const uint8_t   * data;                     /* The whole file */
+    size_t          size;
+}
+_nes_rom_image;
+_nes_rom_image nes_rom_image;
+
+/* Map the file at 'path' into memory (read it in where there's no mmap), NULL on failure */
+static inline const uint8_t * nes_rom_map(const char * path, size_t size)
+{
+#if !defined(_WIN32)
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    void * data = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return (data == MAP_FAILED) ? NULL : data;
+#else
+    FILE    * f     = fopen(path, "rb");
+    uint8_t * data  = malloc(size);
+
+    if (f == NULL || data == NULL || fread(data, 1, size, f) != size)
+    {
+        free(data);
+        data = NULL;
+    }
+    if (f != NULL)
+        fclose(f);
+
+    return data;
+#endif
+}
+
+/* Open the ROM image at 'path' */
+static inline const _nes_rom_image * nes_rom_open(const char * path)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+    {
+        fprintf(stderr, "error: failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (st.st_size < NES_ROM_HEADER_SIZE)
+    {
+        fprintf(stderr, "error: %s is too small to be a ROM.\n", path);
+        return NULL;
+    }
+
+    const uint8_t * data = nes_rom_map(path, (size_t) st.st_size);
+    if (data == NULL)
+    {
+        fprintf(stderr, "error: failed to map %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    nes_rom_image = (_nes_rom_image){
+        .data   = data,
+        .size   = (size_t) st.st_size
+    };
+
+    return &nes_rom_image;
+}